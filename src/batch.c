@@ -0,0 +1,170 @@
+#include "batch.h"
+#include "sd_block.h"
+#include "write_plan.h"
+#include "hardware/gpio.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+    bool valid;
+    uint32_t last_used;             // Card number, for LRU eviction
+    format_plan_t fp;
+} batch_plan_slot_t;
+
+typedef struct {
+    sd_block_dev_t* dev;
+    int card_detect_pin;
+    batch_stats_t stats;
+    batch_plan_slot_t plan_cache[BATCH_PLAN_CACHE_SIZE];
+} batch_station_t;
+
+typedef struct {
+    bool passed;
+    const char* reason;
+    uint32_t blocks;
+    uint32_t au_sectors;
+    uint32_t serial;
+    uint32_t init_ms;
+    uint32_t plan_ms;
+    uint32_t write_ms;
+} batch_result_t;
+
+static batch_station_t stations[SD_BLOCK_SLOTS];
+static const int card_detect_pins[SD_BLOCK_SLOTS] = {
+    BATCH_CARD_DETECT_PIN, BATCH_CARD_DETECT_PIN_SLOT1
+};
+
+static uint32_t batch_elapsed_ms(uint64_t start_us) {
+    return (uint32_t)((time_us_64() - start_us) / 1000);
+}
+
+static bool batch_slot_occupied(batch_station_t* station) {
+    if (station->card_detect_pin >= 0) {
+        return !gpio_get(station->card_detect_pin);
+    }
+    return sd_block_card_present(station->dev);
+}
+
+// Wait until the slot reads as wanted for BATCH_DEBOUNCE_POLLS polls in a row
+static void batch_wait_for_slot(batch_station_t* station, bool occupied) {
+    int stable = 0;
+    while (stable < BATCH_DEBOUNCE_POLLS) {
+        stable = (batch_slot_occupied(station) == occupied) ? stable + 1 : 0;
+        sleep_ms(BATCH_POLL_INTERVAL_MS);
+    }
+}
+
+// Return the cached plan for this geometry, compiling it on a miss
+static format_plan_t* batch_get_plan(batch_station_t* station, const format_options_t* options,
+                                     uint32_t blocks, uint32_t au_sectors) {
+    batch_plan_slot_t* victim = &station->plan_cache[0];
+
+    for (int i = 0; i < BATCH_PLAN_CACHE_SIZE; i++) {
+        batch_plan_slot_t* slot = &station->plan_cache[i];
+        if (slot->valid && slot->fp.total_sectors == blocks && slot->fp.au_sectors == au_sectors) {
+            slot->last_used = station->stats.cards;
+            station->stats.plan_cache_hits++;
+            printf("Slot %u: using cached format plan for %u blocks\n", station->dev->index, blocks);
+            return &slot->fp;
+        }
+        if (!slot->valid || (victim->valid && slot->last_used < victim->last_used)) {
+            victim = slot;
+        }
+    }
+
+    victim->valid = false;
+    if (sd_formatter_build_plan(&victim->fp, options, blocks, au_sectors) != 0) {
+        return NULL;
+    }
+    victim->valid = true;
+    victim->last_used = station->stats.cards;
+    station->stats.plans_built++;
+    return &victim->fp;
+}
+
+static void batch_format_card(batch_station_t* station, const format_options_t* options,
+                              batch_result_t* result) {
+    sd_block_dev_t* dev = station->dev;
+    uint64_t start_us = time_us_64();
+
+    if (sd_block_attach(dev) != 0) {
+        result->reason = "init";
+        return;
+    }
+    uint8_t cid[16];
+    if (sd_block_read_cid(dev, cid) != 0) {
+        result->reason = "cid";
+        return;
+    }
+    result->blocks = sd_block_get_block_count(dev);
+    result->au_sectors = sd_block_au_sectors(dev);
+    result->serial = (uint32_t)cid[9] << 24 | (uint32_t)cid[10] << 16 |
+                     (uint32_t)cid[11] << 8 | cid[12];
+    result->init_ms = batch_elapsed_ms(start_us);
+
+    start_us = time_us_64();
+    format_plan_t* fp = batch_get_plan(station, options, result->blocks, result->au_sectors);
+    if (!fp) {
+        result->reason = "plan";
+        return;
+    }
+    sd_formatter_stamp_ids(fp, cid);
+    result->plan_ms = batch_elapsed_ms(start_us);
+
+    start_us = time_us_64();
+    write_plan_report_t report;
+    if (write_plan_execute(&fp->plan, dev, options->dry_run, &report) != 0) {
+        result->reason = "write";
+        return;
+    }
+    result->write_ms = batch_elapsed_ms(start_us);
+
+    result->passed = true;
+    result->reason = options->dry_run ? "dry-run" : "ok";
+}
+
+void batch_run(int slot, const format_options_t* options) {
+    batch_station_t* station = &stations[slot];
+    station->dev = sd_block_slot(slot);
+    station->card_detect_pin = card_detect_pins[slot];
+    memset(&station->stats, 0, sizeof(station->stats));
+
+    if (station->card_detect_pin >= 0) {
+        gpio_init(station->card_detect_pin);
+        gpio_set_dir(station->card_detect_pin, GPIO_IN);
+        gpio_pull_up(station->card_detect_pin);
+    }
+
+    batch_stats_t* stats = &station->stats;
+    printf("\n=== BATCH MODE (slot %d) ===\n", slot);
+    printf("%s, %s, label '%s'%s\n",
+           sd_formatter_get_partition_table_name(options->partition_table),
+           sd_formatter_get_filesystem_name(options->filesystem),
+           options->volume_label, options->dry_run ? " (DRY RUN)" : "");
+
+    while (1) {
+        printf("\nSlot %d: insert card %u...\n", slot, stats->cards + 1);
+        batch_wait_for_slot(station, true);
+        stats->cards++;
+
+        batch_result_t result = { false, "", 0, 0, 0, 0, 0, 0 };
+        batch_format_card(station, options, &result);
+
+        if (result.passed) {
+            stats->passed++;
+        } else {
+            stats->failed++;
+        }
+        printf("BATCH,%d,%u,%s,%u,%u,%08X,%u,%u,%u,%s\n",
+               slot, stats->cards, result.passed ? "PASS" : "FAIL",
+               result.blocks, result.au_sectors, result.serial,
+               result.init_ms, result.plan_ms, result.write_ms, result.reason);
+        printf("Slot %d totals: %u passed, %u failed, %u plan(s) built, %u reused\n",
+               slot, stats->passed, stats->failed, stats->plans_built, stats->plan_cache_hits);
+
+        printf("Slot %d: remove card %u\n", slot, stats->cards);
+        batch_wait_for_slot(station, false);
+        sd_block_detach(station->dev);
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include "sd_formatter.h"
+
+// Production batch mode: format card after card with the same options.
+//
+// Cards are detected by polling the slot (or a card-detect switch), the
+// format plan is compiled once per (capacity, allocation unit) pair and
+// reused, and every card ends with one log line on the serial console:
+//
+//   BATCH,<slot>,<n>,<PASS|FAIL>,<blocks>,<au>,<cid serial>,<init ms>,<plan ms>,<write ms>,<reason>
+
+// Optional card-detect switches (active low); -1 polls the card instead
+#ifndef BATCH_CARD_DETECT_PIN
+#define BATCH_CARD_DETECT_PIN -1
+#endif
+#ifndef BATCH_CARD_DETECT_PIN_SLOT1
+#define BATCH_CARD_DETECT_PIN_SLOT1 -1
+#endif
+
+#define BATCH_PLAN_CACHE_SIZE 4
+#define BATCH_POLL_INTERVAL_MS 250
+#define BATCH_DEBOUNCE_POLLS 3
+
+typedef struct {
+    uint32_t cards;
+    uint32_t passed;
+    uint32_t failed;
+    uint32_t plans_built;
+    uint32_t plan_cache_hits;
+} batch_stats_t;
+
+// Run the station for one slot; never returns. Each slot keeps its own plan
+// cache, so two slots can run at the same time, one per core.
+void batch_run(int slot, const format_options_t* options);
+
+#endif // BATCH_H
@@ -0,0 +1,137 @@
+#include "checkpoint.h"
+#include "host_link.h"
+#include "hardware/flash.h"
+#include "pico/flash.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CHECKPOINT_MAGIC 0x50434453     // "SDCP"
+
+#define CHECKPOINT_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - CHECKPOINT_FLASH_SECTORS * FLASH_SECTOR_SIZE)
+#define CHECKPOINT_SLOTS_PER_SECTOR ((int)(FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE))
+#define CHECKPOINT_SLOTS (CHECKPOINT_FLASH_SECTORS * CHECKPOINT_SLOTS_PER_SECTOR)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    checkpoint_t data;
+    uint32_t crc;                   // CRC-32 of the fields above
+} checkpoint_record_t;
+
+_Static_assert(sizeof(checkpoint_record_t) <= FLASH_PAGE_SIZE, "checkpoint record must fit a flash page");
+
+typedef struct {
+    uint32_t offset;                // Flash offset of the page to program
+    bool erase_sector;
+    const uint8_t* page;
+} checkpoint_flash_op_t;
+
+static uint8_t checkpoint_page[FLASH_PAGE_SIZE];
+
+static const uint8_t* checkpoint_slot(int slot) {
+    return (const uint8_t*)(XIP_BASE + CHECKPOINT_FLASH_OFFSET + slot * FLASH_PAGE_SIZE);
+}
+
+static bool checkpoint_slot_valid(int slot, checkpoint_record_t* record) {
+    memcpy(record, checkpoint_slot(slot), sizeof(*record));
+    return record->magic == CHECKPOINT_MAGIC &&
+           record->crc == host_link_crc32(0, record, offsetof(checkpoint_record_t, crc));
+}
+
+// True when the count pages from slot on are all 0xFF
+static bool checkpoint_slots_erased(int slot, int count) {
+    const uint8_t* page = checkpoint_slot(slot);
+    for (int i = 0; i < count * (int)FLASH_PAGE_SIZE; i++) {
+        if (page[i] != 0xFF) return false;
+    }
+    return true;
+}
+
+// Slot of the newest valid record, -1 if the ring holds none
+static int checkpoint_find_newest(checkpoint_record_t* newest) {
+    int found = -1;
+    checkpoint_record_t record;
+    for (int slot = 0; slot < CHECKPOINT_SLOTS; slot++) {
+        if (checkpoint_slot_valid(slot, &record) &&
+            (found < 0 || (int32_t)(record.sequence - newest->sequence) > 0)) {
+            *newest = record;
+            found = slot;
+        }
+    }
+    return found;
+}
+
+// Runs with the other core locked out and interrupts off: nothing may
+// execute from flash while it is being erased or programmed
+static void checkpoint_flash_write(void* param) {
+    const checkpoint_flash_op_t* op = (const checkpoint_flash_op_t*)param;
+    if (op->erase_sector) {
+        flash_range_erase(op->offset - op->offset % FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+    }
+    flash_range_program(op->offset, op->page, FLASH_PAGE_SIZE);
+}
+
+bool checkpoint_load(checkpoint_t* cp) {
+    checkpoint_record_t record;
+    if (checkpoint_find_newest(&record) < 0 || record.data.operation == CHECKPOINT_OP_NONE) {
+        return false;
+    }
+    *cp = record.data;
+    return true;
+}
+
+int checkpoint_save(const checkpoint_t* cp) {
+    checkpoint_record_t newest;
+    int slot = checkpoint_find_newest(&newest) + 1;
+    uint32_t sequence = (slot > 0) ? newest.sequence + 1 : 1;
+
+    // Programming can only clear bits: a used page in the middle of a sector
+    // (left by an interrupted save) moves the write to the next sector
+    slot %= CHECKPOINT_SLOTS;
+    if (slot % CHECKPOINT_SLOTS_PER_SECTOR != 0 && !checkpoint_slots_erased(slot, 1)) {
+        slot = (slot / CHECKPOINT_SLOTS_PER_SECTOR + 1) * CHECKPOINT_SLOTS_PER_SECTOR % CHECKPOINT_SLOTS;
+    }
+
+    checkpoint_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.magic = CHECKPOINT_MAGIC;
+    record.sequence = sequence;
+    record.data = *cp;
+    record.crc = host_link_crc32(0, &record, offsetof(checkpoint_record_t, crc));
+
+    memset(checkpoint_page, 0xFF, sizeof(checkpoint_page));
+    memcpy(checkpoint_page, &record, sizeof(record));
+
+    checkpoint_flash_op_t op = {
+        .offset = CHECKPOINT_FLASH_OFFSET + slot * FLASH_PAGE_SIZE,
+        .erase_sector = (slot % CHECKPOINT_SLOTS_PER_SECTOR == 0) &&
+                        !checkpoint_slots_erased(slot, CHECKPOINT_SLOTS_PER_SECTOR),
+        .page = checkpoint_page,
+    };
+    if (flash_safe_execute(checkpoint_flash_write, &op, CHECKPOINT_LOCKOUT_TIMEOUT_MS) != 0) {
+        printf("Checkpoint: flash write failed\n");
+        return -1;
+    }
+
+    checkpoint_record_t check;
+    if (!checkpoint_slot_valid(slot, &check) || check.sequence != sequence) {
+        printf("Checkpoint: verify failed at slot %d\n", slot);
+        return -1;
+    }
+    return 0;
+}
+
+int checkpoint_clear(void) {
+    checkpoint_record_t newest;
+    if (checkpoint_find_newest(&newest) < 0 || newest.data.operation == CHECKPOINT_OP_NONE) {
+        return 0;
+    }
+    checkpoint_t none;
+    memset(&none, 0, sizeof(none));
+    return checkpoint_save(&none);
+}
+
+bool checkpoint_matches_card(const checkpoint_t* cp, const uint8_t cid[16], uint32_t card_blocks) {
+    return cp->card_blocks == card_blocks && memcmp(cp->cid, cid, sizeof(cp->cid)) == 0;
+}
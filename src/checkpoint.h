@@ -0,0 +1,45 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Progress of long card operations, kept in the last sectors of the Pico's
+// flash so an operation interrupted by a power loss or USB reset can resume
+// where it stopped. Each save programs the next 256-byte page of a ring of
+// CHECKPOINT_FLASH_SECTORS sectors; a sector is only erased when the ring
+// wraps onto it, and the newest record (highest sequence number with a
+// valid CRC) always lives in another sector while that happens.
+
+#define CHECKPOINT_FLASH_SECTORS 4
+
+// Upper bound on the time the other core may be held off during a save
+#define CHECKPOINT_LOCKOUT_TIMEOUT_MS 100
+
+typedef enum {
+    CHECKPOINT_OP_NONE = 0,         // No operation in progress
+    CHECKPOINT_OP_SECURE_ERASE = 1
+} checkpoint_op_t;
+
+#define CHECKPOINT_PARAMS 6
+
+typedef struct {
+    uint32_t operation;             // checkpoint_op_t
+    uint8_t cid[16];                // Card the operation was running on
+    uint32_t card_blocks;
+    uint32_t next_lba;              // First block not yet completed
+    uint32_t params[CHECKPOINT_PARAMS]; // Operation specific
+} checkpoint_t;
+
+// Latest checkpoint; false when there is none or the operation finished
+bool checkpoint_load(checkpoint_t* cp);
+
+int checkpoint_save(const checkpoint_t* cp);
+
+// Mark the current operation as finished
+int checkpoint_clear(void);
+
+// Same card: identical CID and capacity
+bool checkpoint_matches_card(const checkpoint_t* cp, const uint8_t cid[16], uint32_t card_blocks);
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,270 @@
+#include "duplicator.h"
+#include "batch.h"
+#include "byte_order.h"
+#include "host_link.h"
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "pico/util/queue.h"
+#include <stdio.h>
+#include <string.h>
+
+// Three buffers: one being read on core 0, one being written on core 1,
+// one in flight between them
+#define DUPLICATOR_BUFFERS 3
+#define DUPLICATOR_BUFFER_DONE 0xFF
+#define DUPLICATOR_POLL_INTERVAL_MS 250
+#define DUPLICATOR_DEBOUNCE_POLLS 3
+
+typedef struct {
+    uint32_t lba;
+    uint32_t count;
+    uint8_t data[DUPLICATOR_CHUNK_BLOCKS * SD_BLOCK_SIZE];
+} clone_buffer_t;
+
+static clone_buffer_t clone_buffers[DUPLICATOR_BUFFERS];
+static queue_t clone_free_queue;
+static queue_t clone_full_queue;
+
+// Owned by core 1 while a clone runs
+static sd_block_dev_t* clone_target;
+static volatile int clone_write_status;
+
+static const format_options_t* core1_options;
+
+static void duplicator_clone_core1_entry(void) {
+    while (true) {
+        uint8_t index;
+        queue_remove_blocking(&clone_full_queue, &index);
+
+        // After a failed write keep draining so core 0 never blocks
+        if (index != DUPLICATOR_BUFFER_DONE && clone_write_status == 0) {
+            clone_buffer_t* buffer = &clone_buffers[index];
+            if (sd_block_write_blocks(clone_target, buffer->lba, buffer->count, buffer->data) != 0) {
+                printf("Clone: write failed at LBA %u\n", buffer->lba);
+                clone_write_status = -1;
+            }
+        }
+
+        queue_add_blocking(&clone_free_queue, &index);
+        if (index == DUPLICATOR_BUFFER_DONE) {
+            return;
+        }
+    }
+}
+
+// A GPT copied onto a larger card still ends where the master did: move the
+// backup entries and header to the end of the target, point the primary
+// header at them and widen the protective MBR. Runs after core 1 is done, so
+// the clone buffers serve as scratch.
+static int duplicator_relocate_gpt(sd_block_dev_t* target, uint32_t master_blocks) {
+    uint32_t target_blocks = sd_block_get_block_count(target);
+    uint8_t* header = clone_buffers[0].data;
+    uint8_t* chunk = clone_buffers[1].data;
+
+    if (sd_block_read_blocks(target, 1, 1, header) != 0) {
+        return -1;
+    }
+    if (memcmp(header, "EFI PART", 8) != 0) {
+        return 0;
+    }
+
+    uint32_t header_size = le32_get(header + 12);
+    uint64_t entries_lba = le64_get(header + 72);
+    uint32_t entry_bytes = le32_get(header + 80) * le32_get(header + 84);
+    uint32_t entry_sectors = (entry_bytes + SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE;
+    if (header_size < 92 || header_size > SD_BLOCK_SIZE || entry_sectors == 0 ||
+        entries_lba + entry_sectors > master_blocks || entry_sectors + 3 > target_blocks) {
+        printf("Clone: master GPT header is invalid, backup GPT not moved\n");
+        return -1;
+    }
+
+    uint32_t backup_entries_lba = target_blocks - 1 - entry_sectors;
+    for (uint32_t done = 0; done < entry_sectors; done += DUPLICATOR_CHUNK_BLOCKS) {
+        uint32_t count = entry_sectors - done;
+        if (count > DUPLICATOR_CHUNK_BLOCKS) count = DUPLICATOR_CHUNK_BLOCKS;
+        if (sd_block_read_blocks(target, (uint32_t)entries_lba + done, count, chunk) != 0 ||
+            sd_block_write_blocks(target, backup_entries_lba + done, count, chunk) != 0) {
+            return -1;
+        }
+    }
+
+    // Primary header: same entries, new backup location and usable range
+    le64_put(header + 32, target_blocks - 1);
+    le64_put(header + 48, backup_entries_lba - 1);
+    le32_put(header + 16, 0);
+    le32_put(header + 16, host_link_crc32(0, header, header_size));
+    if (sd_block_write_blocks(target, 1, 1, header) != 0) {
+        return -1;
+    }
+
+    // Backup header: mirrored locations
+    le64_put(header + 24, target_blocks - 1);
+    le64_put(header + 32, 1);
+    le64_put(header + 72, backup_entries_lba);
+    le32_put(header + 16, 0);
+    le32_put(header + 16, host_link_crc32(0, header, header_size));
+    if (sd_block_write_blocks(target, target_blocks - 1, 1, header) != 0) {
+        return -1;
+    }
+
+    // The master's backup header now sits past the last partition; clear it
+    // so no tool mistakes it for the real one
+    memset(chunk, 0, SD_BLOCK_SIZE);
+    if (sd_block_write_blocks(target, master_blocks - 1, 1, chunk) != 0) {
+        return -1;
+    }
+
+    if (sd_block_read_blocks(target, 0, 1, header) != 0) {
+        return -1;
+    }
+    if (header[510] == 0x55 && header[511] == 0xAA && header[446 + 4] == 0xEE) {
+        le32_put(header + 446 + 12, target_blocks - 1);
+        if (sd_block_write_blocks(target, 0, 1, header) != 0) {
+            return -1;
+        }
+    }
+
+    printf("Clone: backup GPT moved to the end of the larger target (LBA %u)\n", target_blocks - 1);
+    return 0;
+}
+
+int duplicator_clone(sd_block_dev_t* source, sd_block_dev_t* target,
+                     duplicator_clone_stats_t* stats) {
+    duplicator_clone_stats_t result;
+    memset(&result, 0, sizeof(result));
+
+    uint32_t total = sd_block_get_block_count(source);
+    if (!sd_block_is_attached(source) || !sd_block_is_attached(target) ||
+        sd_block_get_block_count(target) < total) {
+        printf("Clone: target card is missing or smaller than the master\n");
+        result.status = -1;
+        if (stats) *stats = result;
+        return -1;
+    }
+
+    uint64_t start_us = time_us_64();
+
+    queue_init(&clone_free_queue, sizeof(uint8_t), DUPLICATOR_BUFFERS + 1);
+    queue_init(&clone_full_queue, sizeof(uint8_t), DUPLICATOR_BUFFERS + 1);
+    for (uint8_t i = 0; i < DUPLICATOR_BUFFERS; i++) {
+        queue_add_blocking(&clone_free_queue, &i);
+    }
+    clone_target = target;
+    clone_write_status = 0;
+
+    multicore_reset_core1();
+    multicore_launch_core1(duplicator_clone_core1_entry);
+
+    int read_status = 0;
+    uint32_t lba = 0;
+    while (lba < total && clone_write_status == 0) {
+        uint8_t index;
+        queue_remove_blocking(&clone_free_queue, &index);
+
+        clone_buffer_t* buffer = &clone_buffers[index];
+        buffer->lba = lba;
+        buffer->count = total - lba;
+        if (buffer->count > DUPLICATOR_CHUNK_BLOCKS) buffer->count = DUPLICATOR_CHUNK_BLOCKS;
+
+        if (sd_block_read_blocks(source, lba, buffer->count, buffer->data) != 0) {
+            printf("Clone: read failed at LBA %u\n", lba);
+            read_status = -1;
+            queue_add_blocking(&clone_free_queue, &index);
+            break;
+        }
+        queue_add_blocking(&clone_full_queue, &index);
+        lba += buffer->count;
+    }
+
+    // Drain core 1
+    uint8_t done = DUPLICATOR_BUFFER_DONE;
+    queue_add_blocking(&clone_full_queue, &done);
+    uint8_t index;
+    do {
+        queue_remove_blocking(&clone_free_queue, &index);
+    } while (index != DUPLICATOR_BUFFER_DONE);
+    queue_free(&clone_full_queue);
+    queue_free(&clone_free_queue);
+
+    result.status = (read_status != 0 || clone_write_status != 0) ? -1 : 0;
+    if (result.status == 0 && sd_block_get_block_count(target) > total &&
+        duplicator_relocate_gpt(target, total) != 0) {
+        printf("Clone: could not fix up the GPT on the larger target\n");
+        result.status = -1;
+    }
+    result.blocks_copied = (result.status == 0) ? total : 0;
+    result.elapsed_ms = (uint32_t)((time_us_64() - start_us) / 1000);
+
+    if (stats) *stats = result;
+    return result.status;
+}
+
+// Wait until the slot reads as wanted for DUPLICATOR_DEBOUNCE_POLLS polls in a row
+static void duplicator_wait_for_card(sd_block_dev_t* dev, bool present) {
+    int stable = 0;
+    while (stable < DUPLICATOR_DEBOUNCE_POLLS) {
+        stable = (sd_block_card_present(dev) == present) ? stable + 1 : 0;
+        sleep_ms(DUPLICATOR_POLL_INTERVAL_MS);
+    }
+}
+
+static void duplicator_format_core1_entry(void) {
+    batch_run(1, core1_options);
+}
+
+static void duplicator_run_clone(void) {
+    sd_block_dev_t* master = sd_block_slot(0);
+    sd_block_dev_t* copy = sd_block_slot(1);
+    uint32_t cards = 0;
+    uint32_t passed = 0;
+
+    printf("\n=== DUPLICATOR: CLONE SLOT 0 -> SLOT 1 ===\n");
+
+    while (1) {
+        if (!sd_block_is_attached(master) || !sd_block_card_present(master)) {
+            sd_block_detach(master);
+            printf("Insert master card in slot 0...\n");
+            duplicator_wait_for_card(master, true);
+            if (sd_block_attach(master) != 0) {
+                printf("Master card not usable\n");
+                duplicator_wait_for_card(master, false);
+                continue;
+            }
+        }
+
+        printf("\nInsert card %u in slot 1...\n", cards + 1);
+        duplicator_wait_for_card(copy, true);
+        cards++;
+
+        duplicator_clone_stats_t stats = { -1, 0, 0 };
+        if (sd_block_attach(copy) == 0) {
+            duplicator_clone(master, copy, &stats);
+        }
+        if (stats.status == 0) {
+            passed++;
+        }
+
+        // 512-byte blocks per millisecond * 500 = KiB per second
+        uint32_t kb_per_s = stats.elapsed_ms ?
+            (uint32_t)((uint64_t)stats.blocks_copied * 500 / stats.elapsed_ms) : 0;
+        printf("CLONE,%u,%s,%u,%u,%u\n", cards, stats.status == 0 ? "PASS" : "FAIL",
+               stats.blocks_copied, stats.elapsed_ms, kb_per_s);
+        printf("Totals: %u passed, %u failed\n", passed, cards - passed);
+
+        printf("Remove card %u from slot 1\n", cards);
+        duplicator_wait_for_card(copy, false);
+        sd_block_detach(copy);
+    }
+}
+
+void duplicator_run(duplicator_mode_t mode, const format_options_t* options) {
+    if (mode == DUPLICATOR_CLONE) {
+        duplicator_run_clone();
+    }
+
+    // One batch station per slot, one slot per core
+    core1_options = options;
+    multicore_reset_core1();
+    multicore_launch_core1(duplicator_format_core1_entry);
+    batch_run(0, options);
+}
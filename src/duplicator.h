@@ -0,0 +1,41 @@
+#ifndef DUPLICATOR_H
+#define DUPLICATOR_H
+
+#include <stdint.h>
+#include "sd_block.h"
+#include "sd_formatter.h"
+
+// Two-slot duplicator: slot 0 on spi0 and slot 1 on spi1, each driven from
+// its own core so neither card waits for the other's SPI transfers.
+//
+// DUPLICATOR_FORMAT runs an independent batch station per slot (core 0 for
+// slot 0, core 1 for slot 1), so cards can be swapped in either slot at any
+// time. DUPLICATOR_CLONE keeps a master card in slot 0 and copies it block
+// for block onto every card inserted in slot 1, with core 0 reading the
+// master while core 1 writes the previous chunk to the copy.
+
+typedef enum {
+    DUPLICATOR_FORMAT = 1,
+    DUPLICATOR_CLONE = 2
+} duplicator_mode_t;
+
+// Blocks per clone transfer (one multi-block read and one multi-block write)
+#define DUPLICATOR_CHUNK_BLOCKS 16
+
+typedef struct {
+    int32_t status;                 // 0 on success
+    uint32_t blocks_copied;
+    uint32_t elapsed_ms;
+} duplicator_clone_stats_t;
+
+// Copy every block of the source card to the start of the target card;
+// both slots must be attached and the target at least as large. On a larger
+// target a GPT master's backup header and entries are moved to the target's
+// last blocks, so the copy's GPT describes the card it is on
+int duplicator_clone(sd_block_dev_t* source, sd_block_dev_t* target,
+                     duplicator_clone_stats_t* stats);
+
+// Never returns
+void duplicator_run(duplicator_mode_t mode, const format_options_t* options);
+
+#endif // DUPLICATOR_H
@@ -0,0 +1,206 @@
+#include "exfat_volume.h"
+#include "byte_order.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+#include <string.h>
+
+#define EXFAT_CACHE_INVALID     0xFFFFFFFF
+#define EXFAT_BAD_CLUSTER       0xFFFFFFF7
+
+#define EXFAT_ENTRY_SIZE        32
+#define EXFAT_ENTRY_END         0x00
+#define EXFAT_ENTRY_BITMAP      0x81
+
+// Root directory entries searched for the allocation bitmap
+#define EXFAT_BITMAP_SEARCH_ENTRIES 256
+
+static uint32_t exfat_scan_buffer[EXFAT_VOLUME_SCAN_SECTORS * SD_BLOCK_SIZE / 4];
+
+uint32_t exfat_volume_cluster_sectors(const exfat_volume_t* vol) {
+    return 1u << vol->sectors_per_cluster_shift;
+}
+
+uint32_t exfat_volume_cluster_lba(const exfat_volume_t* vol, uint32_t cluster) {
+    return vol->heap_lba + ((cluster - EXFAT_FIRST_CLUSTER) << vol->sectors_per_cluster_shift);
+}
+
+bool exfat_volume_is_end(const exfat_volume_t* vol, uint32_t value) {
+    return value >= EXFAT_BAD_CLUSTER || value < EXFAT_FIRST_CLUSTER ||
+           value >= vol->cluster_count + EXFAT_FIRST_CLUSTER;
+}
+
+int exfat_volume_get_entry(exfat_volume_t* vol, uint32_t cluster, uint32_t* value) {
+    if (cluster >= vol->cluster_count + EXFAT_FIRST_CLUSTER) {
+        return -1;
+    }
+
+    uint32_t sector = cluster / (SD_BLOCK_SIZE / 4);
+    if (sector >= vol->fat_length) {
+        return -1;
+    }
+    if (vol->cached_sector != sector) {
+        if (sd_block_read_blocks(vol->dev, vol->fat_lba + sector, 1, vol->cache) != 0) {
+            vol->cached_sector = EXFAT_CACHE_INVALID;
+            return -1;
+        }
+        vol->cached_sector = sector;
+    }
+
+    *value = le32_get(vol->cache + (cluster % (SD_BLOCK_SIZE / 4)) * 4);
+    return 0;
+}
+
+int exfat_volume_next_run(exfat_volume_t* vol, uint32_t cluster, uint32_t* run_length, uint32_t* next) {
+    uint32_t length = 0;
+    uint32_t value;
+
+    do {
+        if (exfat_volume_get_entry(vol, cluster + length, &value) != 0) {
+            return -1;
+        }
+        length++;
+    } while (value == cluster + length && !exfat_volume_is_end(vol, value));
+
+    *run_length = length;
+    *next = value;
+    return 0;
+}
+
+// Walk the start of the root directory for the first allocation bitmap entry
+static int exfat_volume_find_bitmap(exfat_volume_t* vol) {
+    uint8_t sector[SD_BLOCK_SIZE];
+    uint32_t cluster = vol->root_cluster;
+    uint32_t entries = 0;
+
+    while (!exfat_volume_is_end(vol, cluster) && entries < EXFAT_BITMAP_SEARCH_ENTRIES) {
+        uint32_t lba = exfat_volume_cluster_lba(vol, cluster);
+        for (uint32_t s = 0; s < exfat_volume_cluster_sectors(vol); s++) {
+            if (sd_block_read_blocks(vol->dev, lba + s, 1, sector) != 0) {
+                return -1;
+            }
+            for (uint32_t i = 0; i < SD_BLOCK_SIZE; i += EXFAT_ENTRY_SIZE, entries++) {
+                const uint8_t* entry = sector + i;
+                if (entry[0] == EXFAT_ENTRY_END || entries >= EXFAT_BITMAP_SEARCH_ENTRIES) {
+                    return -1;
+                }
+                // BitmapFlags bit 0 selects the bitmap of the second FAT
+                if (entry[0] == EXFAT_ENTRY_BITMAP && (entry[1] & 0x01) == 0) {
+                    vol->bitmap_cluster = le32_get(entry + 20);
+                    vol->bitmap_length = le64_get(entry + 24);
+                    return 0;
+                }
+            }
+        }
+        if (exfat_volume_get_entry(vol, cluster, &cluster) != 0) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+int exfat_volume_mount(sd_block_dev_t* dev, uint32_t start_lba, exfat_volume_t* vol) {
+    uint8_t boot[SD_BLOCK_SIZE];
+
+    memset(vol, 0, sizeof(*vol));
+    vol->dev = dev;
+    vol->cached_sector = EXFAT_CACHE_INVALID;
+
+    if (sd_block_read_blocks(dev, start_lba, 1, boot) != 0) {
+        return -1;
+    }
+    if (memcmp(boot + 3, "EXFAT   ", 8) != 0 || boot[510] != 0x55 || boot[511] != 0xAA) {
+        return -1;
+    }
+
+    // Only 512-byte sectors occur on SD cards
+    uint8_t bytes_per_sector_shift = boot[108];
+    vol->sectors_per_cluster_shift = boot[109];
+    if (bytes_per_sector_shift != 9 || vol->sectors_per_cluster_shift > 16) {
+        return -1;
+    }
+
+    vol->start_lba = start_lba;
+    vol->volume_length = le64_get(boot + 72);
+    vol->fat_lba = start_lba + le32_get(boot + 80);
+    vol->fat_length = le32_get(boot + 84);
+    vol->heap_lba = start_lba + le32_get(boot + 88);
+    vol->cluster_count = le32_get(boot + 92);
+    vol->root_cluster = le32_get(boot + 96);
+    vol->serial = le32_get(boot + 100);
+    vol->percent_in_use = boot[112];
+
+    if (vol->fat_length == 0 || vol->cluster_count == 0 ||
+        (uint64_t)vol->fat_length * (SD_BLOCK_SIZE / 4) < vol->cluster_count + EXFAT_FIRST_CLUSTER ||
+        exfat_volume_is_end(vol, vol->root_cluster)) {
+        return -1;
+    }
+
+    if (exfat_volume_find_bitmap(vol) != 0 ||
+        vol->bitmap_length * 8 < vol->cluster_count ||
+        exfat_volume_is_end(vol, vol->bitmap_cluster)) {
+        printf("exFAT: allocation bitmap not found\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Set bits in n whole words
+static uint32_t exfat_popcount_words(const uint32_t* w, uint32_t n) {
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        used += (uint32_t)__builtin_popcount(w[i]);
+    }
+    return used;
+}
+
+int exfat_volume_count_used(exfat_volume_t* vol, exfat_volume_usage_t* usage) {
+    uint64_t start_us = time_us_64();
+    memset(usage, 0, sizeof(*usage));
+    usage->percent_in_use = vol->percent_in_use;
+
+    // Bit n of the bitmap is cluster n + 2; only cluster_count bits count
+    uint32_t bits_left = vol->cluster_count;
+    uint32_t cluster = vol->bitmap_cluster;
+    uint32_t used = 0;
+
+    while (bits_left > 0) {
+        if (exfat_volume_is_end(vol, cluster)) {
+            return -1;      // Chain shorter than the bitmap
+        }
+        uint32_t run_length;
+        uint32_t next;
+        if (exfat_volume_next_run(vol, cluster, &run_length, &next) != 0) {
+            return -1;
+        }
+
+        uint32_t lba = exfat_volume_cluster_lba(vol, cluster);
+        uint32_t run_sectors = run_length << vol->sectors_per_cluster_shift;
+        while (run_sectors > 0 && bits_left > 0) {
+            uint32_t n = run_sectors;
+            if (n > EXFAT_VOLUME_SCAN_SECTORS) n = EXFAT_VOLUME_SCAN_SECTORS;
+            uint32_t needed = (bits_left + SD_BLOCK_SIZE * 8 - 1) / (SD_BLOCK_SIZE * 8);
+            if (n > needed) n = needed;
+
+            if (sd_block_read_blocks(vol->dev, lba, n, (uint8_t*)exfat_scan_buffer) != 0) {
+                return -1;
+            }
+
+            uint32_t bits = n * SD_BLOCK_SIZE * 8;
+            if (bits > bits_left) bits = bits_left;
+            uint32_t words = bits / 32;
+            used += exfat_popcount_words(exfat_scan_buffer, words);
+            if (bits % 32) {
+                used += (uint32_t)__builtin_popcount(exfat_scan_buffer[words] & ((1u << (bits % 32)) - 1));
+            }
+
+            bits_left -= bits;
+            lba += n;
+            run_sectors -= n;
+        }
+        cluster = next;
+    }
+
+    usage->used_clusters = used;
+    usage->elapsed_ms = (uint32_t)((time_us_64() - start_us) / 1000);
+    return 0;
+}
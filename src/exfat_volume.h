@@ -0,0 +1,61 @@
+#ifndef EXFAT_VOLUME_H
+#define EXFAT_VOLUME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sd_block.h"
+
+// Read-only access to exFAT volume geometry, the FAT and the allocation bitmap
+
+#define EXFAT_FIRST_CLUSTER 2
+
+// Bitmap sectors per multi-block read when counting used clusters
+#define EXFAT_VOLUME_SCAN_SECTORS 16
+
+// PercentInUse value when the formatter did not record it
+#define EXFAT_PERCENT_UNKNOWN 0xFF
+
+typedef struct {
+    sd_block_dev_t* dev;
+    uint32_t start_lba;             // Boot sector LBA
+    uint64_t volume_length;         // Sectors
+    uint32_t fat_lba;
+    uint32_t fat_length;            // Sectors
+    uint32_t heap_lba;              // Cluster 2
+    uint32_t cluster_count;
+    uint32_t root_cluster;
+    uint8_t sectors_per_cluster_shift;
+    uint8_t percent_in_use;
+    uint32_t serial;
+
+    // First allocation bitmap, located from the root directory at mount
+    uint32_t bitmap_cluster;
+    uint64_t bitmap_length;         // Bytes
+
+    // Single FAT sector cache
+    uint32_t cached_sector;
+    uint8_t cache[SD_BLOCK_SIZE];
+} exfat_volume_t;
+
+typedef struct {
+    uint32_t used_clusters;         // Set bits in the allocation bitmap
+    uint8_t percent_in_use;         // Boot sector hint or EXFAT_PERCENT_UNKNOWN
+    uint32_t elapsed_ms;
+} exfat_volume_usage_t;
+
+// Parse the boot sector at start_lba; returns 0 on a valid exFAT volume
+int exfat_volume_mount(sd_block_dev_t* dev, uint32_t start_lba, exfat_volume_t* vol);
+
+int exfat_volume_get_entry(exfat_volume_t* vol, uint32_t cluster, uint32_t* value);
+
+// Same contract as fat_volume_next_run()
+int exfat_volume_next_run(exfat_volume_t* vol, uint32_t cluster, uint32_t* run_length, uint32_t* next);
+bool exfat_volume_is_end(const exfat_volume_t* vol, uint32_t value);
+
+// Count used clusters with a popcount over the allocation bitmap
+int exfat_volume_count_used(exfat_volume_t* vol, exfat_volume_usage_t* usage);
+
+uint32_t exfat_volume_cluster_lba(const exfat_volume_t* vol, uint32_t cluster);
+uint32_t exfat_volume_cluster_sectors(const exfat_volume_t* vol);
+
+#endif // EXFAT_VOLUME_H
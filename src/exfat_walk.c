@@ -0,0 +1,340 @@
+#include "exfat_walk.h"
+#include "sd_block.h"
+#include "byte_order.h"
+#include <stdio.h>
+#include <string.h>
+
+#define EXFAT_DIR_ENTRY_SIZE    32
+#define EXFAT_DIR_ENTRIES_MAX   (256u * 1024 * 1024 / EXFAT_DIR_ENTRY_SIZE)
+
+#define EXFAT_ENTRY_END         0x00
+#define EXFAT_ENTRY_IN_USE      0x80
+#define EXFAT_ENTRY_SECONDARY   0x40
+#define EXFAT_ENTRY_FILE        0x85
+#define EXFAT_ENTRY_STREAM      0xC0
+#define EXFAT_ENTRY_NAME        0xC1
+
+#define EXFAT_ATTR_DIRECTORY    0x10
+#define EXFAT_FLAG_NO_FAT_CHAIN 0x02
+
+#define EXFAT_NAME_CHARS        15      // UTF-16 units per name entry
+#define EXFAT_NAME_MAX          255
+
+typedef struct {
+    exfat_volume_t* vol;
+    fat_walk_limits_t limits;
+    uint32_t entries;
+    uint32_t bad_sets;
+    bool truncated;
+    int status;
+} exfat_walk_t;
+
+// Position within one directory. Contiguous directories (NoFatChain) are a
+// single run; the others follow the FAT like the root directory does.
+typedef struct {
+    uint32_t lba;                   // Sector holding the current entry
+    uint32_t run_end;               // First LBA past the current run
+    uint32_t next_cluster;          // Cluster following the run, or end of chain
+    uint32_t clusters;              // Clusters visited, bounds corrupt chains
+    uint32_t sectors_left;          // Directory size still to visit
+    uint32_t entries;
+    uint16_t index;                 // Entry within the sector
+    bool contiguous;
+} exfat_dir_iter_t;
+
+// File entry set being collected; the file entry comes first and announces
+// how many secondary entries follow
+typedef struct {
+    bool active;
+    bool broken;                    // Missing or unexpected secondary entry
+    uint8_t secondary_left;
+    uint8_t secondary_seen;
+    uint16_t checksum;
+    uint16_t stored_checksum;
+    uint16_t attributes;
+    bool have_stream;
+    bool contiguous;
+    uint8_t name_length;
+    uint8_t name_count;
+    uint32_t first_cluster;
+    uint64_t data_length;
+    uint16_t name[EXFAT_NAME_MAX + 1];
+} exfat_entry_set_t;
+
+// Shared by every directory level; a parent re-reads its chunk after a
+// child directory has used the buffer
+static uint8_t walk_buffer[EXFAT_WALK_READ_SECTORS * SD_BLOCK_SIZE];
+static uint32_t walk_buffer_lba;
+static uint32_t walk_buffer_count;
+static exfat_entry_set_t walk_set;
+static char walk_name[FAT_WALK_NAME_MAX];
+
+static bool exfat_dir_iter_set_run(exfat_walk_t* walk, exfat_dir_iter_t* it, uint32_t cluster,
+                                   uint32_t run_length) {
+    exfat_volume_t* vol = walk->vol;
+    if (cluster - EXFAT_FIRST_CLUSTER + run_length > vol->cluster_count) {
+        return false;       // Run reaches past the cluster heap
+    }
+    it->lba = exfat_volume_cluster_lba(vol, cluster);
+    it->run_end = it->lba + run_length * exfat_volume_cluster_sectors(vol);
+    return true;
+}
+
+// data_length of 0 means "until the end of the chain" (the root directory)
+static bool exfat_dir_iter_open(exfat_walk_t* walk, exfat_dir_iter_t* it, uint32_t cluster,
+                                uint64_t data_length, bool contiguous) {
+    exfat_volume_t* vol = walk->vol;
+    uint32_t cluster_bytes = exfat_volume_cluster_sectors(vol) * SD_BLOCK_SIZE;
+    memset(it, 0, sizeof(*it));
+
+    if (exfat_volume_is_end(vol, cluster)) {
+        return false;
+    }
+
+    uint64_t max_length = (uint64_t)EXFAT_DIR_ENTRIES_MAX * EXFAT_DIR_ENTRY_SIZE;
+    if (data_length == 0 || data_length > max_length) data_length = max_length;
+    it->sectors_left = (uint32_t)(data_length / SD_BLOCK_SIZE);
+    it->contiguous = contiguous;
+
+    uint32_t run_length;
+    if (contiguous) {
+        run_length = (uint32_t)((data_length + cluster_bytes - 1) / cluster_bytes);
+        it->next_cluster = 0;                   // Never followed
+    } else if (exfat_volume_next_run(vol, cluster, &run_length, &it->next_cluster) != 0) {
+        walk->status = -1;
+        return false;
+    }
+    it->clusters = run_length;
+    return it->sectors_left > 0 && exfat_dir_iter_set_run(walk, it, cluster, run_length);
+}
+
+// Advance to the next sector, crossing to the next run at its end
+static bool exfat_dir_iter_next_sector(exfat_walk_t* walk, exfat_dir_iter_t* it) {
+    exfat_volume_t* vol = walk->vol;
+
+    it->index = 0;
+    if (--it->sectors_left == 0) {
+        return false;
+    }
+    if (++it->lba < it->run_end) {
+        return true;
+    }
+    if (it->contiguous || exfat_volume_is_end(vol, it->next_cluster)) {
+        return false;
+    }
+
+    uint32_t cluster = it->next_cluster;
+    uint32_t run_length;
+    if (exfat_volume_next_run(vol, cluster, &run_length, &it->next_cluster) != 0) {
+        walk->status = -1;
+        return false;
+    }
+    it->clusters += run_length;
+    if (it->clusters > vol->cluster_count) {
+        return false;       // Longer than the volume: the chain loops
+    }
+    return exfat_dir_iter_set_run(walk, it, cluster, run_length);
+}
+
+// Current 32-byte entry, reading up to EXFAT_WALK_READ_SECTORS of the run
+static const uint8_t* exfat_dir_iter_entry(exfat_walk_t* walk, exfat_dir_iter_t* it) {
+    if (it->lba < walk_buffer_lba || it->lba >= walk_buffer_lba + walk_buffer_count) {
+        uint32_t count = it->run_end - it->lba;
+        if (count > it->sectors_left) count = it->sectors_left;
+        if (count > EXFAT_WALK_READ_SECTORS) count = EXFAT_WALK_READ_SECTORS;
+
+        walk_buffer_count = 0;
+        if (sd_block_read_blocks(walk->vol->dev, it->lba, count, walk_buffer) != 0) {
+            walk->status = -1;
+            return NULL;
+        }
+        walk_buffer_lba = it->lba;
+        walk_buffer_count = count;
+    }
+    return walk_buffer + (it->lba - walk_buffer_lba) * SD_BLOCK_SIZE +
+           it->index * EXFAT_DIR_ENTRY_SIZE;
+}
+
+static bool exfat_dir_iter_advance(exfat_walk_t* walk, exfat_dir_iter_t* it) {
+    if (++it->entries >= EXFAT_DIR_ENTRIES_MAX) {
+        return false;
+    }
+    if (++it->index < SD_BLOCK_SIZE / EXFAT_DIR_ENTRY_SIZE) {
+        return true;
+    }
+    return exfat_dir_iter_next_sector(walk, it);
+}
+
+// EntrySetChecksum: bytes 2-3 of the file entry hold the checksum itself
+static uint16_t exfat_set_checksum(uint16_t sum, const uint8_t* entry, bool primary) {
+    for (int i = 0; i < EXFAT_DIR_ENTRY_SIZE; i++) {
+        if (primary && (i == 2 || i == 3)) continue;
+        sum = (uint16_t)(((sum & 1) ? 0x8000 : 0) + (sum >> 1) + entry[i]);
+    }
+    return sum;
+}
+
+static void exfat_set_begin(exfat_entry_set_t* set, const uint8_t* entry) {
+    memset(set, 0, sizeof(*set));
+    set->active = true;
+    set->secondary_left = entry[1];
+    set->broken = entry[1] < 2;     // At least a stream extension and one name entry
+    set->stored_checksum = le16_get(entry + 2);
+    set->attributes = le16_get(entry + 4);
+    set->checksum = exfat_set_checksum(0, entry, true);
+}
+
+// Add a secondary entry; true once the set is complete
+static bool exfat_set_add(exfat_entry_set_t* set, const uint8_t* entry) {
+    set->checksum = exfat_set_checksum(set->checksum, entry, false);
+
+    if (set->secondary_seen++ == 0) {
+        // The stream extension must come first
+        if (entry[0] == EXFAT_ENTRY_STREAM) {
+            set->have_stream = true;
+            set->contiguous = (entry[1] & EXFAT_FLAG_NO_FAT_CHAIN) != 0;
+            set->name_length = entry[3];
+            set->first_cluster = le32_get(entry + 20);
+            set->data_length = le64_get(entry + 24);
+        } else {
+            set->broken = true;
+        }
+    } else if (entry[0] == EXFAT_ENTRY_NAME) {
+        // Name entries past NameLength only count towards the checksum
+        for (int i = 0; i < EXFAT_NAME_CHARS && set->name_count < set->name_length; i++) {
+            set->name[set->name_count++] = le16_get(entry + 2 + i * 2);
+        }
+    }
+    // Other secondary entries (vendor extension 0xE0, vendor allocation
+    // 0xE1) only count towards the checksum; a set may hold up to 255
+
+    return --set->secondary_left == 0;
+}
+
+static void exfat_walk_directory(exfat_walk_t* walk, uint32_t cluster, uint64_t data_length,
+                                 bool contiguous, int depth, fat_walk_totals_t* totals) {
+    exfat_dir_iter_t it;
+    if (!exfat_dir_iter_open(walk, &it, cluster, data_length, contiguous)) {
+        return;
+    }
+    exfat_entry_set_t* set = &walk_set;
+    set->active = false;
+
+    do {
+        const uint8_t* entry = exfat_dir_iter_entry(walk, &it);
+        if (!entry || entry[0] == EXFAT_ENTRY_END) {
+            break;                  // Read error or end of directory
+        }
+
+        if (entry[0] == EXFAT_ENTRY_FILE) {
+            if (set->active) walk->bad_sets++;      // Previous set cut short
+            exfat_set_begin(set, entry);
+            if (set->secondary_left == 0) {
+                walk->bad_sets++;
+                set->active = false;
+            }
+            continue;
+        }
+        if ((entry[0] & (EXFAT_ENTRY_IN_USE | EXFAT_ENTRY_SECONDARY)) !=
+            (EXFAT_ENTRY_IN_USE | EXFAT_ENTRY_SECONDARY)) {
+            // Deleted entry or another primary (bitmap, up-case table, label)
+            if (set->active) {
+                walk->bad_sets++;
+                set->active = false;
+            }
+            continue;
+        }
+        if (!set->active || !exfat_set_add(set, entry)) {
+            continue;
+        }
+        set->active = false;
+
+        if (walk->entries >= walk->limits.max_entries) {
+            walk->truncated = true;
+            return;
+        }
+        walk->entries++;
+
+        set->name[set->name_count] = 0;
+        fat_walk_utf16_to_utf8(set->name, walk_name, sizeof(walk_name));
+        if (walk_name[0] == '\0') strcpy(walk_name, "?");
+
+        int indent = (depth + 1) * 2;
+        if (set->broken || !set->have_stream || set->name_count < set->name_length ||
+            set->checksum != set->stored_checksum) {
+            walk->bad_sets++;
+            printf("%*s%s  [corrupt entry set - skipped]\n", indent, "", walk_name);
+            continue;
+        }
+
+        if (set->attributes & EXFAT_ATTR_DIRECTORY) {
+            // The shared set is reused by the child, keep what is needed here
+            uint32_t child = set->first_cluster;
+            uint64_t child_length = set->data_length;
+            bool child_contiguous = set->contiguous;
+            totals->dirs++;
+            printf("%*s%s/\n", indent, "", walk_name);
+
+            if (depth + 1 > walk->limits.max_depth) {
+                printf("%*s...\n", indent + 2, "");
+                walk->truncated = true;
+                continue;
+            }
+
+            fat_walk_totals_t sub = { 0, 0, 0, false };
+            exfat_walk_directory(walk, child, child_length, child_contiguous, depth + 1, &sub);
+            set->active = false;    // The child may have stopped inside a set of its own
+            totals->files += sub.files;
+            totals->dirs += sub.dirs;
+            totals->bytes += sub.bytes;
+
+            char size[16];
+            fat_walk_format_size(sub.bytes, size, sizeof(size));
+            printf("%*s[%u files, %u dirs, %s]\n", indent + 2, "", sub.files, sub.dirs, size);
+        } else {
+            totals->files++;
+            totals->bytes += set->data_length;
+
+            char size[16];
+            fat_walk_format_size(set->data_length, size, sizeof(size));
+            printf("%*s%-*s %10s\n", indent, "", 40 - indent, walk_name, size);
+        }
+
+        if (walk->status != 0) {
+            return;
+        }
+    } while (exfat_dir_iter_advance(walk, &it));
+
+    if (set->active) {
+        walk->bad_sets++;           // Directory ended inside an entry set
+        set->active = false;
+    }
+}
+
+int exfat_walk_tree(exfat_volume_t* vol, const fat_walk_limits_t* limits, fat_walk_totals_t* totals) {
+    exfat_walk_t walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.vol = vol;
+    walk.limits.max_depth = limits ? limits->max_depth : FAT_WALK_MAX_DEPTH;
+    walk.limits.max_entries = limits ? limits->max_entries : FAT_WALK_MAX_ENTRIES;
+    walk_buffer_count = 0;
+
+    fat_walk_totals_t sum = { 0, 0, 0, false };
+    printf("/\n");
+    exfat_walk_directory(&walk, vol->root_cluster, 0, false, 0, &sum);
+    sum.truncated = walk.truncated;
+
+    char size[16];
+    fat_walk_format_size(sum.bytes, size, sizeof(size));
+    printf("Total: %u files, %u directories, %s%s\n", sum.files, sum.dirs, size,
+           walk.truncated ? " (listing truncated)" : "");
+    if (walk.bad_sets) {
+        printf("%u corrupt entry set(s) skipped\n", walk.bad_sets);
+    }
+    if (walk.status != 0) {
+        printf("Directory read failed - listing incomplete\n");
+    }
+
+    if (totals) *totals = sum;
+    return walk.status;
+}
@@ -0,0 +1,21 @@
+#ifndef EXFAT_WALK_H
+#define EXFAT_WALK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "exfat_volume.h"
+#include "fat_walk.h"
+
+// Read-only recursive directory listing for exFAT volumes.
+// File entry sets are streamed entry by entry: the set checksum is
+// accumulated on the fly and only the name and stream extension fields are
+// kept, so a set may span sector and cluster boundaries. Sets that fail the
+// checksum are reported and never descended into. Limits and totals are the
+// same as for the FAT listing.
+
+#define EXFAT_WALK_READ_SECTORS 8       // Directory sectors per multi-block read
+
+// Print the tree; limits may be NULL for the defaults, totals may be NULL
+int exfat_walk_tree(exfat_volume_t* vol, const fat_walk_limits_t* limits, fat_walk_totals_t* totals);
+
+#endif // EXFAT_WALK_H
@@ -0,0 +1,323 @@
+#include "ext_volume.h"
+#include "byte_order.h"
+#include <stdio.h>
+#include <string.h>
+
+#define EXT_SUPERBLOCK_OFFSET   1024
+#define EXT_SUPER_MAGIC         0xEF53
+#define EXT_CACHE_INVALID       0xFFFFFFFF
+
+#define EXT_COMPAT_HAS_JOURNAL  0x0004
+
+#define EXT_INCOMPAT_RECOVER    0x0004
+#define EXT_INCOMPAT_EXTENTS    0x0040
+#define EXT_INCOMPAT_64BIT      0x0080
+#define EXT_INCOMPAT_MMP        0x0100
+#define EXT_INCOMPAT_FLEX_BG    0x0200
+#define EXT_INCOMPAT_EA_INODE   0x0400
+#define EXT_INCOMPAT_CSUM_SEED  0x2000
+#define EXT_INCOMPAT_LARGEDIR   0x4000
+#define EXT_INCOMPAT_INLINE     0x8000
+#define EXT_INCOMPAT_CASEFOLD   0x20000
+
+// Everything else (compression, META_BG descriptor layout, encrypted
+// names, ...) changes how metadata is found or read
+#define EXT_INCOMPAT_SUPPORTED  (EXT_INCOMPAT_FILETYPE | EXT_INCOMPAT_RECOVER | \
+                                 EXT_INCOMPAT_EXTENTS | EXT_INCOMPAT_64BIT | \
+                                 EXT_INCOMPAT_MMP | EXT_INCOMPAT_FLEX_BG | \
+                                 EXT_INCOMPAT_EA_INODE | EXT_INCOMPAT_CSUM_SEED | \
+                                 EXT_INCOMPAT_LARGEDIR | EXT_INCOMPAT_INLINE | \
+                                 EXT_INCOMPAT_CASEFOLD)
+#define EXT_INCOMPAT_EXT4_ONLY  (EXT_INCOMPAT_EXTENTS | EXT_INCOMPAT_64BIT | \
+                                 EXT_INCOMPAT_FLEX_BG | EXT_INCOMPAT_INLINE)
+
+#define EXT_DESC_SIZE_MIN       32
+#define EXT_DESC_SIZE_64BIT     64
+
+#define EXT_EXTENT_MAGIC        0xF30A
+#define EXT_EXTENT_MAX_DEPTH    5
+#define EXT_EXTENT_ENTRY_SIZE   12
+#define EXT_EXTENT_UNWRITTEN    32768
+
+#define EXT_DIRECT_BLOCKS       12
+
+// Extent tree node below the root held in the inode
+static uint8_t ext_node_buffer[EXT_VOLUME_BLOCK_MAX];
+
+uint32_t ext_volume_block_lba(const ext_volume_t* vol, uint64_t block) {
+    return vol->start_lba + (uint32_t)(block << vol->block_sectors_shift);
+}
+
+const char* ext_volume_type_name(const ext_volume_t* vol) {
+    if (vol->feature_incompat & EXT_INCOMPAT_EXT4_ONLY) return "ext4";
+    if (vol->feature_compat & EXT_COMPAT_HAS_JOURNAL) return "ext3";
+    return "ext2";
+}
+
+int ext_volume_mount(sd_block_dev_t* dev, uint32_t start_lba, ext_volume_t* vol) {
+    uint8_t super[2 * SD_BLOCK_SIZE];
+
+    memset(vol, 0, sizeof(*vol));
+    vol->dev = dev;
+    vol->desc_cached_lba = EXT_CACHE_INVALID;
+    vol->inode_cached_lba = EXT_CACHE_INVALID;
+    vol->indirect_cached_lba = EXT_CACHE_INVALID;
+
+    if (sd_block_read_blocks(dev, start_lba + EXT_SUPERBLOCK_OFFSET / SD_BLOCK_SIZE, 2, super) != 0) {
+        return -1;
+    }
+    if (le16_get(super + 56) != EXT_SUPER_MAGIC) {
+        return -1;
+    }
+
+    uint32_t log_block_size = le32_get(super + 24);
+    if (log_block_size > 2) {
+        printf("ext: %u-byte blocks are not supported\n", 1024u << log_block_size);
+        return -1;
+    }
+    vol->start_lba = start_lba;
+    vol->block_size = 1024u << log_block_size;
+    vol->block_sectors_shift = (uint8_t)(log_block_size + 1);
+
+    vol->inodes_count = le32_get(super + 0);
+    vol->blocks_count = le32_get(super + 4);
+    vol->free_blocks = le32_get(super + 12);
+    vol->first_data_block = le32_get(super + 20);
+    vol->blocks_per_group = le32_get(super + 32);
+    vol->inodes_per_group = le32_get(super + 40);
+    vol->feature_compat = le32_get(super + 92);
+    vol->feature_incompat = le32_get(super + 96);
+
+    // Revision 0 has fixed 128-byte inodes and no feature flags
+    if (le32_get(super + 76) == 0) {
+        vol->inode_size = 128;
+        vol->feature_compat = 0;
+        vol->feature_incompat = 0;
+    } else {
+        vol->inode_size = le16_get(super + 88);
+    }
+
+    vol->desc_size = EXT_DESC_SIZE_MIN;
+    if (vol->feature_incompat & EXT_INCOMPAT_64BIT) {
+        vol->desc_size = le16_get(super + 254);
+        vol->blocks_count |= (uint64_t)le32_get(super + 0x150) << 32;
+        vol->free_blocks |= (uint64_t)le32_get(super + 0x158) << 32;
+    }
+    memcpy(vol->volume_name, super + 120, 16);
+    vol->volume_name[16] = '\0';
+
+    if (vol->feature_incompat & ~EXT_INCOMPAT_SUPPORTED) {
+        printf("ext: unsupported features 0x%x\n",
+               (unsigned)(vol->feature_incompat & ~EXT_INCOMPAT_SUPPORTED));
+        return -1;
+    }
+    if (vol->blocks_per_group == 0 || vol->inodes_per_group == 0 ||
+        vol->blocks_count <= vol->first_data_block ||
+        vol->inode_size < 128 || vol->inode_size > vol->block_size ||
+        (vol->inode_size & (vol->inode_size - 1)) != 0 ||
+        vol->desc_size < EXT_DESC_SIZE_MIN || vol->desc_size > SD_BLOCK_SIZE ||
+        (vol->desc_size & (vol->desc_size - 1)) != 0) {
+        return -1;
+    }
+
+    vol->group_count = (uint32_t)((vol->blocks_count - vol->first_data_block +
+                                   vol->blocks_per_group - 1) / vol->blocks_per_group);
+    return 0;
+}
+
+// Inode table of a group, from the descriptor table after the superblock
+static int ext_volume_inode_table(ext_volume_t* vol, uint32_t group, uint64_t* table) {
+    uint32_t offset = group * vol->desc_size;
+    uint32_t lba = ext_volume_block_lba(vol, vol->first_data_block + 1) + offset / SD_BLOCK_SIZE;
+
+    if (vol->desc_cached_lba != lba) {
+        if (sd_block_read_blocks(vol->dev, lba, 1, vol->desc_cache) != 0) {
+            vol->desc_cached_lba = EXT_CACHE_INVALID;
+            return -1;
+        }
+        vol->desc_cached_lba = lba;
+    }
+
+    const uint8_t* desc = vol->desc_cache + offset % SD_BLOCK_SIZE;
+    *table = le32_get(desc + 8);
+    if (vol->desc_size >= EXT_DESC_SIZE_64BIT) {
+        *table |= (uint64_t)le32_get(desc + 0x28) << 32;
+    }
+    return (*table != 0 && *table < vol->blocks_count) ? 0 : -1;
+}
+
+int ext_volume_read_inode(ext_volume_t* vol, uint32_t number, ext_inode_t* inode) {
+    if (number == 0 || number > vol->inodes_count) {
+        return -1;
+    }
+
+    uint32_t group = (number - 1) / vol->inodes_per_group;
+    uint32_t index = (number - 1) % vol->inodes_per_group;
+    uint64_t table;
+    if (group >= vol->group_count || ext_volume_inode_table(vol, group, &table) != 0) {
+        return -1;
+    }
+
+    // Read an aligned window of the table around the inode
+    uint32_t offset = index * vol->inode_size;
+    uint32_t sector = offset / SD_BLOCK_SIZE;
+    uint32_t window = sector & ~(uint32_t)(EXT_VOLUME_INODE_SECTORS - 1);
+    uint32_t table_sectors = (vol->inodes_per_group * vol->inode_size + SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE;
+    uint32_t count = table_sectors - window;
+    if (count > EXT_VOLUME_INODE_SECTORS) count = EXT_VOLUME_INODE_SECTORS;
+
+    uint32_t lba = ext_volume_block_lba(vol, table) + window;
+    if (vol->inode_cached_lba != lba) {
+        if (sd_block_read_blocks(vol->dev, lba, count, vol->inode_cache) != 0) {
+            vol->inode_cached_lba = EXT_CACHE_INVALID;
+            return -1;
+        }
+        vol->inode_cached_lba = lba;
+    }
+
+    const uint8_t* raw = vol->inode_cache + (sector - window) * SD_BLOCK_SIZE + offset % SD_BLOCK_SIZE;
+    inode->number = number;
+    inode->mode = le16_get(raw + 0);
+    inode->size = le32_get(raw + 4) | ((uint64_t)le32_get(raw + 108) << 32);
+    inode->flags = le32_get(raw + 32);
+    memcpy(inode->block, raw + 40, sizeof(inode->block));
+
+    // Deleted inodes have no links
+    return le16_get(raw + 26) != 0 ? 0 : -1;
+}
+
+static int ext_volume_map_extent(ext_volume_t* vol, const ext_inode_t* inode, uint32_t logical,
+                                 uint64_t* physical, uint32_t* run) {
+    const uint8_t* node = inode->block;
+    uint32_t node_bytes = sizeof(inode->block);
+
+    for (int level = 0; level <= EXT_EXTENT_MAX_DEPTH; level++) {
+        uint16_t entries = le16_get(node + 2);
+        uint16_t depth = le16_get(node + 6);
+        if (le16_get(node) != EXT_EXTENT_MAGIC ||
+            EXT_EXTENT_ENTRY_SIZE * (1u + entries) > node_bytes) {
+            return -1;
+        }
+        const uint8_t* entry = node + EXT_EXTENT_ENTRY_SIZE;
+
+        if (depth == 0) {
+            uint32_t hole_end = 0xFFFFFFFF;
+            for (uint16_t i = 0; i < entries; i++, entry += EXT_EXTENT_ENTRY_SIZE) {
+                uint32_t first = le32_get(entry);
+                uint32_t length = le16_get(entry + 4);
+                bool unwritten = length > EXT_EXTENT_UNWRITTEN;
+                if (unwritten) length -= EXT_EXTENT_UNWRITTEN;
+
+                if (logical < first) {
+                    hole_end = first;
+                    break;
+                }
+                if (logical - first < length) {
+                    uint32_t skip = logical - first;
+                    uint64_t start = ((uint64_t)le16_get(entry + 6) << 32) | le32_get(entry + 8);
+                    *physical = unwritten ? 0 : start + skip;   // Unwritten extents read as zero
+                    *run = length - skip;
+                    return 0;
+                }
+            }
+            *physical = 0;
+            *run = hole_end - logical;
+            return 0;
+        }
+
+        // Index node: follow the last entry that starts at or before logical
+        const uint8_t* chosen = NULL;
+        for (uint16_t i = 0; i < entries && le32_get(entry) <= logical; i++, entry += EXT_EXTENT_ENTRY_SIZE) {
+            chosen = entry;
+        }
+        if (!chosen) {
+            *physical = 0;
+            *run = 1;
+            return 0;
+        }
+
+        uint64_t child = ((uint64_t)le16_get(chosen + 8) << 32) | le32_get(chosen + 4);
+        if (child >= vol->blocks_count ||
+            sd_block_read_blocks(vol->dev, ext_volume_block_lba(vol, child),
+                                 vol->block_size / SD_BLOCK_SIZE, ext_node_buffer) != 0) {
+            return -1;
+        }
+        node = ext_node_buffer;
+        node_bytes = vol->block_size;
+    }
+    return -1;      // Deeper than any valid tree
+}
+
+// Entry index of an indirect block; run counts the consecutive blocks that
+// follow it within the same sector
+static int ext_volume_read_pointer(ext_volume_t* vol, uint32_t block, uint32_t index,
+                                   uint32_t* value, uint32_t* run) {
+    if (block >= vol->blocks_count) {
+        return -1;
+    }
+    uint32_t lba = ext_volume_block_lba(vol, block) + index * 4 / SD_BLOCK_SIZE;
+    if (vol->indirect_cached_lba != lba) {
+        if (sd_block_read_blocks(vol->dev, lba, 1, vol->indirect_cache) != 0) {
+            vol->indirect_cached_lba = EXT_CACHE_INVALID;
+            return -1;
+        }
+        vol->indirect_cached_lba = lba;
+    }
+
+    uint32_t slot = index % (SD_BLOCK_SIZE / 4);
+    *value = le32_get(vol->indirect_cache + slot * 4);
+    *run = 1;
+    while (*value && slot + *run < SD_BLOCK_SIZE / 4 &&
+           le32_get(vol->indirect_cache + (slot + *run) * 4) == *value + *run) {
+        (*run)++;
+    }
+    return 0;
+}
+
+// ext2/3 block map: 12 direct blocks, then single, double and triple indirect
+static int ext_volume_map_indirect(ext_volume_t* vol, const ext_inode_t* inode, uint32_t logical,
+                                   uint64_t* physical, uint32_t* run) {
+    if (logical < EXT_DIRECT_BLOCKS) {
+        uint32_t value = le32_get(inode->block + logical * 4);
+        *physical = value;
+        *run = 1;
+        while (value && logical + *run < EXT_DIRECT_BLOCKS &&
+               le32_get(inode->block + (logical + *run) * 4) == value + *run) {
+            (*run)++;
+        }
+        return 0;
+    }
+
+    uint64_t per_block = vol->block_size / 4;
+    uint64_t index = logical - EXT_DIRECT_BLOCKS;
+    uint64_t span = per_block;
+    int levels = 1;
+    while (index >= span) {
+        index -= span;
+        span *= per_block;
+        if (++levels > 3) return -1;
+    }
+
+    uint32_t block = le32_get(inode->block + (EXT_DIRECT_BLOCKS + levels - 1) * 4);
+    *run = 1;
+    for (int level = levels; level > 0 && block != 0; level--) {
+        span /= per_block;
+        if (ext_volume_read_pointer(vol, block, (uint32_t)(index / span), &block, run) != 0) {
+            return -1;
+        }
+        index %= span;
+    }
+    *physical = block;
+    return 0;
+}
+
+int ext_volume_map_block(ext_volume_t* vol, const ext_inode_t* inode, uint32_t logical,
+                         uint64_t* physical, uint32_t* run) {
+    int result = (inode->flags & EXT_INODE_EXTENTS)
+                 ? ext_volume_map_extent(vol, inode, logical, physical, run)
+                 : ext_volume_map_indirect(vol, inode, logical, physical, run);
+    if (result == 0 && *physical >= vol->blocks_count) {
+        return -1;
+    }
+    return result;
+}
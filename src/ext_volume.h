@@ -0,0 +1,87 @@
+#ifndef EXT_VOLUME_H
+#define EXT_VOLUME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sd_block.h"
+
+// Read-only access to ext2/3/4 volumes. Nothing is loaded up front beyond
+// the superblock: group descriptors, inodes and extent tree nodes are read
+// on demand through small caches, so RAM use does not depend on the size of
+// the volume.
+
+#define EXT_ROOT_INODE          2
+
+// Largest block size handled (directory blocks and extent nodes are read whole)
+#define EXT_VOLUME_BLOCK_MAX    4096
+
+// Inode table sectors per read; neighbouring inodes usually belong to the
+// same directory, so one read serves several entries
+#define EXT_VOLUME_INODE_SECTORS 8
+
+#define EXT_MODE_TYPE           0xF000
+#define EXT_MODE_DIRECTORY      0x4000
+#define EXT_MODE_REGULAR        0x8000
+#define EXT_MODE_SYMLINK        0xA000
+
+// Directory entries carry the file type
+#define EXT_INCOMPAT_FILETYPE   0x0002
+
+#define EXT_INODE_EXTENTS       0x00080000
+#define EXT_INODE_INLINE_DATA   0x10000000
+
+typedef struct {
+    sd_block_dev_t* dev;
+    uint32_t start_lba;
+    uint32_t block_size;
+    uint8_t block_sectors_shift;    // log2(block_size / 512)
+    uint64_t blocks_count;
+    uint64_t free_blocks;
+    uint32_t first_data_block;
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
+    uint32_t inodes_count;
+    uint16_t inode_size;
+    uint16_t desc_size;
+    uint32_t group_count;
+    uint32_t feature_compat;
+    uint32_t feature_incompat;
+    char volume_name[17];
+
+    // Group descriptor sector
+    uint32_t desc_cached_lba;
+    uint8_t desc_cache[SD_BLOCK_SIZE];
+
+    // Window of the inode table
+    uint32_t inode_cached_lba;
+    uint8_t inode_cache[EXT_VOLUME_INODE_SECTORS * SD_BLOCK_SIZE];
+
+    // Indirect block sector (ext2/3 block maps)
+    uint32_t indirect_cached_lba;
+    uint8_t indirect_cache[SD_BLOCK_SIZE];
+} ext_volume_t;
+
+typedef struct {
+    uint32_t number;
+    uint16_t mode;
+    uint32_t flags;
+    uint64_t size;
+    uint8_t block[60];              // i_block: block map, extent root or inline data
+} ext_inode_t;
+
+// Parse the superblock of the volume at start_lba; returns 0 on a supported volume
+int ext_volume_mount(sd_block_dev_t* dev, uint32_t start_lba, ext_volume_t* vol);
+
+int ext_volume_read_inode(ext_volume_t* vol, uint32_t number, ext_inode_t* inode);
+
+// Map a logical block of an inode to a physical block. run is the number of
+// blocks that stay contiguous from there; physical 0 is a hole.
+int ext_volume_map_block(ext_volume_t* vol, const ext_inode_t* inode, uint32_t logical,
+                         uint64_t* physical, uint32_t* run);
+
+uint32_t ext_volume_block_lba(const ext_volume_t* vol, uint64_t block);
+
+// "ext2", "ext3" or "ext4" from the feature flags
+const char* ext_volume_type_name(const ext_volume_t* vol);
+
+#endif // EXT_VOLUME_H
@@ -0,0 +1,266 @@
+#include "ext_walk.h"
+#include "sd_block.h"
+#include "byte_order.h"
+#include <stdio.h>
+#include <string.h>
+
+#define EXT_DIRENT_HEADER       8
+#define EXT_FT_DIRECTORY        2
+
+// Inline directories keep the parent inode number in the first word of i_block
+#define EXT_INLINE_DIR_OFFSET   4
+
+// Symlink targets shorter than i_block are stored in the inode itself
+#define EXT_FAST_SYMLINK_MAX    60
+
+typedef struct {
+    ext_volume_t* vol;
+    fat_walk_limits_t limits;
+    uint32_t entries;
+    uint32_t bad_blocks;
+    bool truncated;
+    int status;
+} ext_walk_t;
+
+// Position within one directory
+typedef struct {
+    ext_inode_t inode;
+    uint32_t blocks;                // Logical blocks in the directory
+    uint32_t logical;
+    uint32_t offset;                // Within the current block
+    uint64_t physical;              // Block holding logical, 0 for a hole
+    uint32_t run;                   // Mapped blocks left from logical on, 0 = unmapped
+    bool inline_data;
+} ext_dir_iter_t;
+
+// Shared by every directory level; a parent re-reads its block after a
+// child directory has used the buffer
+static uint8_t walk_buffer[EXT_VOLUME_BLOCK_MAX];
+static uint64_t walk_buffer_block;
+static char walk_name[FAT_WALK_NAME_MAX];
+static char walk_target[EXT_FAST_SYMLINK_MAX + 1];
+
+static bool ext_dir_iter_open(ext_walk_t* walk, ext_dir_iter_t* it, uint32_t number) {
+    ext_volume_t* vol = walk->vol;
+    memset(it, 0, sizeof(*it));
+
+    if (ext_volume_read_inode(vol, number, &it->inode) != 0) {
+        walk->status = -1;
+        return false;
+    }
+    if ((it->inode.mode & EXT_MODE_TYPE) != EXT_MODE_DIRECTORY) {
+        return false;
+    }
+
+    it->inline_data = (it->inode.flags & EXT_INODE_INLINE_DATA) != 0;
+    it->offset = it->inline_data ? EXT_INLINE_DIR_OFFSET : 0;
+    it->blocks = (uint32_t)((it->inode.size + vol->block_size - 1) / vol->block_size);
+    return true;
+}
+
+// Contents of the current directory block, mapping and reading it on demand
+static const uint8_t* ext_dir_iter_block(ext_walk_t* walk, ext_dir_iter_t* it) {
+    ext_volume_t* vol = walk->vol;
+
+    if (it->run == 0 &&
+        ext_volume_map_block(vol, &it->inode, it->logical, &it->physical, &it->run) != 0) {
+        walk->status = -1;
+        return NULL;
+    }
+    if (it->physical == 0) {
+        return NULL;                // Hole
+    }
+    if (walk_buffer_block != it->physical) {
+        walk_buffer_block = 0;
+        if (sd_block_read_blocks(vol->dev, ext_volume_block_lba(vol, it->physical),
+                                 vol->block_size / SD_BLOCK_SIZE, walk_buffer) != 0) {
+            walk->status = -1;
+            return NULL;
+        }
+        walk_buffer_block = it->physical;
+    }
+    return walk_buffer;
+}
+
+static void ext_dir_iter_next_block(ext_dir_iter_t* it) {
+    it->logical++;
+    it->offset = 0;
+    if (it->run > 1) {
+        it->run--;
+        if (it->physical) it->physical++;
+    } else {
+        it->run = 0;
+    }
+}
+
+// Next directory entry in use, NULL at the end of the directory or on error
+static const uint8_t* ext_dir_iter_next(ext_walk_t* walk, ext_dir_iter_t* it) {
+    for (;;) {
+        const uint8_t* data;
+        uint32_t limit;
+
+        if (it->inline_data) {
+            // Only the part in i_block; a spill-over into the inode's
+            // extended attribute space is not listed
+            data = it->inode.block;
+            limit = sizeof(it->inode.block);
+        } else {
+            if (it->logical >= it->blocks) {
+                return NULL;
+            }
+            data = ext_dir_iter_block(walk, it);
+            limit = walk->vol->block_size;
+            if (!data) {
+                if (walk->status != 0) return NULL;
+                ext_dir_iter_next_block(it);
+                continue;
+            }
+        }
+
+        if (it->offset + EXT_DIRENT_HEADER > limit) {
+            if (it->inline_data) return NULL;
+            ext_dir_iter_next_block(it);
+            continue;
+        }
+
+        const uint8_t* entry = data + it->offset;
+        uint16_t rec_len = le16_get(entry + 4);
+        uint8_t name_len = entry[6];
+        if (rec_len < EXT_DIRENT_HEADER || (rec_len & 3) != 0 || it->offset + rec_len > limit ||
+            EXT_DIRENT_HEADER + name_len > rec_len) {
+            // Damaged block: skip the rest of it
+            walk->bad_blocks++;
+            if (it->inline_data) return NULL;
+            ext_dir_iter_next_block(it);
+            continue;
+        }
+        it->offset += rec_len;
+
+        if (le32_get(entry) != 0) {
+            return entry;
+        }
+    }
+}
+
+static void ext_walk_directory(ext_walk_t* walk, uint32_t number, int depth, fat_walk_totals_t* totals) {
+    ext_volume_t* vol = walk->vol;
+    bool has_filetype = (vol->feature_incompat & EXT_INCOMPAT_FILETYPE) != 0;
+    ext_dir_iter_t it;
+    if (!ext_dir_iter_open(walk, &it, number)) {
+        return;
+    }
+
+    const uint8_t* entry;
+    while ((entry = ext_dir_iter_next(walk, &it)) != NULL) {
+        uint8_t name_len = entry[6];
+        if ((name_len == 1 && entry[8] == '.') ||
+            (name_len == 2 && entry[8] == '.' && entry[9] == '.')) {
+            continue;
+        }
+
+        if (walk->entries >= walk->limits.max_entries) {
+            walk->truncated = true;
+            return;
+        }
+        walk->entries++;
+
+        uint32_t child = le32_get(entry);
+        uint8_t file_type = has_filetype ? entry[7] : 0;
+        memcpy(walk_name, entry + 8, name_len);
+        walk_name[name_len] = '\0';
+
+        int indent = (depth + 1) * 2;
+
+        // A directory past the depth limit is listed without loading its inode
+        if (file_type == EXT_FT_DIRECTORY && depth + 1 > walk->limits.max_depth) {
+            totals->dirs++;
+            printf("%*s%s/\n", indent, "", walk_name);
+            printf("%*s...\n", indent + 2, "");
+            walk->truncated = true;
+            continue;
+        }
+
+        ext_inode_t inode;
+        if (ext_volume_read_inode(vol, child, &inode) != 0) {
+            printf("%*s%s  [unreadable inode %u]\n", indent, "", walk_name, child);
+            continue;
+        }
+
+        uint16_t type = inode.mode & EXT_MODE_TYPE;
+        if (type == EXT_MODE_DIRECTORY) {
+            totals->dirs++;
+            printf("%*s%s/\n", indent, "", walk_name);
+
+            if (depth + 1 > walk->limits.max_depth) {
+                printf("%*s...\n", indent + 2, "");
+                walk->truncated = true;
+                continue;
+            }
+
+            fat_walk_totals_t sub = { 0, 0, 0, false };
+            ext_walk_directory(walk, child, depth + 1, &sub);
+            totals->files += sub.files;
+            totals->dirs += sub.dirs;
+            totals->bytes += sub.bytes;
+
+            char size[16];
+            fat_walk_format_size(sub.bytes, size, sizeof(size));
+            printf("%*s[%u files, %u dirs, %s]\n", indent + 2, "", sub.files, sub.dirs, size);
+        } else if (type == EXT_MODE_SYMLINK) {
+            totals->files++;
+            if (inode.size < EXT_FAST_SYMLINK_MAX &&
+                !(inode.flags & (EXT_INODE_EXTENTS | EXT_INODE_INLINE_DATA))) {
+                memcpy(walk_target, inode.block, (size_t)inode.size);
+                walk_target[inode.size] = '\0';
+                printf("%*s%s -> %s\n", indent, "", walk_name, walk_target);
+            } else {
+                printf("%*s%s -> ...\n", indent, "", walk_name);
+            }
+        } else {
+            totals->files++;
+            if (type == EXT_MODE_REGULAR) {
+                totals->bytes += inode.size;
+            }
+
+            char size[16];
+            if (type == EXT_MODE_REGULAR) {
+                fat_walk_format_size(inode.size, size, sizeof(size));
+            } else {
+                strcpy(size, "special");
+            }
+            printf("%*s%-*s %10s\n", indent, "", 40 - indent, walk_name, size);
+        }
+
+        if (walk->status != 0) {
+            return;
+        }
+    }
+}
+
+int ext_walk_tree(ext_volume_t* vol, const fat_walk_limits_t* limits, fat_walk_totals_t* totals) {
+    ext_walk_t walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.vol = vol;
+    walk.limits.max_depth = limits ? limits->max_depth : FAT_WALK_MAX_DEPTH;
+    walk.limits.max_entries = limits ? limits->max_entries : FAT_WALK_MAX_ENTRIES;
+    walk_buffer_block = 0;
+
+    fat_walk_totals_t sum = { 0, 0, 0, false };
+    printf("/\n");
+    ext_walk_directory(&walk, EXT_ROOT_INODE, 0, &sum);
+    sum.truncated = walk.truncated;
+
+    char size[16];
+    fat_walk_format_size(sum.bytes, size, sizeof(size));
+    printf("Total: %u files, %u directories, %s%s\n", sum.files, sum.dirs, size,
+           walk.truncated ? " (listing truncated)" : "");
+    if (walk.bad_blocks) {
+        printf("%u damaged directory block(s) skipped\n", walk.bad_blocks);
+    }
+    if (walk.status != 0) {
+        printf("Directory read failed - listing incomplete\n");
+    }
+
+    if (totals) *totals = sum;
+    return walk.status;
+}
@@ -0,0 +1,19 @@
+#ifndef EXT_WALK_H
+#define EXT_WALK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ext_volume.h"
+#include "fat_walk.h"
+
+// Read-only recursive directory listing for ext2/3/4 volumes.
+// Directory blocks are mapped through the block map or extent tree one run
+// at a time. An inode is only read for an entry that is listed: directories
+// past the depth limit are shown from their directory entry alone, so their
+// inodes and blocks are never loaded. Limits and totals are the same as for
+// the FAT listing.
+
+// Print the tree; limits may be NULL for the defaults, totals may be NULL
+int ext_walk_tree(ext_volume_t* vol, const fat_walk_limits_t* limits, fat_walk_totals_t* totals);
+
+#endif // EXT_WALK_H
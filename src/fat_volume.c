@@ -0,0 +1,322 @@
+#include "fat_volume.h"
+#include "sd_block.h"
+#include "byte_order.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+#include <string.h>
+
+#define FAT_FSINFO_LEAD_SIG   0x41615252
+#define FAT_FSINFO_STRUCT_SIG 0x61417272
+
+// FAT12 packs eight entries into three words, so its chunks are a multiple
+// of three sectors to keep the groups aligned
+#define FAT12_SCAN_SECTORS    15
+
+static uint32_t fat_scan_buffer[FAT_VOLUME_SCAN_SECTORS * SD_BLOCK_SIZE / 4];
+
+int fat_volume_mount(sd_block_dev_t* dev, uint32_t start_lba, fat_volume_t* vol) {
+    uint8_t boot[SD_BLOCK_SIZE];
+
+    memset(vol, 0, sizeof(*vol));
+    vol->dev = dev;
+
+    if (sd_block_read_blocks(dev, start_lba, 1, boot) != 0) {
+        return -1;
+    }
+
+    if (boot[510] != 0x55 || boot[511] != 0xAA) {
+        return -1;
+    }
+
+    uint16_t bytes_per_sector = le16_get(boot + 11);
+    uint8_t sectors_per_cluster = boot[13];
+    if (bytes_per_sector != SD_BLOCK_SIZE || sectors_per_cluster == 0 ||
+        (sectors_per_cluster & (sectors_per_cluster - 1)) != 0) {
+        return -1;
+    }
+
+    vol->start_lba = start_lba;
+    vol->sectors_per_cluster = sectors_per_cluster;
+    vol->reserved_sectors = le16_get(boot + 14);
+    vol->num_fats = boot[16];
+    vol->root_entries = le16_get(boot + 17);
+
+    uint16_t total16 = le16_get(boot + 19);
+    vol->total_sectors = total16 ? total16 : le32_get(boot + 32);
+
+    // BPB_FATSz16 is zero on FAT32, which stores BPB_FATSz32 at offset 36
+    uint16_t fat_size16 = le16_get(boot + 22);
+    vol->fat_size = fat_size16 ? fat_size16 : le32_get(boot + 36);
+
+    if (vol->reserved_sectors == 0 || vol->num_fats == 0 || vol->fat_size == 0) {
+        return -1;
+    }
+
+    vol->root_dir_sectors = ((uint32_t)vol->root_entries * 32 + SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE;
+    uint32_t meta_sectors = vol->reserved_sectors +
+                            (uint32_t)vol->num_fats * vol->fat_size +
+                            vol->root_dir_sectors;
+    if (meta_sectors >= vol->total_sectors) {
+        return -1;
+    }
+
+    vol->fat_lba = start_lba + vol->reserved_sectors;
+    vol->root_dir_lba = vol->fat_lba + (uint32_t)vol->num_fats * vol->fat_size;
+    vol->data_lba = start_lba + meta_sectors;
+    vol->cluster_count = (vol->total_sectors - meta_sectors) / sectors_per_cluster;
+
+    // The FAT variant is determined by cluster count alone (Microsoft FAT spec)
+    if (vol->cluster_count < 4085) {
+        vol->type = FAT_TYPE_12;
+    } else if (vol->cluster_count < 65525) {
+        vol->type = FAT_TYPE_16;
+    } else {
+        vol->type = FAT_TYPE_32;
+        vol->root_cluster = le32_get(boot + 44);
+        vol->fsinfo_sector = le16_get(boot + 48);
+    }
+
+    return 0;
+}
+
+// Return a pointer to the FAT bytes [offset, offset + len), loading the
+// sector that holds offset (and its successor) into the least recently
+// used cache line on a miss
+static const uint8_t* fat_volume_load(fat_volume_t* vol, uint32_t offset, uint32_t len) {
+    uint32_t sector = offset / SD_BLOCK_SIZE;
+    fat_cache_line_t* victim = &vol->cache[0];
+
+    vol->cache_clock++;
+    for (int i = 0; i < FAT_VOLUME_CACHE_LINES; i++) {
+        fat_cache_line_t* line = &vol->cache[i];
+        uint32_t line_start = line->sector * SD_BLOCK_SIZE;
+        if (line->count && offset >= line_start &&
+            offset + len <= line_start + line->count * SD_BLOCK_SIZE) {
+            line->last_used = vol->cache_clock;
+            vol->cache_hits++;
+            return line->data + (offset - line_start);
+        }
+        if (line->last_used < victim->last_used) {
+            victim = line;
+        }
+    }
+
+    uint32_t count = (sector + 1 < vol->fat_size) ? FAT_VOLUME_LINE_SECTORS : 1;
+    victim->count = 0;
+    if (sd_block_read_blocks(vol->dev, vol->fat_lba + sector, count, victim->data) != 0) {
+        return NULL;
+    }
+    victim->sector = sector;
+    victim->count = count;
+    victim->last_used = vol->cache_clock;
+    vol->cache_misses++;
+    return victim->data + (offset % SD_BLOCK_SIZE);
+}
+
+int fat_volume_get_entry(fat_volume_t* vol, uint32_t cluster, uint32_t* value) {
+    if (cluster >= vol->cluster_count + FAT_FIRST_CLUSTER) {
+        return -1;
+    }
+
+    uint32_t offset;
+    switch (vol->type) {
+        case FAT_TYPE_12: offset = cluster + cluster / 2; break;
+        case FAT_TYPE_16: offset = cluster * 2; break;
+        case FAT_TYPE_32: offset = cluster * 4; break;
+        default: return -1;
+    }
+
+    uint32_t len = (vol->type == FAT_TYPE_32) ? 4 : 2;
+    if (offset + len > vol->fat_size * SD_BLOCK_SIZE) {
+        return -1;
+    }
+
+    const uint8_t* entry = fat_volume_load(vol, offset, len);
+    if (!entry) {
+        return -1;
+    }
+
+    switch (vol->type) {
+        case FAT_TYPE_12: {
+            uint16_t raw = le16_get(entry);
+            *value = (cluster & 1) ? (raw >> 4) : (raw & 0x0FFF);
+            break;
+        }
+        case FAT_TYPE_16:
+            *value = le16_get(entry);
+            break;
+        default:
+            *value = le32_get(entry) & 0x0FFFFFFF;
+            break;
+    }
+    return 0;
+}
+
+// Free entries in n FAT32 words (RP2040 is little-endian, so a word read
+// from the buffer is the on-disk entry). Four zero words are taken at once.
+static uint32_t fat_scan_words32(const uint32_t* w, uint32_t n) {
+    uint32_t free = 0;
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        if ((w[i] | w[i + 1] | w[i + 2] | w[i + 3]) == 0) {
+            free += 4;
+            continue;
+        }
+        free += ((w[i] & 0x0FFFFFFF) == 0) + ((w[i + 1] & 0x0FFFFFFF) == 0) +
+                ((w[i + 2] & 0x0FFFFFFF) == 0) + ((w[i + 3] & 0x0FFFFFFF) == 0);
+    }
+    for (; i < n; i++) {
+        free += (w[i] & 0x0FFFFFFF) == 0;
+    }
+    return free;
+}
+
+// Free entries in n words holding two FAT16 entries each
+static uint32_t fat_scan_words16(const uint32_t* w, uint32_t n) {
+    uint32_t free = 0;
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        if ((w[i] | w[i + 1] | w[i + 2] | w[i + 3]) == 0) {
+            free += 8;
+            continue;
+        }
+        for (uint32_t j = i; j < i + 4; j++) {
+            free += ((w[j] & 0xFFFF) == 0) + ((w[j] >> 16) == 0);
+        }
+    }
+    for (; i < n; i++) {
+        free += ((w[i] & 0xFFFF) == 0) + ((w[i] >> 16) == 0);
+    }
+    return free;
+}
+
+// Free entries in n groups of three words holding eight FAT12 entries
+static uint32_t fat_scan_groups12(const uint32_t* w, uint32_t n) {
+    uint32_t free = 0;
+    for (uint32_t g = 0; g < n; g++, w += 3) {
+        uint32_t w0 = w[0], w1 = w[1], w2 = w[2];
+        if ((w0 | w1 | w2) == 0) {
+            free += 8;
+            continue;
+        }
+        free += ((w0 & 0xFFF) == 0) +
+                (((w0 >> 12) & 0xFFF) == 0) +
+                ((((w0 >> 24) | (w1 << 8)) & 0xFFF) == 0) +
+                (((w1 >> 4) & 0xFFF) == 0) +
+                (((w1 >> 16) & 0xFFF) == 0) +
+                ((((w1 >> 28) | (w2 << 4)) & 0xFFF) == 0) +
+                (((w2 >> 8) & 0xFFF) == 0) +
+                ((w2 >> 20) == 0);
+    }
+    return free;
+}
+
+static uint32_t fat_volume_read_fsinfo(fat_volume_t* vol) {
+    if (vol->type != FAT_TYPE_32 || vol->fsinfo_sector == 0 ||
+        vol->fsinfo_sector >= vol->reserved_sectors) {
+        return FAT_FSINFO_UNKNOWN;
+    }
+
+    uint8_t* sector = (uint8_t*)fat_scan_buffer;
+    if (sd_block_read_blocks(vol->dev, vol->start_lba + vol->fsinfo_sector, 1, sector) != 0 ||
+        le32_get(sector) != FAT_FSINFO_LEAD_SIG ||
+        le32_get(sector + 484) != FAT_FSINFO_STRUCT_SIG) {
+        return FAT_FSINFO_UNKNOWN;
+    }
+
+    uint32_t free = le32_get(sector + 488);
+    return (free <= vol->cluster_count) ? free : FAT_FSINFO_UNKNOWN;
+}
+
+int fat_volume_count_free(fat_volume_t* vol, fat_volume_usage_t* usage) {
+    uint64_t start_us = time_us_64();
+    memset(usage, 0, sizeof(*usage));
+    usage->fsinfo_free = fat_volume_read_fsinfo(vol);
+
+    // Scan unit: bytes and entries per call of the word scanners
+    uint32_t unit_bytes = (vol->type == FAT_TYPE_12) ? 12 : 4;
+    uint32_t unit_entries = (vol->type == FAT_TYPE_12) ? 8 : (vol->type == FAT_TYPE_16) ? 2 : 1;
+    uint32_t chunk_sectors = (vol->type == FAT_TYPE_12) ? FAT12_SCAN_SECTORS : FAT_VOLUME_SCAN_SECTORS;
+
+    uint32_t total = vol->cluster_count + FAT_FIRST_CLUSTER;
+    uint32_t entry = 0;
+    uint32_t free = 0;
+
+    for (uint32_t sector = 0; sector < vol->fat_size && entry < total; ) {
+        uint32_t n = vol->fat_size - sector;
+        if (n > chunk_sectors) n = chunk_sectors;
+
+        if (sd_block_read_blocks(vol->dev, vol->fat_lba + sector, n, (uint8_t*)fat_scan_buffer) != 0) {
+            return -1;
+        }
+
+        uint32_t chunk_units = n * SD_BLOCK_SIZE / unit_bytes;
+        uint32_t units = (total - entry) / unit_entries;
+        if (units > chunk_units) units = chunk_units;
+
+        switch (vol->type) {
+            case FAT_TYPE_12: free += fat_scan_groups12(fat_scan_buffer, units); break;
+            case FAT_TYPE_16: free += fat_scan_words16(fat_scan_buffer, units); break;
+            default: free += fat_scan_words32(fat_scan_buffer, units); break;
+        }
+        entry += units * unit_entries;
+        if (units < chunk_units) break;     // Entries left over share a unit with padding
+        sector += n;
+    }
+
+    // Entries that did not fill a whole unit, then the two reserved entries
+    uint32_t value;
+    for (; entry < total; entry++) {
+        if (fat_volume_get_entry(vol, entry, &value) != 0) return -1;
+        free += (value == 0);
+    }
+    for (uint32_t reserved = 0; reserved < FAT_FIRST_CLUSTER; reserved++) {
+        if (fat_volume_get_entry(vol, reserved, &value) != 0) return -1;
+        free -= (value == 0);
+    }
+
+    usage->free_clusters = free;
+    usage->elapsed_ms = (uint32_t)((time_us_64() - start_us) / 1000);
+    return 0;
+}
+
+bool fat_volume_is_end(const fat_volume_t* vol, uint32_t value) {
+    // Values from the bad-cluster marker up are end-of-chain in every variant
+    uint32_t bad;
+    switch (vol->type) {
+        case FAT_TYPE_12: bad = 0xFF7; break;
+        case FAT_TYPE_16: bad = 0xFFF7; break;
+        default: bad = 0x0FFFFFF7; break;
+    }
+    return value >= bad || value < FAT_FIRST_CLUSTER ||
+           value >= vol->cluster_count + FAT_FIRST_CLUSTER;
+}
+
+int fat_volume_next_run(fat_volume_t* vol, uint32_t cluster, uint32_t* run_length, uint32_t* next) {
+    uint32_t length = 0;
+    uint32_t value;
+
+    do {
+        if (fat_volume_get_entry(vol, cluster + length, &value) != 0) {
+            return -1;
+        }
+        length++;
+    } while (value == cluster + length && !fat_volume_is_end(vol, value));
+
+    *run_length = length;
+    *next = value;
+    return 0;
+}
+
+uint32_t fat_volume_cluster_lba(const fat_volume_t* vol, uint32_t cluster) {
+    return vol->data_lba + (cluster - FAT_FIRST_CLUSTER) * vol->sectors_per_cluster;
+}
+
+const char* fat_volume_type_name(fat_type_t type) {
+    switch (type) {
+        case FAT_TYPE_12: return "FAT12";
+        case FAT_TYPE_16: return "FAT16";
+        case FAT_TYPE_32: return "FAT32";
+        default: return "Unknown";
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef FAT_VOLUME_H
+#define FAT_VOLUME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sd_block.h"
+
+// Read-only access to FAT12/16/32 volume geometry and allocation tables
+
+typedef enum {
+    FAT_TYPE_NONE = 0,
+    FAT_TYPE_12 = 12,
+    FAT_TYPE_16 = 16,
+    FAT_TYPE_32 = 32
+} fat_type_t;
+
+// First valid data cluster number
+#define FAT_FIRST_CLUSTER 2
+
+// FAT sectors per multi-block read when scanning the whole table
+#define FAT_VOLUME_SCAN_SECTORS 16
+
+// FSInfo free count when the sector is missing or says "unknown"
+#define FAT_FSINFO_UNKNOWN 0xFFFFFFFF
+
+// FAT sector cache: a few two-sector windows, so FAT12 entries may straddle
+// a sector boundary and walks that alternate between chains (a directory
+// and its files) do not evict each other
+#define FAT_VOLUME_CACHE_LINES 4
+#define FAT_VOLUME_LINE_SECTORS 2
+
+typedef struct {
+    uint32_t sector;                // First FAT sector held (relative)
+    uint32_t count;                 // Sectors loaded, 0 = empty
+    uint32_t last_used;
+    uint8_t data[FAT_VOLUME_LINE_SECTORS * 512];
+} fat_cache_line_t;
+
+typedef struct {
+    sd_block_dev_t* dev;
+    fat_type_t type;
+    uint32_t start_lba;             // Boot sector LBA
+    uint32_t total_sectors;
+    uint8_t sectors_per_cluster;
+    uint16_t reserved_sectors;
+    uint8_t num_fats;
+    uint32_t fat_size;              // Sectors per FAT
+    uint16_t root_entries;          // FAT12/16 fixed root directory entries
+    uint32_t fat_lba;               // First FAT
+    uint32_t root_dir_lba;          // FAT12/16 fixed root directory
+    uint32_t root_dir_sectors;
+    uint32_t data_lba;              // Cluster 2
+    uint32_t cluster_count;
+    uint32_t root_cluster;          // FAT32 root directory cluster
+    uint16_t fsinfo_sector;         // FAT32 FSInfo sector (relative)
+
+    fat_cache_line_t cache[FAT_VOLUME_CACHE_LINES];
+    uint32_t cache_clock;
+    uint32_t cache_hits;
+    uint32_t cache_misses;
+} fat_volume_t;
+
+typedef struct {
+    uint32_t free_clusters;         // Counted from the first FAT
+    uint32_t fsinfo_free;           // FAT32 FSInfo hint or FAT_FSINFO_UNKNOWN
+    uint32_t elapsed_ms;
+} fat_volume_usage_t;
+
+// Parse the boot sector at start_lba; returns 0 on a valid FAT volume
+int fat_volume_mount(sd_block_dev_t* dev, uint32_t start_lba, fat_volume_t* vol);
+
+// Read the FAT entry for a cluster (FAT32 entries are masked to 28 bits)
+int fat_volume_get_entry(fat_volume_t* vol, uint32_t cluster, uint32_t* value);
+
+// Follow the chain from cluster while it stays contiguous. run_length is the
+// number of consecutive clusters starting at cluster; next is the cluster
+// that follows the run (end of chain: fat_volume_is_end(vol, next)).
+int fat_volume_next_run(fat_volume_t* vol, uint32_t cluster, uint32_t* run_length, uint32_t* next);
+
+// Count free clusters by streaming the first FAT through multi-block reads
+// and testing a 32-bit word (one to eight entries) at a time
+int fat_volume_count_free(fat_volume_t* vol, fat_volume_usage_t* usage);
+
+// True for end-of-chain, bad-cluster and out-of-range values
+bool fat_volume_is_end(const fat_volume_t* vol, uint32_t value);
+
+uint32_t fat_volume_cluster_lba(const fat_volume_t* vol, uint32_t cluster);
+const char* fat_volume_type_name(fat_type_t type);
+
+#endif // FAT_VOLUME_H
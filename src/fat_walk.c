@@ -0,0 +1,346 @@
+#include "fat_walk.h"
+#include "sd_block.h"
+#include "byte_order.h"
+#include <stdio.h>
+#include <string.h>
+
+#define FAT_DIR_ENTRY_SIZE      32
+#define FAT_DIR_ENTRIES_MAX     65536   // Largest directory the spec allows
+
+#define FAT_ATTR_VOLUME_ID      0x08
+#define FAT_ATTR_DIRECTORY      0x10
+#define FAT_ATTR_LFN            0x0F
+
+#define FAT_NT_LOWER_BASE       0x08
+#define FAT_NT_LOWER_EXT        0x10
+
+#define FAT_LFN_LAST            0x40
+#define FAT_LFN_CHARS           13
+#define FAT_LFN_MAX_ENTRIES     20      // 255 characters
+
+typedef struct {
+    fat_volume_t* vol;
+    fat_walk_limits_t limits;
+    uint32_t entries;
+    uint32_t bad_dirs;              // Directory entries pointing outside the data area
+    bool truncated;
+    int status;
+} fat_walk_t;
+
+// Position within one directory. The fixed FAT12/16 root directory is a
+// single run with no successor cluster.
+typedef struct {
+    uint32_t lba;                   // Sector holding the current entry
+    uint32_t run_end;               // First LBA past the current run
+    uint32_t next_cluster;          // Cluster following the run, or end of chain
+    uint32_t clusters;              // Clusters visited, bounds corrupt chains
+    uint32_t entries;
+    uint16_t index;                 // Entry within the sector
+    bool fixed_root;
+} fat_dir_iter_t;
+
+// Long file name being assembled; entries arrive last part first
+typedef struct {
+    uint16_t chars[FAT_LFN_MAX_ENTRIES * FAT_LFN_CHARS + 1];
+    uint8_t checksum;
+    uint8_t expected;               // Sequence number of the next LFN entry, 0 = complete
+    bool active;
+} fat_lfn_t;
+
+// Shared by every directory level; a parent re-reads its chunk after a
+// child directory has used the buffer
+static uint8_t walk_buffer[FAT_WALK_READ_SECTORS * SD_BLOCK_SIZE];
+static uint32_t walk_buffer_lba;
+static uint32_t walk_buffer_count;
+static fat_lfn_t walk_lfn;
+static char walk_name[FAT_WALK_NAME_MAX];
+
+static bool fat_dir_iter_open(fat_walk_t* walk, fat_dir_iter_t* it, uint32_t cluster) {
+    fat_volume_t* vol = walk->vol;
+    memset(it, 0, sizeof(*it));
+
+    if (cluster == 0) {
+        if (vol->type != FAT_TYPE_32) {
+            it->fixed_root = true;
+            it->lba = vol->root_dir_lba;
+            it->run_end = vol->root_dir_lba + vol->root_dir_sectors;
+            return it->lba < it->run_end;
+        }
+        cluster = vol->root_cluster;
+    }
+    if (fat_volume_is_end(vol, cluster)) {
+        return false;
+    }
+
+    uint32_t run_length;
+    if (fat_volume_next_run(vol, cluster, &run_length, &it->next_cluster) != 0) {
+        walk->status = -1;
+        return false;
+    }
+    it->clusters = run_length;
+    it->lba = fat_volume_cluster_lba(vol, cluster);
+    it->run_end = it->lba + run_length * vol->sectors_per_cluster;
+    return true;
+}
+
+// Advance to the next sector, crossing to the next run at its end
+static bool fat_dir_iter_next_sector(fat_walk_t* walk, fat_dir_iter_t* it) {
+    fat_volume_t* vol = walk->vol;
+
+    it->index = 0;
+    if (++it->lba < it->run_end) {
+        return true;
+    }
+    if (it->fixed_root || fat_volume_is_end(vol, it->next_cluster)) {
+        return false;
+    }
+
+    uint32_t cluster = it->next_cluster;
+    uint32_t run_length;
+    if (fat_volume_next_run(vol, cluster, &run_length, &it->next_cluster) != 0) {
+        walk->status = -1;
+        return false;
+    }
+    it->clusters += run_length;
+    if (it->clusters > vol->cluster_count) {
+        return false;       // Longer than the volume: the chain loops
+    }
+    it->lba = fat_volume_cluster_lba(vol, cluster);
+    it->run_end = it->lba + run_length * vol->sectors_per_cluster;
+    return true;
+}
+
+// Current 32-byte entry, reading up to FAT_WALK_READ_SECTORS of the run
+static const uint8_t* fat_dir_iter_entry(fat_walk_t* walk, fat_dir_iter_t* it) {
+    if (it->lba < walk_buffer_lba || it->lba >= walk_buffer_lba + walk_buffer_count) {
+        uint32_t count = it->run_end - it->lba;
+        if (count > FAT_WALK_READ_SECTORS) count = FAT_WALK_READ_SECTORS;
+
+        walk_buffer_count = 0;
+        if (sd_block_read_blocks(walk->vol->dev, it->lba, count, walk_buffer) != 0) {
+            walk->status = -1;
+            return NULL;
+        }
+        walk_buffer_lba = it->lba;
+        walk_buffer_count = count;
+    }
+    return walk_buffer + (it->lba - walk_buffer_lba) * SD_BLOCK_SIZE +
+           it->index * FAT_DIR_ENTRY_SIZE;
+}
+
+static bool fat_dir_iter_advance(fat_walk_t* walk, fat_dir_iter_t* it) {
+    if (++it->entries >= FAT_DIR_ENTRIES_MAX) {
+        return false;
+    }
+    if (++it->index < SD_BLOCK_SIZE / FAT_DIR_ENTRY_SIZE) {
+        return true;
+    }
+    return fat_dir_iter_next_sector(walk, it);
+}
+
+static uint8_t fat_short_name_checksum(const uint8_t* entry) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + entry[i]);
+    }
+    return sum;
+}
+
+static void fat_lfn_add(fat_lfn_t* lfn, const uint8_t* entry) {
+    static const uint8_t offsets[FAT_LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+    uint8_t sequence = entry[0] & 0x1F;
+
+    if (entry[0] & FAT_LFN_LAST) {
+        lfn->active = sequence >= 1 && sequence <= FAT_LFN_MAX_ENTRIES;
+        lfn->checksum = entry[13];
+        lfn->expected = sequence;
+        lfn->chars[sequence * FAT_LFN_CHARS] = 0;
+    }
+    if (!lfn->active || sequence != lfn->expected || entry[13] != lfn->checksum) {
+        lfn->active = false;
+        return;
+    }
+
+    uint16_t* out = lfn->chars + (sequence - 1) * FAT_LFN_CHARS;
+    for (int i = 0; i < FAT_LFN_CHARS; i++) {
+        out[i] = le16_get(entry + offsets[i]);
+    }
+    lfn->expected--;
+}
+
+void fat_walk_utf16_to_utf8(const uint16_t* chars, char* out, size_t size) {
+    size_t n = 0;
+    for (int i = 0; chars[i] && chars[i] != 0xFFFF; i++) {
+        uint16_t c = chars[i];
+        char encoded[3];
+        size_t len;
+        if (c < 0x80) {
+            encoded[0] = (char)c;
+            len = 1;
+        } else if (c < 0x800) {
+            encoded[0] = (char)(0xC0 | (c >> 6));
+            encoded[1] = (char)(0x80 | (c & 0x3F));
+            len = 2;
+        } else if (c >= 0xD800 && c < 0xE000) {
+            encoded[0] = '?';       // Surrogate halves are not decoded
+            len = 1;
+        } else {
+            encoded[0] = (char)(0xE0 | (c >> 12));
+            encoded[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+            encoded[2] = (char)(0x80 | (c & 0x3F));
+            len = 3;
+        }
+        if (n + len >= size) break;
+        memcpy(out + n, encoded, len);
+        n += len;
+    }
+    out[n] = '\0';
+}
+
+// 8.3 name with padding removed, honouring the NT lowercase flags
+static void fat_short_name(const uint8_t* entry, char* out) {
+    int n = 0;
+    for (int i = 0; i < 8 && entry[i] != ' '; i++) {
+        char c = (i == 0 && entry[i] == 0x05) ? (char)0xE5 : (char)entry[i];
+        if ((entry[12] & FAT_NT_LOWER_BASE) && c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        out[n++] = c;
+    }
+    if (entry[8] != ' ') {
+        out[n++] = '.';
+        for (int i = 8; i < 11 && entry[i] != ' '; i++) {
+            char c = (char)entry[i];
+            if ((entry[12] & FAT_NT_LOWER_EXT) && c >= 'A' && c <= 'Z') c += 'a' - 'A';
+            out[n++] = c;
+        }
+    }
+    out[n] = '\0';
+}
+
+void fat_walk_format_size(uint64_t bytes, char* out, size_t size) {
+    if (bytes < 1024) {
+        snprintf(out, size, "%u B", (unsigned)bytes);
+    } else if (bytes < 1024 * 1024) {
+        snprintf(out, size, "%.1f KB", bytes / 1024.0);
+    } else if (bytes < 1024ull * 1024 * 1024) {
+        snprintf(out, size, "%.1f MB", bytes / (1024.0 * 1024));
+    } else {
+        snprintf(out, size, "%.2f GB", bytes / (1024.0 * 1024 * 1024));
+    }
+}
+
+static void fat_walk_directory(fat_walk_t* walk, uint32_t cluster, int depth, fat_walk_totals_t* totals) {
+    fat_dir_iter_t it;
+    if (!fat_dir_iter_open(walk, &it, cluster)) {
+        return;
+    }
+    walk_lfn.active = false;
+
+    do {
+        const uint8_t* entry = fat_dir_iter_entry(walk, &it);
+        if (!entry || entry[0] == 0x00) {
+            break;                  // Read error or end of directory
+        }
+        if (entry[0] == 0xE5) {
+            walk_lfn.active = false;
+            continue;
+        }
+
+        uint8_t attr = entry[11];
+        if ((attr & 0x3F) == FAT_ATTR_LFN) {
+            fat_lfn_add(&walk_lfn, entry);
+            continue;
+        }
+
+        bool have_lfn = walk_lfn.active && walk_lfn.expected == 0 &&
+                        walk_lfn.checksum == fat_short_name_checksum(entry);
+        walk_lfn.active = false;
+
+        if (attr & FAT_ATTR_VOLUME_ID) continue;
+        if (entry[0] == '.' && (entry[1] == ' ' || entry[1] == '.')) continue;
+
+        if (walk->entries >= walk->limits.max_entries) {
+            walk->truncated = true;
+            return;
+        }
+        walk->entries++;
+
+        if (have_lfn) {
+            fat_walk_utf16_to_utf8(walk_lfn.chars, walk_name, sizeof(walk_name));
+        } else {
+            fat_short_name(entry, walk_name);
+        }
+
+        int indent = (depth + 1) * 2;
+        if (attr & FAT_ATTR_DIRECTORY) {
+            uint32_t child = le16_get(entry + 26);
+            if (walk->vol->type == FAT_TYPE_32) {
+                child |= (uint32_t)le16_get(entry + 20) << 16;
+            }
+            // Cluster 0 would open the root again; anything else outside
+            // the data area is a corrupt entry
+            if (child < 2 || child > walk->vol->cluster_count + 1) {
+                walk->bad_dirs++;
+                printf("%*s%s/  [broken directory entry - skipped]\n", indent, "", walk_name);
+                continue;
+            }
+            totals->dirs++;
+            printf("%*s%s/\n", indent, "", walk_name);
+
+            if (depth + 1 > walk->limits.max_depth) {
+                printf("%*s...\n", indent + 2, "");
+                walk->truncated = true;
+                continue;
+            }
+
+            fat_walk_totals_t sub = { 0, 0, 0, false };
+            fat_walk_directory(walk, child, depth + 1, &sub);
+            totals->files += sub.files;
+            totals->dirs += sub.dirs;
+            totals->bytes += sub.bytes;
+
+            char size[16];
+            fat_walk_format_size(sub.bytes, size, sizeof(size));
+            printf("%*s[%u files, %u dirs, %s]\n", indent + 2, "", sub.files, sub.dirs, size);
+        } else {
+            uint32_t bytes = le32_get(entry + 28);
+            totals->files++;
+            totals->bytes += bytes;
+
+            char size[16];
+            fat_walk_format_size(bytes, size, sizeof(size));
+            printf("%*s%-*s %10s\n", indent, "", 40 - indent, walk_name, size);
+        }
+
+        if (walk->status != 0) {
+            return;
+        }
+    } while (fat_dir_iter_advance(walk, &it));
+}
+
+int fat_walk_tree(fat_volume_t* vol, const fat_walk_limits_t* limits, fat_walk_totals_t* totals) {
+    fat_walk_t walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.vol = vol;
+    walk.limits.max_depth = limits ? limits->max_depth : FAT_WALK_MAX_DEPTH;
+    walk.limits.max_entries = limits ? limits->max_entries : FAT_WALK_MAX_ENTRIES;
+    walk_buffer_count = 0;
+
+    fat_walk_totals_t sum = { 0, 0, 0, false };
+    printf("/\n");
+    fat_walk_directory(&walk, 0, 0, &sum);
+    sum.truncated = walk.truncated;
+
+    char size[16];
+    fat_walk_format_size(sum.bytes, size, sizeof(size));
+    printf("Total: %u files, %u directories, %s%s\n", sum.files, sum.dirs, size,
+           walk.truncated ? " (listing truncated)" : "");
+    if (walk.bad_dirs) {
+        printf("%u broken directory entr%s skipped\n", walk.bad_dirs, walk.bad_dirs == 1 ? "y" : "ies");
+    }
+    if (walk.status != 0) {
+        printf("Directory read failed - listing incomplete\n");
+    }
+
+    if (totals) *totals = sum;
+    return walk.status;
+}
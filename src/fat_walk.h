@@ -0,0 +1,39 @@
+#ifndef FAT_WALK_H
+#define FAT_WALK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "fat_volume.h"
+
+// Read-only recursive directory listing for FAT12/16/32 volumes.
+// Directory cluster chains are resolved into contiguous runs and read with
+// multi-block transfers; long file names are assembled from their LFN
+// entries and each directory is followed by the totals of its subtree.
+
+#define FAT_WALK_MAX_DEPTH     8
+#define FAT_WALK_MAX_ENTRIES   512      // Entries listed before the walk stops
+#define FAT_WALK_READ_SECTORS  8        // Directory sectors per multi-block read
+#define FAT_WALK_NAME_MAX      256      // UTF-8 bytes, including terminator
+
+typedef struct {
+    uint8_t max_depth;              // 0 lists the root directory only
+    uint32_t max_entries;
+} fat_walk_limits_t;
+
+typedef struct {
+    uint32_t files;
+    uint32_t dirs;
+    uint64_t bytes;
+    bool truncated;                 // A depth or entry limit was hit
+} fat_walk_totals_t;
+
+// Helpers shared with the exFAT and ext listings.
+// UCS-2 to UTF-8; the name ends at the first 0x0000 (or 0xFFFF padding).
+void fat_walk_utf16_to_utf8(const uint16_t* chars, char* out, size_t size);
+void fat_walk_format_size(uint64_t bytes, char* out, size_t size);
+
+// Print the tree; limits may be NULL for the defaults, totals may be NULL
+int fat_walk_tree(fat_volume_t* vol, const fat_walk_limits_t* limits, fat_walk_totals_t* totals);
+
+#endif // FAT_WALK_H
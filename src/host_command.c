@@ -0,0 +1,401 @@
+#include "host_command.h"
+#include "host_link.h"
+#include "sd_block.h"
+#include "byte_order.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+#include <string.h>
+
+#define HOST_COMMAND_FRAME_MAX (HOST_COMMAND_HEADER_SIZE + HOST_COMMAND_MAX_PAYLOAD)
+
+typedef struct {
+    uint8_t command;
+    uint16_t sequence;
+    uint16_t payload_len;
+    const uint8_t* payload;
+} host_request_t;
+
+typedef struct {
+    sd_block_dev_t* dev;
+    format_options_t options;
+    bool replied;                   // response_frame holds the response to
+    uint16_t last_sequence;         // this request
+    uint32_t last_crc;              // Covers its command and payload too
+    secure_erase_mode_t erase_pending;  // Interrupted on the attached card, or NONE
+    uint32_t trace_next;
+} host_session_t;
+
+static uint8_t request_frame[HOST_COMMAND_FRAME_MAX];
+static uint8_t response_frame[HOST_COMMAND_FRAME_MAX];
+static uint32_t response_len;
+static host_command_trace_entry_t trace[HOST_COMMAND_TRACE_ENTRIES];
+static format_plan_t host_plan;
+
+static int host_read_byte(uint32_t timeout_us) {
+    int c = getchar_timeout_us(timeout_us);
+    return (c < 0) ? -1 : c;
+}
+
+// Next frame with a good header and CRC. Bytes that cannot start a frame
+// (console echo, a damaged frame's tail) are skipped one at a time.
+static host_command_status_t host_receive(host_request_t* request) {
+    uint8_t* h = request_frame;
+    for (;;) {
+        int c = host_read_byte(HOST_COMMAND_BYTE_TIMEOUT_US);
+        if (c != HOST_COMMAND_MAGIC0) {
+            continue;
+        }
+        do {
+            c = host_read_byte(HOST_COMMAND_BYTE_TIMEOUT_US);
+        } while (c == HOST_COMMAND_MAGIC0);
+        if (c != HOST_COMMAND_MAGIC1) {
+            continue;
+        }
+        h[0] = HOST_COMMAND_MAGIC0;
+        h[1] = HOST_COMMAND_MAGIC1;
+
+        int got = 2;
+        while (got < HOST_COMMAND_HEADER_SIZE && (c = host_read_byte(HOST_COMMAND_BYTE_TIMEOUT_US)) >= 0) {
+            h[got++] = (uint8_t)c;
+        }
+        if (got < HOST_COMMAND_HEADER_SIZE) {
+            continue;
+        }
+
+        request->command = h[2];
+        request->sequence = le16_get(h + 4);
+        request->payload_len = le16_get(h + 6);
+        request->payload = h + HOST_COMMAND_HEADER_SIZE;
+        if (request->payload_len > HOST_COMMAND_MAX_PAYLOAD) {
+            // Not a header after all, or a host that ignored max_payload
+            continue;
+        }
+
+        uint32_t total = HOST_COMMAND_HEADER_SIZE + request->payload_len;
+        while (got < (int)total && (c = host_read_byte(HOST_COMMAND_BYTE_TIMEOUT_US)) >= 0) {
+            h[got++] = (uint8_t)c;
+        }
+        if (got < (int)total) {
+            continue;
+        }
+
+        uint32_t crc = host_link_crc32(0, h, 8);
+        crc = host_link_crc32(crc, request->payload, request->payload_len);
+        return (crc == le32_get(h + 8)) ? HOST_STATUS_OK : HOST_STATUS_BAD_CRC;
+    }
+}
+
+// Build the response in response_frame; payload may already be in place at
+// response_frame + HOST_COMMAND_HEADER_SIZE
+static void host_send(const host_request_t* request, host_command_status_t status,
+                      const void* payload, uint16_t payload_len) {
+    uint8_t* h = response_frame;
+    uint8_t* body = h + HOST_COMMAND_HEADER_SIZE;
+    if (payload && payload != body) {
+        memcpy(body, payload, payload_len);
+    }
+    h[0] = HOST_COMMAND_MAGIC0;
+    h[1] = HOST_COMMAND_MAGIC1;
+    h[2] = request->command | HOST_CMD_RESPONSE;
+    h[3] = (uint8_t)status;
+    le16_put(h + 4, request->sequence);
+    le16_put(h + 6, payload_len);
+    uint32_t crc = host_link_crc32(0, h, 8);
+    le32_put(h + 8, host_link_crc32(crc, body, payload_len));
+
+    response_len = HOST_COMMAND_HEADER_SIZE + payload_len;
+    host_link_write(response_frame, response_len);
+    host_link_flush();
+}
+
+static void host_trace(host_session_t* session, const host_request_t* request,
+                       host_command_status_t status, uint32_t lba, uint64_t start_us) {
+    host_command_trace_entry_t* e = &trace[session->trace_next % HOST_COMMAND_TRACE_ENTRIES];
+    uint64_t now = time_us_64();
+    e->time_ms = (uint32_t)(now / 1000);
+    e->sequence = request->sequence;
+    e->command = request->command;
+    e->status = (uint8_t)status;
+    e->lba = lba;
+    e->elapsed_us = (uint32_t)(now - start_us);
+    session->trace_next++;
+}
+
+// Look up the checkpoint of an erase interrupted on the attached card
+static void host_check_erase(host_session_t* session) {
+    secure_erase_pending_t pending;
+    session->erase_pending = secure_erase_find_pending(session->dev, &pending)
+                             ? pending.mode : SECURE_ERASE_NONE;
+}
+
+// The card in slot 0, attached; NULL when there is none. A card that
+// stopped answering is detached so a replacement is picked up.
+static sd_block_dev_t* host_card(host_session_t* session) {
+    sd_block_dev_t* dev = session->dev;
+    if (sd_block_is_attached(dev) && !sd_block_card_present(dev)) {
+        sd_block_detach(dev);
+    }
+    if (!sd_block_is_attached(dev)) {
+        if (sd_block_attach(dev) != 0) {
+            session->erase_pending = SECURE_ERASE_NONE;
+            return NULL;
+        }
+        host_check_erase(session);
+    }
+    return dev;
+}
+
+static host_command_status_t host_get_info(host_session_t* session, host_command_info_t* info) {
+    memset(info, 0, sizeof(*info));
+    info->version = HOST_COMMAND_VERSION;
+    info->max_payload = HOST_COMMAND_MAX_PAYLOAD;
+
+    sd_block_dev_t* dev = host_card(session);
+    if (dev) {
+        info->card_blocks = sd_block_get_block_count(dev);
+        info->au_sectors = sd_block_au_sectors(dev);
+        info->ready_us = dev->ready_us;
+        info->erase_value = sd_block_erase_value(dev);
+        info->erase_pending = (uint8_t)session->erase_pending;
+        sd_block_read_cid(dev, info->cid);
+    }
+    return HOST_STATUS_OK;
+}
+
+static host_command_status_t host_set_options(host_session_t* session, const host_request_t* request) {
+    host_command_options_t in;
+    if (request->payload_len != sizeof(in)) {
+        return HOST_STATUS_BAD_ARGUMENT;
+    }
+    memcpy(&in, request->payload, sizeof(in));
+    // The formatter cannot build exFAT volumes yet
+    if (in.partition_table > PARTITION_TABLE_GPT || in.filesystem >= FILESYSTEM_EXFAT ||
+        in.secure_erase > SECURE_ERASE_CARD || memchr(in.volume_label, '\0', sizeof(in.volume_label)) == NULL) {
+        return HOST_STATUS_BAD_ARGUMENT;
+    }
+
+    format_options_t* options = &session->options;
+    options->partition_table = (partition_table_type_t)in.partition_table;
+    options->filesystem = (filesystem_type_t)in.filesystem;
+    options->quick_format = in.quick_format != 0;
+    options->dry_run = in.dry_run != 0;
+    options->secure_erase = (secure_erase_mode_t)in.secure_erase;
+    memcpy(options->volume_label, in.volume_label, sizeof(options->volume_label));
+    return HOST_STATUS_OK;
+}
+
+static void host_get_options(const host_session_t* session, host_command_options_t* out) {
+    const format_options_t* options = &session->options;
+    memset(out, 0, sizeof(*out));
+    out->partition_table = (uint8_t)options->partition_table;
+    out->filesystem = (uint8_t)options->filesystem;
+    out->quick_format = options->quick_format;
+    out->dry_run = options->dry_run;
+    out->secure_erase = (uint8_t)options->secure_erase;
+    memcpy(out->volume_label, options->volume_label, sizeof(out->volume_label));
+}
+
+// FORMAT applies the plan for the current options; VERIFY compares the card
+// with it. Identifiers derive from the CID, so a formatted card verifies clean.
+static host_command_status_t host_format(host_session_t* session, bool verify,
+                                         write_plan_report_t* report) {
+    memset(report, 0, sizeof(*report));
+    sd_block_dev_t* dev = host_card(session);
+    if (!dev) {
+        return HOST_STATUS_NO_CARD;
+    }
+    const format_options_t* options = &session->options;
+    bool dry_run = verify || options->dry_run;
+
+    if (!dry_run && options->secure_erase != SECURE_ERASE_NONE) {
+        int status = secure_erase_run(dev, options->secure_erase, (uint32_t)time_us_64(), NULL);
+        host_check_erase(session);
+        if (status != 0) {
+            return HOST_STATUS_IO_ERROR;
+        }
+    }
+
+    uint8_t cid[16];
+    if (sd_block_read_cid(dev, cid) != 0) {
+        return HOST_STATUS_IO_ERROR;
+    }
+    // The options do not fit this card; the card itself is fine
+    if (sd_formatter_build_plan(&host_plan, options, sd_block_get_block_count(dev),
+                                sd_block_au_sectors(dev)) != 0) {
+        return HOST_STATUS_BAD_ARGUMENT;
+    }
+    sd_formatter_stamp_ids(&host_plan, cid);
+
+    if (write_plan_execute(&host_plan.plan, dev, dry_run, report) != 0) {
+        return HOST_STATUS_IO_ERROR;
+    }
+    if (verify && (report->sectors_written || report->sectors_erased)) {
+        return HOST_STATUS_MISMATCH;
+    }
+    return HOST_STATUS_OK;
+}
+
+static host_command_status_t host_resume_erase(host_session_t* session) {
+    sd_block_dev_t* dev = host_card(session);
+    if (!dev) {
+        return HOST_STATUS_NO_CARD;
+    }
+    if (session->options.dry_run || session->erase_pending == SECURE_ERASE_NONE) {
+        return HOST_STATUS_BAD_ARGUMENT;
+    }
+
+    int status = secure_erase_resume_pending(dev, NULL);
+    host_check_erase(session);
+    return (status < 0) ? HOST_STATUS_IO_ERROR : HOST_STATUS_OK;
+}
+
+// READ and WRITE: the extent must lie on the card and match the payload
+static host_command_status_t host_check_extent(host_session_t* session, const host_request_t* request,
+                                               host_command_extent_t* extent, sd_block_dev_t** dev) {
+    if (request->payload_len < sizeof(*extent)) {
+        return HOST_STATUS_BAD_ARGUMENT;
+    }
+    extent->lba = le32_get(request->payload);
+    extent->count = le16_get(request->payload + 4);
+    uint32_t data_len = (request->command == HOST_CMD_WRITE) ? extent->count * SD_BLOCK_SIZE : 0;
+    if (extent->count == 0 || extent->count > HOST_COMMAND_MAX_BLOCKS ||
+        request->payload_len != sizeof(*extent) + data_len) {
+        return HOST_STATUS_BAD_ARGUMENT;
+    }
+    if (request->command == HOST_CMD_WRITE && session->options.dry_run) {
+        return HOST_STATUS_BAD_ARGUMENT;
+    }
+
+    *dev = host_card(session);
+    if (!*dev) {
+        return HOST_STATUS_NO_CARD;
+    }
+    if (extent->lba >= sd_block_get_block_count(*dev) ||
+        extent->count > sd_block_get_block_count(*dev) - extent->lba) {
+        return HOST_STATUS_BAD_ARGUMENT;
+    }
+    return HOST_STATUS_OK;
+}
+
+static uint16_t host_fetch_trace(const host_session_t* session, const host_request_t* request,
+                                 uint8_t* out) {
+    uint32_t first = (request->payload_len >= 4) ? le32_get(request->payload) : 0;
+    uint32_t oldest = (session->trace_next > HOST_COMMAND_TRACE_ENTRIES)
+                      ? session->trace_next - HOST_COMMAND_TRACE_ENTRIES : 0;
+    if (first < oldest) first = oldest;
+    if (first > session->trace_next) first = session->trace_next;
+
+    host_command_trace_t header = { session->trace_next, 0 };
+    uint8_t* p = out + sizeof(header);
+    for (uint32_t i = first; i < session->trace_next; i++) {
+        memcpy(p, &trace[i % HOST_COMMAND_TRACE_ENTRIES], sizeof(host_command_trace_entry_t));
+        p += sizeof(host_command_trace_entry_t);
+        header.count++;
+    }
+    memcpy(out, &header, sizeof(header));
+    return (uint16_t)(p - out);
+}
+
+static void host_handle(host_session_t* session, const host_request_t* request) {
+    uint64_t start_us = time_us_64();
+    uint8_t* body = response_frame + HOST_COMMAND_HEADER_SIZE;
+    host_command_status_t status = HOST_STATUS_OK;
+    uint16_t len = 0;
+    uint32_t lba = 0;
+
+    switch (request->command) {
+        case HOST_CMD_GET_INFO: {
+            host_command_info_t info;
+            status = host_get_info(session, &info);
+            memcpy(body, &info, sizeof(info));
+            len = sizeof(info);
+            break;
+        }
+        case HOST_CMD_SET_OPTIONS: {
+            status = host_set_options(session, request);
+            host_command_options_t options;
+            host_get_options(session, &options);
+            memcpy(body, &options, sizeof(options));
+            len = sizeof(options);
+            break;
+        }
+        case HOST_CMD_FORMAT:
+        case HOST_CMD_VERIFY: {
+            write_plan_report_t report;
+            status = host_format(session, request->command == HOST_CMD_VERIFY, &report);
+            memcpy(body, &report, sizeof(report));
+            len = sizeof(report);
+            break;
+        }
+        case HOST_CMD_READ:
+        case HOST_CMD_WRITE: {
+            host_command_extent_t extent;
+            sd_block_dev_t* dev = NULL;
+            status = host_check_extent(session, request, &extent, &dev);
+            if (status != HOST_STATUS_OK) break;
+            lba = extent.lba;
+            int result;
+            if (request->command == HOST_CMD_READ) {
+                result = sd_block_read_blocks(dev, extent.lba, extent.count, body);
+                len = (result == 0) ? extent.count * SD_BLOCK_SIZE : 0;
+            } else {
+                result = sd_block_write_blocks(dev, extent.lba, extent.count,
+                                               request->payload + sizeof(extent));
+            }
+            if (result != 0) {
+                status = HOST_STATUS_IO_ERROR;
+            }
+            break;
+        }
+        case HOST_CMD_FETCH_TRACE:
+            len = host_fetch_trace(session, request, body);
+            break;
+        case HOST_CMD_RESUME_ERASE:
+            status = host_resume_erase(session);
+            break;
+        default:
+            status = HOST_STATUS_BAD_COMMAND;
+            break;
+    }
+
+    if (status == HOST_STATUS_IO_ERROR) {
+        // Re-identify the card on the next command
+        sd_block_detach(session->dev);
+    }
+    host_trace(session, request, status, lba, start_us);
+    host_send(request, status, body, len);
+}
+
+void host_command_run(const format_options_t* options) {
+    static host_session_t session;
+    memset(&session, 0, sizeof(session));
+    session.dev = sd_block_slot(0);
+    session.options = *options;
+
+    printf("Host command mode: binary protocol v%d on USB serial\n", HOST_COMMAND_VERSION);
+
+    // Report an interrupted secure erase now; RESUME_ERASE continues it
+    host_card(&session);
+
+    for (;;) {
+        host_request_t request;
+        if (host_receive(&request) != HOST_STATUS_OK) {
+            host_send(&request, HOST_STATUS_BAD_CRC, NULL, 0);
+            session.replied = false;
+            continue;
+        }
+
+        uint32_t crc = le32_get(request_frame + 8);
+        if (session.replied && request.sequence == session.last_sequence &&
+            crc == session.last_crc) {
+            host_link_write(response_frame, response_len);
+            host_link_flush();
+            continue;
+        }
+
+        host_handle(&session, &request);
+        session.replied = true;
+        session.last_sequence = request.sequence;
+        session.last_crc = crc;
+    }
+}
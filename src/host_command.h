@@ -0,0 +1,123 @@
+#ifndef HOST_COMMAND_H
+#define HOST_COMMAND_H
+
+#include <stdint.h>
+#include "sd_formatter.h"
+
+// Binary request/response protocol over the USB CDC port, for test rigs
+// that drive the formatter from a script (see tools/sdform_client.py).
+//
+// Every frame is a 12-byte little-endian header followed by payload_len
+// bytes of payload:
+//
+//   offset size field
+//   0      2    magic "SC"
+//   2      1    command (HOST_CMD_*); responses set HOST_CMD_RESPONSE
+//   3      1    status (HOST_STATUS_*), 0 in requests
+//   4      2    sequence, echoed in the response
+//   6      2    payload_len (at most HOST_COMMAND_MAX_PAYLOAD)
+//   8      4    crc32 of header bytes 0-7 followed by the payload
+//
+// Requests are handled in order, so a host may send several before reading
+// the responses. A request repeating the sequence and CRC (so also the
+// command and payload) of the one just handled is not run again: its
+// response is resent, so a host can retry after a lost response without
+// formatting or writing twice.
+//
+// A secure erase interrupted on the inserted card is reported in GET_INFO
+// and only continued by RESUME_ERASE, which like FORMAT needs dry run
+// cleared (BAD_ARGUMENT otherwise, or when nothing is pending). WRITE is
+// refused with BAD_ARGUMENT while dry run is set as well. Hosts start each session at a random
+// sequence so a new run never matches the previous run's last request.
+// Console text printed while a command runs only ever falls between
+// frames; hosts skip it by scanning for the magic and checking the CRC.
+
+#define HOST_COMMAND_MAGIC0 'S'
+#define HOST_COMMAND_MAGIC1 'C'
+#define HOST_COMMAND_HEADER_SIZE 12
+#define HOST_COMMAND_VERSION 1
+
+// Blocks per READ or WRITE request
+#define HOST_COMMAND_MAX_BLOCKS 8
+#define HOST_COMMAND_MAX_PAYLOAD (8 + HOST_COMMAND_MAX_BLOCKS * SD_BLOCK_SIZE)
+
+// A frame whose bytes stop arriving for this long is dropped
+#define HOST_COMMAND_BYTE_TIMEOUT_US (100 * 1000)
+
+// Commands traced for FETCH_TRACE, oldest overwritten first
+#define HOST_COMMAND_TRACE_ENTRIES 64
+
+#define HOST_CMD_RESPONSE 0x80
+
+typedef enum {
+    HOST_CMD_GET_INFO = 0x01,       // -> host_command_info_t
+    HOST_CMD_SET_OPTIONS = 0x02,    // host_command_options_t -> the options now in use
+    HOST_CMD_FORMAT = 0x03,         // -> write_plan_report_t
+    HOST_CMD_VERIFY = 0x04,         // -> write_plan_report_t of a dry run
+    HOST_CMD_READ = 0x05,           // host_command_extent_t -> block data
+    HOST_CMD_WRITE = 0x06,          // host_command_extent_t + block data, needs dry run cleared
+    HOST_CMD_FETCH_TRACE = 0x07,    // uint32_t first index -> host_command_trace_t + entries
+    HOST_CMD_RESUME_ERASE = 0x08    // Continue the card's interrupted secure erase
+} host_command_code_t;
+
+typedef enum {
+    HOST_STATUS_OK = 0,
+    HOST_STATUS_BAD_CRC = 1,        // Sequence and command may be wrong too
+    HOST_STATUS_BAD_COMMAND = 2,
+    HOST_STATUS_BAD_ARGUMENT = 3,
+    HOST_STATUS_NO_CARD = 4,
+    HOST_STATUS_IO_ERROR = 5,
+    HOST_STATUS_MISMATCH = 6        // VERIFY: the card differs from the format
+} host_command_status_t;
+
+typedef struct {
+    uint16_t version;               // HOST_COMMAND_VERSION
+    uint16_t max_payload;
+    uint32_t card_blocks;           // 0 when no card is attached
+    uint32_t au_sectors;
+    uint32_t ready_us;              // Card identification time
+    uint8_t cid[16];
+    uint8_t erase_value;
+    uint8_t erase_pending;          // secure_erase_mode_t of an interrupted erase, 0 if none
+    uint8_t reserved[2];
+} host_command_info_t;
+
+typedef struct {
+    uint8_t partition_table;        // partition_table_type_t
+    uint8_t filesystem;             // filesystem_type_t, FAT12 to FAT32 (no exFAT yet)
+    uint8_t quick_format;
+    uint8_t dry_run;                // Set by default: clear it to write the card
+    uint8_t secure_erase;           // secure_erase_mode_t, run before FORMAT
+    uint8_t reserved[3];
+    char volume_label[12];
+} host_command_options_t;
+
+typedef struct {
+    uint32_t lba;
+    uint16_t count;                 // 1 .. HOST_COMMAND_MAX_BLOCKS
+    uint16_t reserved;
+} host_command_extent_t;
+
+typedef struct {
+    uint32_t time_ms;               // Since boot, when the command finished
+    uint16_t sequence;
+    uint8_t command;
+    uint8_t status;
+    uint32_t lba;                   // READ and WRITE, 0 otherwise
+    uint32_t elapsed_us;
+} host_command_trace_entry_t;
+
+typedef struct {
+    uint32_t next;                  // Index the next traced command will get
+    uint32_t count;                 // Entries that follow
+} host_command_trace_t;
+
+_Static_assert(sizeof(host_command_info_t) == 36, "info layout");
+_Static_assert(sizeof(host_command_options_t) == 20, "options layout");
+_Static_assert(sizeof(host_command_extent_t) == 8, "extent layout");
+_Static_assert(sizeof(host_command_trace_entry_t) == 16, "trace entry layout");
+
+// Serve requests on slot 0 forever, starting from options
+void host_command_run(const format_options_t* options);
+
+#endif // HOST_COMMAND_H
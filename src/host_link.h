@@ -0,0 +1,15 @@
+#ifndef HOST_LINK_H
+#define HOST_LINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Raw binary output to the USB CDC host, bypassing printf's CR/LF translation
+
+void host_link_write(const void* data, size_t len);
+void host_link_flush(void);
+
+// CRC-32 (IEEE 802.3, as used by zlib/GPT); pass 0 to start a new checksum
+uint32_t host_link_crc32(uint32_t crc, const void* data, size_t len);
+
+#endif // HOST_LINK_H
@@ -2,26 +2,96 @@
 #include <stdlib.h>
 #include <string.h>
 #include "pico/stdlib.h"
+#include "pico/stdio_usb.h"
 #include "sd_analyzer.h"
 #include "sd_formatter.h"
+#include "sd_dump.h"
+#include "sd_block.h"
+#include "write_plan.h"
+#include "batch.h"
+#include "duplicator.h"
+#include "secure_erase.h"
+#include "host_command.h"
 
 #define VERSION "1.3.1"
 
+// Build with -DSDFORMATTER_BATCH_MODE=1 for unattended production runs
+#ifndef SDFORMATTER_BATCH_MODE
+#define SDFORMATTER_BATCH_MODE 0
+#endif
+
+// Two-slot duplicator: 1 = format both slots in parallel, 2 = clone slot 0 to slot 1
+#ifndef SDFORMATTER_DUPLICATOR_MODE
+#define SDFORMATTER_DUPLICATOR_MODE 0
+#endif
+
+// Build with -DSDFORMATTER_HOST_MODE=1 to be driven by the binary host protocol
+#ifndef SDFORMATTER_HOST_MODE
+#define SDFORMATTER_HOST_MODE 0
+#endif
+
+// Longest wait for a host to open the USB serial port before carrying on
+#ifndef SDFORMATTER_USB_WAIT_MS
+#define SDFORMATTER_USB_WAIT_MS 2000
+#endif
+
+// Wait until the host opens the USB serial port, at most timeout_ms
+static bool wait_for_usb(uint32_t timeout_ms) {
+    absolute_time_t deadline = make_timeout_time_ms(timeout_ms);
+    while (!stdio_usb_connected()) {
+        if (time_reached(deadline)) return false;
+        sleep_ms(10);
+    }
+    return true;
+}
+
 int main() {
     stdio_init_all();
     
-    // Wait for USB serial to be ready
-    sleep_ms(2000);
+    // Bring the card up while USB enumerates rather than after it; anything
+    // printed before the host connects is dropped, so the timing is repeated
+    // below. The batch, duplicator and host command modes attach their own
+    // cards and never return.
+    sd_block_dev_t* dev = sd_block_slot(0);
+    int card_status = 0;
+#if !SDFORMATTER_DUPLICATOR_MODE && !SDFORMATTER_BATCH_MODE && !SDFORMATTER_HOST_MODE
+    card_status = sd_block_attach(dev);
+#endif
+    
+    bool usb_connected = wait_for_usb(SDFORMATTER_USB_WAIT_MS);
     
     // Display startup banner
     sd_analyzer_print_banner("SD Card Formatter", VERSION);
+    printf("Ready %u ms after boot (USB serial %s)\n", to_ms_since_boot(get_absolute_time()),
+           usb_connected ? "connected" : "not connected");
+    if (sd_block_is_attached(dev)) {
+        printf("Card ready in %u.%u ms (%u ACMD41 polls), %u blocks\n", dev->ready_us / 1000,
+               dev->ready_us % 1000 / 100, dev->op_cond_polls, sd_block_get_block_count(dev));
+    }
     
-    // Initialize SD card
-    if (sd_analyzer_init() != 0) {
+#if SDFORMATTER_DUPLICATOR_MODE
+    static format_options_t station_options;
+    sd_formatter_get_format_options(&station_options);
+    duplicator_run((duplicator_mode_t)SDFORMATTER_DUPLICATOR_MODE, &station_options);
+#elif SDFORMATTER_BATCH_MODE
+    format_options_t batch_options;
+    sd_formatter_get_format_options(&batch_options);
+    batch_run(0, &batch_options);
+#elif SDFORMATTER_HOST_MODE
+    format_options_t host_options;
+    sd_formatter_get_format_options(&host_options);
+    host_command_run(&host_options);
+#endif
+    
+    if (card_status != 0) {
         printf("Cannot proceed without SD card initialization\n");
         while (1) sleep_ms(1000);
     }
     
+    // Report a secure erase that a power loss or reset cut short on this
+    // card; it is only continued when the options ask for it
+    bool erase_pending = secure_erase_find_pending(dev, NULL);
+    
     // Show current card content
     printf("\nAnalyzing current SD card content...\n");
     int partition_count = sd_formatter_show_card_content();
@@ -33,7 +103,7 @@ int main() {
     
     // Get SD card analysis for confirmation
     sd_analysis_t analysis;
-    if (sd_analyzer_get_info(&analysis) != 0) {
+    if (sd_formatter_get_info(&analysis) != 0) {
         printf("Failed to get SD card information\n");
         while (1) sleep_ms(1000);
     }
@@ -55,41 +125,73 @@ int main() {
     // Print format summary
     sd_formatter_print_format_summary(&options, &analysis);
     
-    // Perform the format operation (simulated for safety)
+    // Compile the whole format into one write plan, then apply it
     printf("\n=== BEGINNING FORMAT OPERATION ===\n");
     
-    printf("Step 1: Wiping existing data...\n");
-    if (sd_formatter_wipe_card() != 0) {
-        printf("Failed to wipe SD card\n");
-        while (1) sleep_ms(1000);
+    if (options.backup_before_format) {
+        printf("Step 0: Dumping used card contents to host...\n");
+        if (sd_dump_card(NULL) != 0) {
+            printf("Backup dump failed - nothing has been erased\n");
+            while (1) sleep_ms(1000);
+        }
     }
     
-    printf("\nStep 2: Creating partition table...\n");
-    if (sd_formatter_create_partition_table(options.partition_table, analysis.card_info.blocks) != 0) {
-        printf("Failed to create partition table\n");
+    if (!sd_block_is_attached(dev) && sd_block_attach(dev) != 0) {
+        printf("Failed to access SD card for writing\n");
         while (1) sleep_ms(1000);
     }
+    uint8_t cid[16] = {0};
+    sd_block_read_cid(dev, cid);
+    
+    int erase_resumed = 0;
+    if (erase_pending) {
+        if (!options.resume_secure_erase) {
+            printf("Interrupted secure erase left as is - set resume_secure_erase to continue it\n");
+        } else if (options.dry_run) {
+            printf("Resuming the interrupted secure erase skipped in dry run\n");
+        } else if ((erase_resumed = secure_erase_resume_pending(dev, NULL)) < 0) {
+            printf("Resumed secure erase failed - card not formatted\n");
+            while (1) sleep_ms(1000);
+        }
+    }
     
-    printf("\nStep 3: Formatting filesystem...\n");
-    uint32_t partition_start = (options.partition_table == PARTITION_TABLE_GPT) ? 2048 : 2048; // Standard alignment
-    uint32_t partition_size = analysis.card_info.blocks - partition_start - 1024; // Leave some space at end
+    if (options.secure_erase != SECURE_ERASE_NONE) {
+        if (erase_resumed) {
+            printf("Secure erase already completed by the resumed run\n");
+        } else if (options.dry_run) {
+            printf("Secure erase (%s) skipped in dry run\n", secure_erase_mode_name(options.secure_erase));
+        } else if (secure_erase_run(dev, options.secure_erase, (uint32_t)time_us_64(), NULL) != 0) {
+            printf("Secure erase failed - card not formatted\n");
+            while (1) sleep_ms(1000);
+        }
+    }
     
-    if (sd_formatter_format_partition(partition_start, partition_size, 
-                                     options.filesystem, options.volume_label) != 0) {
-        printf("Failed to format partition\n");
+    static format_plan_t format_plan;
+    if (sd_formatter_build_plan(&format_plan, &options, sd_block_get_block_count(dev),
+                                sd_block_au_sectors(dev)) != 0) {
+        printf("Failed to build format plan\n");
+        while (1) sleep_ms(1000);
+    }
+    sd_formatter_stamp_ids(&format_plan, cid);
+    
+    printf("\nStep 4: Writing changed sectors...\n");
+    write_plan_print(&format_plan.plan);
+    write_plan_report_t report;
+    if (write_plan_execute(&format_plan.plan, dev, options.dry_run, &report) != 0) {
+        printf("Failed to apply write plan\n");
         while (1) sleep_ms(1000);
     }
     
     printf("\n=== FORMAT COMPLETE ===\n");
-    printf("\n*** IMPORTANT NOTE ***\n");
-    printf("This is a SIMULATION for safety. To enable actual formatting:\n");
-    printf("1. Implement sd_write_block() function in sd_card.c\n");
-    printf("2. Add proper MBR/GPT creation logic\n");
-    printf("3. Add FAT filesystem creation logic\n");
-    printf("4. Enable confirmation in sd_formatter_confirm_format()\n");
-    printf("5. Test thoroughly with non-important SD cards first!\n");
-    
-    printf("\nFormatter ready for development. System will now idle.\n");
+    if (options.dry_run) {
+        printf("\n*** IMPORTANT NOTE ***\n");
+        printf("This was a DRY RUN - no sectors were written.\n");
+        printf("To write the card, enable confirmation in sd_formatter_confirm_format()\n");
+        printf("and clear dry_run in sd_formatter_get_format_options().\n");
+        printf("Test thoroughly with non-important SD cards first!\n");
+    }
+    
+    printf("\nFormatter finished. System will now idle.\n");
     
     // Keep the program running
     while (1) {
@@ -0,0 +1,506 @@
+#include "sd_block.h"
+#include "hardware/spi.h"
+#include "hardware/gpio.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+#include <string.h>
+
+#define SD_BLOCK_FAST_BAUDRATE  (12500 * 1000)
+#define SD_BLOCK_SAFE_BAUDRATE  (1000 * 1000)
+#define SD_BLOCK_PROBE_BAUDRATE (400 * 1000)
+
+// SPI-mode command indices (sent as 0x40 | index)
+#define SD_CMD_GO_IDLE_STATE        0
+#define SD_CMD_SEND_IF_COND         8
+#define SD_CMD_SEND_CSD             9
+#define SD_CMD_SEND_CID             10
+#define SD_CMD_STOP_TRANSMISSION    12
+#define SD_CMD_SEND_STATUS          13
+#define SD_CMD_SET_BLOCKLEN         16
+#define SD_CMD_READ_SINGLE_BLOCK    17
+#define SD_CMD_READ_MULTIPLE_BLOCK  18
+#define SD_CMD_WRITE_BLOCK          24
+#define SD_CMD_WRITE_MULTIPLE_BLOCK 25
+#define SD_CMD_ERASE_WR_BLK_START   32
+#define SD_CMD_ERASE_WR_BLK_END     33
+#define SD_CMD_ERASE                38
+#define SD_CMD_APP_CMD              55
+#define SD_CMD_READ_OCR             58
+#define SD_ACMD_SD_SEND_OP_COND     41
+#define SD_ACMD_SD_STATUS           13
+#define SD_ACMD_SEND_SCR            51
+
+#define SD_TOKEN_START_BLOCK    0xFE
+#define SD_TOKEN_START_MULTI    0xFC
+#define SD_TOKEN_STOP_TRAN      0xFD
+#define SD_DATA_ACCEPTED        0x05
+#define SD_READY_TIMEOUT_US     (500 * 1000)
+#define SD_TOKEN_TIMEOUT_US     (200 * 1000)
+#define SD_INIT_TIMEOUT_US      (1000 * 1000)
+
+// ACMD41 polling starts tight and backs off: most cards are ready within
+// tens of milliseconds, and a fixed 10 ms interval overshoots by up to that
+#define SD_INIT_POLL_MIN_US     100
+#define SD_INIT_POLL_MAX_US     (4 * 1000)
+
+#define SD_IF_COND_CHECK        0x1AA       // 2.7-3.6V, check pattern 0xAA
+#define SD_OCR_HCS              0x40000000  // Host supports high capacity
+#define SD_OCR_CCS              0x40000000  // Card is high capacity
+
+// Erase busy time budget: a fixed base plus a per-4MB allowance
+#define SD_ERASE_TIMEOUT_BASE_US    (1000 * 1000)
+#define SD_ERASE_TIMEOUT_PER_4MB_US (250 * 1000)
+
+static sd_block_dev_t slots[SD_BLOCK_SLOTS] = {
+    { .index = 0, .pin_sck = SD_BLOCK_PIN_SCK, .pin_mosi = SD_BLOCK_PIN_MOSI,
+      .pin_miso = SD_BLOCK_PIN_MISO, .pin_cs = SD_BLOCK_PIN_CS },
+    { .index = 1, .pin_sck = SD_BLOCK_SLOT1_PIN_SCK, .pin_mosi = SD_BLOCK_SLOT1_PIN_MOSI,
+      .pin_miso = SD_BLOCK_SLOT1_PIN_MISO, .pin_cs = SD_BLOCK_SLOT1_PIN_CS },
+};
+
+static void sd_block_cs_select(sd_block_dev_t* dev) {
+    gpio_put(dev->pin_cs, 0);
+}
+
+static void sd_block_cs_deselect(sd_block_dev_t* dev) {
+    gpio_put(dev->pin_cs, 1);
+    // One extra byte so the card releases MISO
+    uint8_t ff = 0xFF;
+    spi_write_blocking(dev->spi, &ff, 1);
+}
+
+static uint8_t sd_block_xfer(sd_block_dev_t* dev, uint8_t data) {
+    uint8_t rx;
+    spi_write_read_blocking(dev->spi, &data, &rx, 1);
+    return rx;
+}
+
+static bool sd_block_wait_ready(sd_block_dev_t* dev, uint32_t timeout_us) {
+    absolute_time_t deadline = make_timeout_time_us(timeout_us);
+    do {
+        if (sd_block_xfer(dev, 0xFF) == 0xFF) return true;
+    } while (!time_reached(deadline));
+    return false;
+}
+
+static uint8_t sd_block_command(sd_block_dev_t* dev, uint8_t cmd, uint32_t arg) {
+    // CMD12 interrupts a running multi-block read, so it cannot wait for idle
+    if (cmd != SD_CMD_STOP_TRANSMISSION && !sd_block_wait_ready(dev, SD_READY_TIMEOUT_US)) {
+        return 0xFF;
+    }
+
+    uint8_t packet[6] = {
+        (uint8_t)(0x40 | cmd),
+        (uint8_t)(arg >> 24), (uint8_t)(arg >> 16),
+        (uint8_t)(arg >> 8), (uint8_t)arg,
+        // CRC is ignored in SPI mode after CMD0/CMD8
+        (uint8_t)(cmd == SD_CMD_GO_IDLE_STATE ? 0x95 :
+                  cmd == SD_CMD_SEND_IF_COND ? 0x87 : 0x01)
+    };
+    spi_write_blocking(dev->spi, packet, sizeof(packet));
+
+    // CMD12 is followed by a stuff byte before the response
+    if (cmd == SD_CMD_STOP_TRANSMISSION) {
+        sd_block_xfer(dev, 0xFF);
+    }
+
+    uint8_t response = 0xFF;
+    for (int i = 0; i < 10; i++) {
+        response = sd_block_xfer(dev, 0xFF);
+        if ((response & 0x80) == 0) break;
+    }
+    return response;
+}
+
+// Wait for a data token and read one data block plus CRC
+static int sd_block_receive(sd_block_dev_t* dev, uint8_t* buffer, uint32_t len) {
+    absolute_time_t deadline = make_timeout_time_us(SD_TOKEN_TIMEOUT_US);
+    uint8_t token;
+    do {
+        token = sd_block_xfer(dev, 0xFF);
+        if (token != 0xFF) break;
+    } while (!time_reached(deadline));
+
+    if (token != SD_TOKEN_START_BLOCK) {
+        return -1;
+    }
+
+    spi_read_blocking(dev->spi, 0xFF, buffer, len);
+
+    // CRC (ignored)
+    uint8_t crc[2];
+    spi_read_blocking(dev->spi, 0xFF, crc, sizeof(crc));
+    return 0;
+}
+
+// Send one data block with the given start token and check the data response
+static int sd_block_transmit(sd_block_dev_t* dev, uint8_t token, const uint8_t* buffer) {
+    uint8_t crc[2] = {0xFF, 0xFF};
+
+    sd_block_xfer(dev, token);
+    spi_write_blocking(dev->spi, buffer, SD_BLOCK_SIZE);
+    spi_write_blocking(dev->spi, crc, sizeof(crc));
+
+    uint8_t response = sd_block_xfer(dev, 0xFF);
+    if ((response & 0x1F) != SD_DATA_ACCEPTED) {
+        return -1;
+    }
+    return sd_block_wait_ready(dev, SD_READY_TIMEOUT_US) ? 0 : -1;
+}
+
+static int sd_block_read_register(sd_block_dev_t* dev, uint8_t cmd, bool app_cmd, uint8_t* reg, uint32_t len) {
+    sd_block_cs_select(dev);
+    uint8_t response = 0x00;
+    if (app_cmd) {
+        response = sd_block_command(dev, SD_CMD_APP_CMD, 0);
+    }
+    if (response <= 0x01) {
+        response = sd_block_command(dev, cmd, 0);
+    }
+    int result = (response == 0x00) ? sd_block_receive(dev, reg, len) : -1;
+    sd_block_cs_deselect(dev);
+    return result;
+}
+
+// Allocation unit in 512-byte blocks from the AU_SIZE field of SD Status
+static uint32_t sd_block_ssr_au_sectors(const uint8_t ssr[64]) {
+    static const uint16_t large_au_mb[] = { 12, 16, 24, 32, 64 };
+    uint8_t code = ssr[10] >> 4;
+
+    if (code == 0) return 0;
+    if (code <= 10) return 32u << (code - 1);           // 16 KB .. 8 MB
+    return (uint32_t)large_au_mb[code - 11] * 2048;     // 12 MB .. 64 MB
+}
+
+// Capacity in 512-byte blocks from a CSD v1.0 or v2.0 register
+static uint32_t sd_block_csd_capacity(const uint8_t csd[16]) {
+    uint8_t structure = csd[0] >> 6;
+
+    if (structure == 1) {
+        uint32_t c_size = ((uint32_t)(csd[7] & 0x3F) << 16) |
+                          ((uint32_t)csd[8] << 8) | csd[9];
+        return (c_size + 1) * 1024;
+    }
+
+    if (structure == 0) {
+        uint32_t read_bl_len = csd[5] & 0x0F;
+        uint32_t c_size = ((uint32_t)(csd[6] & 0x03) << 10) |
+                          ((uint32_t)csd[7] << 2) | (csd[8] >> 6);
+        uint32_t c_size_mult = ((csd[9] & 0x03) << 1) | (csd[10] >> 7);
+        return (c_size + 1) << (c_size_mult + 2 + read_bl_len - 9);
+    }
+
+    return 0;
+}
+
+sd_block_dev_t* sd_block_slot(int index) {
+    if (index < 0 || index >= SD_BLOCK_SLOTS) return NULL;
+    sd_block_dev_t* dev = &slots[index];
+    if (!dev->spi) {
+        dev->spi = (index == 0) ? spi0 : spi1;
+    }
+    return dev;
+}
+
+// Configure the slot's pins and SPI controller at identification speed and
+// give the card the 74+ clocks with CS high it needs before the first command
+static void sd_block_bus_init(sd_block_dev_t* dev) {
+    spi_init(dev->spi, SD_BLOCK_PROBE_BAUDRATE);
+    gpio_set_function(dev->pin_sck, GPIO_FUNC_SPI);
+    gpio_set_function(dev->pin_mosi, GPIO_FUNC_SPI);
+    gpio_set_function(dev->pin_miso, GPIO_FUNC_SPI);
+    gpio_pull_up(dev->pin_miso);
+    gpio_init(dev->pin_cs);
+    gpio_set_dir(dev->pin_cs, GPIO_OUT);
+    gpio_put(dev->pin_cs, 1);
+
+    uint8_t ff[10];
+    memset(ff, 0xFF, sizeof(ff));
+    spi_write_blocking(dev->spi, ff, sizeof(ff));
+}
+
+static uint32_t sd_block_read_r3(sd_block_dev_t* dev) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value = (value << 8) | sd_block_xfer(dev, 0xFF);
+    }
+    return value;
+}
+
+// Repeat ACMD41 until the card leaves the idle state
+static bool sd_block_wait_op_cond(sd_block_dev_t* dev, uint32_t arg) {
+    absolute_time_t deadline = make_timeout_time_us(SD_INIT_TIMEOUT_US);
+    uint32_t interval_us = SD_INIT_POLL_MIN_US;
+    do {
+        uint8_t response = sd_block_command(dev, SD_CMD_APP_CMD, 0);
+        if (response > 0x01) return false;
+        response = sd_block_command(dev, SD_ACMD_SD_SEND_OP_COND, arg);
+        dev->op_cond_polls++;
+        if (response == 0x00) return true;
+        if (response != 0x01) return false;
+        sleep_us(interval_us);
+        if (interval_us < SD_INIT_POLL_MAX_US) interval_us *= 2;
+    } while (!time_reached(deadline));
+    return false;
+}
+
+// SPI-mode identification: CMD0, CMD8, ACMD41 and CMD58 (or CMD16 for
+// byte-addressed cards), with CS already asserted. A v2 card gets ACMD41
+// with HCS straight away; HCS=0 would keep an SDHC card busy until timeout.
+static int sd_block_identify_selected(sd_block_dev_t* dev) {
+    if (sd_block_command(dev, SD_CMD_GO_IDLE_STATE, 0) != 0x01) {
+        return -1;
+    }
+
+    uint8_t response = sd_block_command(dev, SD_CMD_SEND_IF_COND, SD_IF_COND_CHECK);
+    if (response == 0x01) {
+        // SD v2: echo must match, then the OCR tells the addressing mode
+        if ((sd_block_read_r3(dev) & 0xFFF) != SD_IF_COND_CHECK ||
+            !sd_block_wait_op_cond(dev, SD_OCR_HCS) ||
+            sd_block_command(dev, SD_CMD_READ_OCR, 0) != 0x00) {
+            return -1;
+        }
+        dev->block_addressing = (sd_block_read_r3(dev) & SD_OCR_CCS) != 0;
+    } else if (response & 0x04) {
+        // Illegal command: SD v1
+        if (!sd_block_wait_op_cond(dev, 0)) {
+            return -1;
+        }
+        dev->block_addressing = false;
+    } else {
+        return -1;
+    }
+
+    if (!dev->block_addressing &&
+        sd_block_command(dev, SD_CMD_SET_BLOCKLEN, SD_BLOCK_SIZE) != 0x00) {
+        return -1;
+    }
+    return 0;
+}
+
+// Works on any slot, independently of pico-sd-lib
+static int sd_block_identify(sd_block_dev_t* dev) {
+    uint64_t start_us = time_us_64();
+    dev->op_cond_polls = 0;
+    sd_block_bus_init(dev);
+    sd_block_cs_select(dev);
+    int result = sd_block_identify_selected(dev);
+    sd_block_cs_deselect(dev);
+    dev->ready_us = (uint32_t)(time_us_64() - start_us);
+    return result;
+}
+
+int sd_block_attach(sd_block_dev_t* dev) {
+    sd_block_detach(dev);
+    if (sd_block_identify(dev) != 0) {
+        printf("sd_block: slot %u: card not responding\n", dev->index);
+        return -1;
+    }
+
+    uint8_t csd[16];
+    uint baud = spi_set_baudrate(dev->spi, SD_BLOCK_FAST_BAUDRATE);
+    if (sd_block_read_csd(dev, csd) != 0) {
+        // Long wires or a marginal card: fall back to a conservative clock
+        baud = spi_set_baudrate(dev->spi, SD_BLOCK_SAFE_BAUDRATE);
+        if (sd_block_read_csd(dev, csd) != 0) {
+            printf("sd_block: slot %u: failed to read CSD register\n", dev->index);
+            return -1;
+        }
+    }
+
+    dev->card_blocks = sd_block_csd_capacity(csd);
+    if (dev->card_blocks == 0) {
+        printf("sd_block: slot %u: unsupported CSD structure 0x%02X\n", dev->index, csd[0] >> 6);
+        return -1;
+    }
+
+    // DATA_STAT_AFTER_ERASE (SCR bit 55) tells what erased blocks read as
+    uint8_t scr[8];
+    if (sd_block_read_scr(dev, scr) == 0) {
+        dev->erase_value = (scr[1] & 0x80) ? 0xFF : 0x00;
+    }
+
+    // The AU is only a layout hint, so a card without SD Status still attaches
+    uint8_t ssr[64];
+    dev->au_sectors = (sd_block_read_ssr(dev, ssr) == 0) ? sd_block_ssr_au_sectors(ssr) : 0;
+
+    dev->attached = true;
+    printf("Slot %u: SPI clock %u kHz, capacity from CSD: %u blocks (%.2f MB)\n",
+           dev->index, baud / 1000, dev->card_blocks, (dev->card_blocks * 512.0) / (1024 * 1024));
+    printf("Slot %u: card ready in %u.%u ms (%u ACMD41 polls)\n", dev->index,
+           dev->ready_us / 1000, dev->ready_us % 1000 / 100, dev->op_cond_polls);
+    return 0;
+}
+
+bool sd_block_is_attached(const sd_block_dev_t* dev) {
+    return dev->attached;
+}
+
+void sd_block_detach(sd_block_dev_t* dev) {
+    dev->attached = false;
+    dev->block_addressing = false;
+    dev->card_blocks = 0;
+    dev->erase_value = 0x00;
+    dev->au_sectors = 0;
+}
+
+bool sd_block_card_present(sd_block_dev_t* dev) {
+    if (dev->attached) {
+        // SEND_STATUS answers with R2; a removed card leaves MISO high
+        sd_block_cs_select(dev);
+        uint8_t response = sd_block_command(dev, SD_CMD_SEND_STATUS, 0);
+        sd_block_xfer(dev, 0xFF);
+        sd_block_cs_deselect(dev);
+        return response == 0x00;
+    }
+
+    // No card bound yet: see whether anything answers GO_IDLE_STATE
+    sd_block_bus_init(dev);
+    sd_block_cs_select(dev);
+    uint8_t response = sd_block_command(dev, SD_CMD_GO_IDLE_STATE, 0);
+    sd_block_cs_deselect(dev);
+    return response == 0x01;
+}
+
+uint32_t sd_block_get_block_count(const sd_block_dev_t* dev) {
+    return dev->card_blocks;
+}
+
+uint32_t sd_block_au_sectors(const sd_block_dev_t* dev) {
+    return dev->au_sectors;
+}
+
+int sd_block_read_blocks(sd_block_dev_t* dev, uint32_t lba, uint32_t count, uint8_t* buffer) {
+    if (count == 0) return 0;
+    if (dev->card_blocks && (lba >= dev->card_blocks || count > dev->card_blocks - lba)) {
+        return -1;
+    }
+
+    uint32_t address = dev->block_addressing ? lba : lba * SD_BLOCK_SIZE;
+    int result = 0;
+
+    sd_block_cs_select(dev);
+
+    if (count == 1) {
+        if (sd_block_command(dev, SD_CMD_READ_SINGLE_BLOCK, address) != 0x00 ||
+            sd_block_receive(dev, buffer, SD_BLOCK_SIZE) != 0) {
+            result = -1;
+        }
+    } else {
+        if (sd_block_command(dev, SD_CMD_READ_MULTIPLE_BLOCK, address) != 0x00) {
+            result = -1;
+        } else {
+            for (uint32_t i = 0; i < count; i++) {
+                if (sd_block_receive(dev, buffer + i * SD_BLOCK_SIZE, SD_BLOCK_SIZE) != 0) {
+                    result = -1;
+                    break;
+                }
+            }
+            sd_block_command(dev, SD_CMD_STOP_TRANSMISSION, 0);
+            sd_block_wait_ready(dev, SD_READY_TIMEOUT_US);
+        }
+    }
+
+    sd_block_cs_deselect(dev);
+    return result;
+}
+
+// Shared by write and fill: stride is 0 to repeat one block
+static int sd_block_write_common(sd_block_dev_t* dev, uint32_t lba, uint32_t count, const uint8_t* buffer, uint32_t stride) {
+    if (count == 0) return 0;
+    if (lba >= dev->card_blocks || count > dev->card_blocks - lba) {
+        return -1;
+    }
+
+    uint32_t address = dev->block_addressing ? lba : lba * SD_BLOCK_SIZE;
+    int result = 0;
+
+    sd_block_cs_select(dev);
+
+    if (count == 1) {
+        if (sd_block_command(dev, SD_CMD_WRITE_BLOCK, address) != 0x00 ||
+            sd_block_transmit(dev, SD_TOKEN_START_BLOCK, buffer) != 0) {
+            result = -1;
+        }
+    } else {
+        if (sd_block_command(dev, SD_CMD_WRITE_MULTIPLE_BLOCK, address) != 0x00) {
+            result = -1;
+        } else {
+            for (uint32_t i = 0; i < count; i++) {
+                if (sd_block_transmit(dev, SD_TOKEN_START_MULTI, buffer + i * stride) != 0) {
+                    result = -1;
+                    break;
+                }
+            }
+            sd_block_xfer(dev, SD_TOKEN_STOP_TRAN);
+            sd_block_xfer(dev, 0xFF);
+            if (!sd_block_wait_ready(dev, SD_READY_TIMEOUT_US)) {
+                result = -1;
+            }
+        }
+    }
+
+    sd_block_cs_deselect(dev);
+    return result;
+}
+
+int sd_block_write_blocks(sd_block_dev_t* dev, uint32_t lba, uint32_t count, const uint8_t* buffer) {
+    return sd_block_write_common(dev, lba, count, buffer, SD_BLOCK_SIZE);
+}
+
+int sd_block_fill_blocks(sd_block_dev_t* dev, uint32_t lba, uint32_t count, const uint8_t* block) {
+    return sd_block_write_common(dev, lba, count, block, 0);
+}
+
+int sd_block_erase_blocks(sd_block_dev_t* dev, uint32_t lba, uint32_t count) {
+    if (count == 0) return 0;
+    if (lba >= dev->card_blocks || count > dev->card_blocks - lba) {
+        return -1;
+    }
+
+    uint32_t last = lba + count - 1;
+    uint32_t start_address = dev->block_addressing ? lba : lba * SD_BLOCK_SIZE;
+    uint32_t end_address = dev->block_addressing ? last : last * SD_BLOCK_SIZE;
+    uint32_t timeout_us = SD_ERASE_TIMEOUT_BASE_US +
+                          (count / 8192 + 1) * SD_ERASE_TIMEOUT_PER_4MB_US;
+    int result = -1;
+
+    sd_block_cs_select(dev);
+    if (sd_block_command(dev, SD_CMD_ERASE_WR_BLK_START, start_address) == 0x00 &&
+        sd_block_command(dev, SD_CMD_ERASE_WR_BLK_END, end_address) == 0x00 &&
+        sd_block_command(dev, SD_CMD_ERASE, 0) == 0x00 &&
+        sd_block_wait_ready(dev, timeout_us)) {
+        result = 0;
+    }
+    sd_block_cs_deselect(dev);
+    return result;
+}
+
+uint8_t sd_block_erase_value(const sd_block_dev_t* dev) {
+    return dev->erase_value;
+}
+
+int sd_block_read_cid(sd_block_dev_t* dev, uint8_t cid[16]) {
+    return sd_block_read_register(dev, SD_CMD_SEND_CID, false, cid, 16);
+}
+
+int sd_block_read_csd(sd_block_dev_t* dev, uint8_t csd[16]) {
+    return sd_block_read_register(dev, SD_CMD_SEND_CSD, false, csd, 16);
+}
+
+int sd_block_read_scr(sd_block_dev_t* dev, uint8_t scr[8]) {
+    return sd_block_read_register(dev, SD_ACMD_SEND_SCR, true, scr, 8);
+}
+
+int sd_block_read_ssr(sd_block_dev_t* dev, uint8_t ssr[64]) {
+    // SD_STATUS answers with a two-byte R2, unlike the other registers
+    sd_block_cs_select(dev);
+    int result = -1;
+    if (sd_block_command(dev, SD_CMD_APP_CMD, 0) <= 0x01 &&
+        sd_block_command(dev, SD_ACMD_SD_STATUS, 0) == 0x00) {
+        sd_block_xfer(dev, 0xFF);
+        result = sd_block_receive(dev, ssr, 64);
+    }
+    sd_block_cs_deselect(dev);
+    return result;
+}
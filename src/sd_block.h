@@ -0,0 +1,84 @@
+#ifndef SD_BLOCK_H
+#define SD_BLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hardware/spi.h"
+
+// Block-level access used by the formatter on top of pico-sd-lib.
+// pico-sd-lib only offers single-block reads (CMD17) on one fixed bus; this
+// module adds multi-block transfers and the card registers, and drives each
+// card slot through its own device context so two cards can be handled at
+// the same time (one per SPI controller, one per core).
+
+#define SD_BLOCK_SIZE 512
+#define SD_BLOCK_SLOTS 2
+
+// Slot 0 wiring (the same pins pico-sd-lib's sd_analyzer_init() uses)
+#define SD_BLOCK_PIN_SCK  2
+#define SD_BLOCK_PIN_MOSI 3
+#define SD_BLOCK_PIN_MISO 4
+#define SD_BLOCK_PIN_CS   5
+
+// Slot 1 wiring on spi1
+#define SD_BLOCK_SLOT1_PIN_SCK  10
+#define SD_BLOCK_SLOT1_PIN_MOSI 11
+#define SD_BLOCK_SLOT1_PIN_MISO 12
+#define SD_BLOCK_SLOT1_PIN_CS   13
+
+typedef struct {
+    uint8_t index;
+    spi_inst_t* spi;
+    uint8_t pin_sck;
+    uint8_t pin_mosi;
+    uint8_t pin_miso;
+    uint8_t pin_cs;
+
+    // Card state, valid while attached
+    bool attached;
+    bool block_addressing;          // SDHC/SDXC: addresses are LBAs
+    uint32_t card_blocks;
+    uint8_t erase_value;
+    uint32_t au_sectors;
+    uint32_t ready_us;              // Identification time, CMD0 to ACMD41 ready
+    uint32_t op_cond_polls;         // ACMD41 attempts it took
+} sd_block_dev_t;
+
+// Device context for a slot (0 .. SD_BLOCK_SLOTS - 1)
+sd_block_dev_t* sd_block_slot(int index);
+
+// Identify the card in the slot, raise the SPI clock and read the real
+// capacity from the CSD register
+int sd_block_attach(sd_block_dev_t* dev);
+bool sd_block_is_attached(const sd_block_dev_t* dev);
+uint32_t sd_block_get_block_count(const sd_block_dev_t* dev);
+
+// Allocation unit size from the SD Status register (0 when unknown)
+uint32_t sd_block_au_sectors(const sd_block_dev_t* dev);
+
+// Forget the current card, e.g. after it was removed
+void sd_block_detach(sd_block_dev_t* dev);
+
+// Probe the slot: SEND_STATUS when attached, GO_IDLE_STATE otherwise.
+// The probe resets an unattached card, so sd_block_attach() must follow.
+bool sd_block_card_present(sd_block_dev_t* dev);
+
+// Data transfers (count blocks of SD_BLOCK_SIZE bytes)
+int sd_block_read_blocks(sd_block_dev_t* dev, uint32_t lba, uint32_t count, uint8_t* buffer);
+int sd_block_write_blocks(sd_block_dev_t* dev, uint32_t lba, uint32_t count, const uint8_t* buffer);
+
+// Write the same block to every LBA in [lba, lba + count)
+int sd_block_fill_blocks(sd_block_dev_t* dev, uint32_t lba, uint32_t count, const uint8_t* block);
+
+// Erase [lba, lba + count) with CMD32/33/38; erased blocks read back as
+// sd_block_erase_value() (0x00 or 0xFF, from the SCR register)
+int sd_block_erase_blocks(sd_block_dev_t* dev, uint32_t lba, uint32_t count);
+uint8_t sd_block_erase_value(const sd_block_dev_t* dev);
+
+// Card registers (CID/CSD are 16 bytes, SCR is 8 bytes, SD Status is 64)
+int sd_block_read_cid(sd_block_dev_t* dev, uint8_t cid[16]);
+int sd_block_read_csd(sd_block_dev_t* dev, uint8_t csd[16]);
+int sd_block_read_scr(sd_block_dev_t* dev, uint8_t scr[8]);
+int sd_block_read_ssr(sd_block_dev_t* dev, uint8_t ssr[64]);
+
+#endif // SD_BLOCK_H
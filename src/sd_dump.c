@@ -0,0 +1,438 @@
+#include "sd_dump.h"
+#include "sd_block.h"
+#include "fat_volume.h"
+#include "host_link.h"
+#include "byte_order.h"
+#include "sd_formatter.h"
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "pico/util/queue.h"
+#include <stdio.h>
+#include <string.h>
+
+#define SD_DUMP_VERSION 2       // 2: the record CRC covers the header too
+#define SD_DUMP_CHUNK_BYTES (SD_DUMP_CHUNK_BLOCKS * SD_BLOCK_SIZE)
+#define SD_DUMP_MAX_PARTITIONS 8
+
+// Three slots: one being read on core 0, one being compressed on core 1,
+// one in flight between them
+#define SD_DUMP_SLOTS 3
+#define SD_DUMP_SLOT_DONE 0xFF
+
+// LZ4 block format parameters
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5
+#define LZ4_MF_LIMIT        12
+#define LZ4_HASH_BITS       12
+
+typedef struct {
+    uint32_t lba;
+    uint16_t block_count;           // Blocks read into raw[]
+    uint16_t zero_mask;
+    uint32_t payload_len;           // Non-zero bytes compacted at raw[0]
+    uint8_t raw[SD_DUMP_CHUNK_BYTES] __attribute__((aligned(4)));
+    uint8_t out[SD_DUMP_CHUNK_BYTES];
+} dump_slot_t;
+
+typedef struct {
+    sd_block_dev_t* dev;
+    int status;
+    dump_slot_t* fill;              // Slot core 0 is filling, NULL if none
+    uint8_t fill_index;
+    sd_dump_stats_t stats;
+} dump_context_t;
+
+static dump_slot_t dump_slots[SD_DUMP_SLOTS];
+static queue_t dump_free_queue;
+static queue_t dump_full_queue;
+
+// Owned by core 1 while the pipeline runs
+static uint16_t lz4_table[1 << LZ4_HASH_BITS];
+static uint32_t dump_bytes_sent;
+
+static inline uint32_t lz4_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+static uint8_t* lz4_put_length(uint8_t* op, uint32_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Emit one sequence (literals, then an optional match); NULL if out of space
+static uint8_t* lz4_put_sequence(uint8_t* op, const uint8_t* op_end,
+                                 const uint8_t* literals, uint32_t literal_len,
+                                 uint32_t offset, uint32_t match_len) {
+    uint32_t needed = 1 + literal_len / 255 + 1 + literal_len +
+                      (offset ? 2 + match_len / 255 + 1 : 0);
+    if ((uint32_t)(op_end - op) < needed) {
+        return NULL;
+    }
+
+    uint8_t* token = op++;
+    *token = (uint8_t)((literal_len >= 15 ? 15 : literal_len) << 4);
+    if (literal_len >= 15) {
+        op = lz4_put_length(op, literal_len - 15);
+    }
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    if (offset) {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        uint32_t ml = match_len - LZ4_MIN_MATCH;
+        *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+        if (ml >= 15) {
+            op = lz4_put_length(op, ml - 15);
+        }
+    }
+    return op;
+}
+
+// Greedy single-pass LZ4 block compressor; returns 0 if the output would
+// not fit in dst_cap (the caller then sends the data raw)
+static uint32_t lz4_compress_block(const uint8_t* src, uint32_t len,
+                                   uint8_t* dst, uint32_t dst_cap) {
+    const uint8_t* dst_end = dst + dst_cap;
+    uint8_t* op = dst;
+    uint32_t anchor = 0;
+    uint32_t ip = 0;
+
+    // Table entries are position + 1 so zero means empty
+    memset(lz4_table, 0, sizeof(lz4_table));
+
+    if (len > LZ4_MF_LIMIT) {
+        uint32_t match_limit = len - LZ4_MF_LIMIT;
+        uint32_t extend_limit = len - LZ4_LAST_LITERALS;
+
+        while (ip < match_limit) {
+            uint32_t sequence = lz4_read32(src + ip);
+            uint32_t h = lz4_hash(sequence);
+            uint32_t candidate = lz4_table[h];
+            lz4_table[h] = (uint16_t)(ip + 1);
+
+            if (candidate == 0 || lz4_read32(src + candidate - 1) != sequence) {
+                ip++;
+                continue;
+            }
+
+            uint32_t ref = candidate - 1;
+            uint32_t match_len = LZ4_MIN_MATCH;
+            while (ip + match_len < extend_limit && src[ref + match_len] == src[ip + match_len]) {
+                match_len++;
+            }
+
+            op = lz4_put_sequence(op, dst_end, src + anchor, ip - anchor, ip - ref, match_len);
+            if (!op) return 0;
+
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    op = lz4_put_sequence(op, dst_end, src + anchor, len - anchor, 0, 0);
+    if (!op) return 0;
+    return (uint32_t)(op - dst);
+}
+
+static void sd_dump_send_record(uint8_t kind, uint8_t encoding, uint32_t lba,
+                                uint16_t block_count, uint16_t zero_mask,
+                                const void* payload, uint32_t payload_len) {
+    uint8_t header[SD_DUMP_HEADER_SIZE];
+    header[0] = SD_DUMP_MAGIC0;
+    header[1] = SD_DUMP_MAGIC1;
+    header[2] = kind;
+    header[3] = encoding;
+    le32_put(header + 4, lba);
+    le16_put(header + 8, block_count);
+    le16_put(header + 10, zero_mask);
+    le32_put(header + 12, payload_len);
+    uint32_t crc = host_link_crc32(0, header, 16);
+    le32_put(header + 16, host_link_crc32(crc, payload, payload_len));
+
+    host_link_write(header, sizeof(header));
+    host_link_write(payload, payload_len);
+}
+
+// Core 1: compress and stream filled slots until told to stop
+static void sd_dump_core1_entry(void) {
+    while (true) {
+        uint8_t index;
+        queue_remove_blocking(&dump_full_queue, &index);
+
+        if (index != SD_DUMP_SLOT_DONE) {
+            dump_slot_t* slot = &dump_slots[index];
+            uint32_t packed = lz4_compress_block(slot->raw, slot->payload_len,
+                                                 slot->out, slot->payload_len - 1);
+            if (packed) {
+                sd_dump_send_record(SD_DUMP_RECORD_DATA, SD_DUMP_ENC_LZ4, slot->lba,
+                                    slot->block_count, slot->zero_mask, slot->out, packed);
+                dump_bytes_sent += packed;
+            } else {
+                sd_dump_send_record(SD_DUMP_RECORD_DATA, SD_DUMP_ENC_RAW, slot->lba,
+                                    slot->block_count, slot->zero_mask, slot->raw, slot->payload_len);
+                dump_bytes_sent += slot->payload_len;
+            }
+        }
+
+        queue_add_blocking(&dump_free_queue, &index);
+        if (index == SD_DUMP_SLOT_DONE) {
+            return;
+        }
+    }
+}
+
+static inline bool sd_dump_block_is_zero(const uint8_t* block) {
+    const uint32_t* words = (const uint32_t*)block;
+    uint32_t acc = 0;
+    for (int i = 0; i < SD_BLOCK_SIZE / 4; i++) {
+        acc |= words[i];
+    }
+    return acc == 0;
+}
+
+// Elide zero blocks from the current slot and hand it to core 1
+static void sd_dump_flush(dump_context_t* ctx) {
+    dump_slot_t* slot = ctx->fill;
+    if (!slot) return;
+    ctx->fill = NULL;
+
+    uint32_t packed = 0;
+    slot->zero_mask = 0;
+    for (uint32_t i = 0; i < slot->block_count; i++) {
+        const uint8_t* block = slot->raw + i * SD_BLOCK_SIZE;
+        if (sd_dump_block_is_zero(block)) {
+            slot->zero_mask |= (uint16_t)(1u << i);
+            ctx->stats.blocks_zero++;
+            continue;
+        }
+        if (packed != i * SD_BLOCK_SIZE) {
+            memmove(slot->raw + packed, block, SD_BLOCK_SIZE);
+        }
+        packed += SD_BLOCK_SIZE;
+    }
+    slot->payload_len = packed;
+
+    if (packed == 0) {
+        // Nothing worth sending; recycle the slot
+        queue_add_blocking(&dump_free_queue, &ctx->fill_index);
+        return;
+    }
+
+    ctx->stats.blocks_sent += packed / SD_BLOCK_SIZE;
+    queue_add_blocking(&dump_full_queue, &ctx->fill_index);
+}
+
+// Queue [lba, lba + count) for dumping, batching contiguous blocks per slot
+static void sd_dump_range(dump_context_t* ctx, uint32_t lba, uint32_t count) {
+    while (count > 0 && ctx->status == 0) {
+        dump_slot_t* slot = ctx->fill;
+        if (slot && slot->lba + slot->block_count != lba) {
+            sd_dump_flush(ctx);
+            slot = NULL;
+        }
+        if (!slot) {
+            queue_remove_blocking(&dump_free_queue, &ctx->fill_index);
+            slot = ctx->fill = &dump_slots[ctx->fill_index];
+            slot->lba = lba;
+            slot->block_count = 0;
+        }
+
+        uint32_t n = SD_DUMP_CHUNK_BLOCKS - slot->block_count;
+        if (n > count) n = count;
+
+        if (sd_block_read_blocks(ctx->dev, lba, n, slot->raw + slot->block_count * SD_BLOCK_SIZE) != 0) {
+            ctx->status = -1;
+            return;
+        }
+        slot->block_count += n;
+        ctx->stats.blocks_scanned += n;
+        lba += n;
+        count -= n;
+
+        if (slot->block_count == SD_DUMP_CHUNK_BLOCKS) {
+            sd_dump_flush(ctx);
+        }
+    }
+}
+
+// Dump a FAT volume: all metadata, then only clusters marked in use
+static void sd_dump_fat_volume(dump_context_t* ctx, fat_volume_t* vol, uint32_t end_lba) {
+    sd_dump_range(ctx, vol->start_lba, vol->data_lba - vol->start_lba);
+
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+    uint32_t last_cluster = vol->cluster_count + FAT_FIRST_CLUSTER;
+
+    for (uint32_t cluster = FAT_FIRST_CLUSTER; cluster < last_cluster && ctx->status == 0; cluster++) {
+        uint32_t entry;
+        if (fat_volume_get_entry(vol, cluster, &entry) != 0) {
+            ctx->status = -1;
+            return;
+        }
+
+        if (entry != 0) {
+            if (run_length == 0) run_start = cluster;
+            run_length++;
+            continue;
+        }
+
+        ctx->stats.blocks_scanned += vol->sectors_per_cluster;
+        ctx->stats.blocks_unallocated += vol->sectors_per_cluster;
+        if (run_length) {
+            sd_dump_range(ctx, fat_volume_cluster_lba(vol, run_start),
+                          run_length * vol->sectors_per_cluster);
+            run_length = 0;
+        }
+    }
+    if (run_length) {
+        sd_dump_range(ctx, fat_volume_cluster_lba(vol, run_start),
+                      run_length * vol->sectors_per_cluster);
+    }
+
+    // Sectors past the last whole cluster still belong to the partition
+    uint32_t data_end = fat_volume_cluster_lba(vol, last_cluster);
+    if (end_lba > data_end) {
+        sd_dump_range(ctx, data_end, end_lba - data_end);
+    }
+}
+
+static void sd_dump_partition(dump_context_t* ctx, uint32_t start_lba, uint32_t size_sectors) {
+    static fat_volume_t vol;
+
+    if (fat_volume_mount(ctx->dev, start_lba, &vol) == 0 &&
+        vol.data_lba + (uint64_t)vol.cluster_count * vol.sectors_per_cluster <=
+        (uint64_t)start_lba + size_sectors) {
+        sd_dump_fat_volume(ctx, &vol, start_lba + size_sectors);
+    } else {
+        // No allocation info for this filesystem: rely on zero elision
+        sd_dump_range(ctx, start_lba, size_sectors);
+    }
+}
+
+static int sd_dump_collect_partitions(partition_info_t* partitions, uint32_t card_blocks) {
+    sd_analysis_t analysis;
+    if (sd_formatter_get_info(&analysis) != 0) {
+        return -1;
+    }
+
+    int count = sd_formatter_read_partitions(&analysis, partitions, SD_DUMP_MAX_PARTITIONS);
+    if (count < 0) count = 0;
+
+    // Drop entries outside the card, then sort by start LBA
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (partitions[i].size_sectors == 0 || partitions[i].start_lba >= card_blocks) continue;
+        if (partitions[i].size_sectors > card_blocks - partitions[i].start_lba) {
+            partitions[i].size_sectors = card_blocks - partitions[i].start_lba;
+        }
+        partitions[kept++] = partitions[i];
+    }
+    for (int i = 1; i < kept; i++) {
+        partition_info_t p = partitions[i];
+        int j = i - 1;
+        while (j >= 0 && partitions[j].start_lba > p.start_lba) {
+            partitions[j + 1] = partitions[j];
+            j--;
+        }
+        partitions[j + 1] = p;
+    }
+    return kept;
+}
+
+int sd_dump_card(sd_dump_stats_t* stats) {
+    // The partition list comes from sd_formatter_read_partitions, which reads slot 0
+    sd_block_dev_t* dev = sd_block_slot(0);
+    if (!sd_block_is_attached(dev) && sd_block_attach(dev) != 0) {
+        return -1;
+    }
+
+    uint32_t card_blocks = sd_block_get_block_count(dev);
+    partition_info_t partitions[SD_DUMP_MAX_PARTITIONS];
+    int partition_count = sd_dump_collect_partitions(partitions, card_blocks);
+    if (partition_count < 0) {
+        return -1;
+    }
+
+    sd_dump_begin_t begin;
+    memset(&begin, 0, sizeof(begin));
+    begin.version = SD_DUMP_VERSION;
+    begin.card_blocks = card_blocks;
+    sd_block_read_cid(dev, begin.cid);
+
+    printf("Streaming backup dump (%u blocks, %d partitions)...\n", card_blocks, partition_count);
+    stdio_flush();
+
+    dump_context_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.dev = dev;
+    uint64_t start_us = time_us_64();
+
+    queue_init(&dump_free_queue, sizeof(uint8_t), SD_DUMP_SLOTS + 1);
+    queue_init(&dump_full_queue, sizeof(uint8_t), SD_DUMP_SLOTS + 1);
+    for (uint8_t i = 0; i < SD_DUMP_SLOTS; i++) {
+        queue_add_blocking(&dump_free_queue, &i);
+    }
+    dump_bytes_sent = 0;
+
+    sd_dump_send_record(SD_DUMP_RECORD_BEGIN, SD_DUMP_ENC_RAW, 0, 0, 0, &begin, sizeof(begin));
+
+    multicore_reset_core1();
+    multicore_launch_core1(sd_dump_core1_entry);
+
+    uint32_t lba = 0;
+    if (partition_count == 0) {
+        // Superfloppy layouts keep the filesystem at LBA 0
+        sd_dump_partition(&ctx, 0, card_blocks);
+        lba = card_blocks;
+    }
+    for (int i = 0; i < partition_count && ctx.status == 0; i++) {
+        if (partitions[i].start_lba < lba) continue; // Overlaps an earlier entry
+        if (partitions[i].start_lba > lba) {
+            sd_dump_range(&ctx, lba, partitions[i].start_lba - lba);
+        }
+        sd_dump_partition(&ctx, partitions[i].start_lba, partitions[i].size_sectors);
+        lba = partitions[i].start_lba + partitions[i].size_sectors;
+    }
+    if (lba < card_blocks) {
+        sd_dump_range(&ctx, lba, card_blocks - lba);
+    }
+    sd_dump_flush(&ctx);
+
+    // Drain core 1
+    uint8_t done = SD_DUMP_SLOT_DONE;
+    queue_add_blocking(&dump_full_queue, &done);
+    uint8_t index;
+    do {
+        queue_remove_blocking(&dump_free_queue, &index);
+    } while (index != SD_DUMP_SLOT_DONE);
+    queue_free(&dump_full_queue);
+    queue_free(&dump_free_queue);
+
+    ctx.stats.status = ctx.status;
+    ctx.stats.bytes_sent = dump_bytes_sent;
+    ctx.stats.elapsed_ms = (uint32_t)((time_us_64() - start_us) / 1000);
+
+    uint8_t end[sizeof(sd_dump_stats_t)];
+    memcpy(end, &ctx.stats, sizeof(end));
+    sd_dump_send_record(SD_DUMP_RECORD_END, SD_DUMP_ENC_RAW, 0, 0, 0, end, sizeof(end));
+    host_link_flush();
+
+    printf("\nDump %s: %u blocks scanned, %u unallocated, %u zero, %u sent as %u bytes in %u ms\n",
+           ctx.status == 0 ? "complete" : "FAILED",
+           ctx.stats.blocks_scanned, ctx.stats.blocks_unallocated, ctx.stats.blocks_zero,
+           ctx.stats.blocks_sent, ctx.stats.bytes_sent, ctx.stats.elapsed_ms);
+
+    if (stats) *stats = ctx.stats;
+    return ctx.status;
+}
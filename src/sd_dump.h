@@ -0,0 +1,66 @@
+#ifndef SD_DUMP_H
+#define SD_DUMP_H
+
+#include <stdint.h>
+
+// Pre-format backup dump streamed to the USB host.
+//
+// The stream is a sequence of records, each a 20-byte little-endian header
+// followed by payload_len bytes of payload:
+//
+//   offset size field
+//   0      2    magic "SD"
+//   2      1    kind (SD_DUMP_RECORD_*)
+//   3      1    encoding (SD_DUMP_ENC_*)
+//   4      4    lba of the first block covered
+//   8      2    block_count covered by the record
+//   10     2    zero_mask: bit n set = block n is all zero and omitted
+//   12     4    payload_len
+//   16     4    crc32 of header bytes 0-15 followed by the payload as sent
+//
+// DATA payloads hold the non-zero blocks in order, either raw or as one
+// LZ4 block (decompressed size = non-zero blocks * 512). Blocks that no
+// record covers were unallocated or all zero and restore as zeros.
+// BEGIN carries sd_dump_begin_t, END carries sd_dump_stats_t.
+// The stream shares the USB serial port with console text, so a reader
+// scans for the magic and only trusts records whose CRC matches;
+// tools/sd_dump_restore.py rebuilds a card image from a capture.
+
+#define SD_DUMP_MAGIC0 'S'
+#define SD_DUMP_MAGIC1 'D'
+#define SD_DUMP_HEADER_SIZE 20
+
+// Blocks per DATA record (bounded by the 16-bit zero mask)
+#define SD_DUMP_CHUNK_BLOCKS 16
+
+typedef enum {
+    SD_DUMP_RECORD_BEGIN = 1,
+    SD_DUMP_RECORD_DATA = 2,
+    SD_DUMP_RECORD_END = 3
+} sd_dump_record_kind_t;
+
+typedef enum {
+    SD_DUMP_ENC_RAW = 0,
+    SD_DUMP_ENC_LZ4 = 1
+} sd_dump_encoding_t;
+
+typedef struct {
+    uint32_t version;
+    uint32_t card_blocks;
+    uint8_t cid[16];
+} sd_dump_begin_t;
+
+typedef struct {
+    int32_t status;                 // 0 on success
+    uint32_t blocks_scanned;        // Blocks considered for the dump
+    uint32_t blocks_unallocated;    // Skipped using FAT allocation info
+    uint32_t blocks_zero;           // Read but elided as all-zero
+    uint32_t blocks_sent;
+    uint32_t bytes_sent;            // Payload bytes after compression
+    uint32_t elapsed_ms;
+} sd_dump_stats_t;
+
+// Stream the used contents of the card; stats may be NULL
+int sd_dump_card(sd_dump_stats_t* stats);
+
+#endif // SD_DUMP_H
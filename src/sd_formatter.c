@@ -1,11 +1,267 @@
 #include "sd_formatter.h"
+#include "sd_block.h"
+#include "fat_volume.h"
+#include "fat_walk.h"
+#include "exfat_volume.h"
+#include "exfat_walk.h"
+#include "ext_walk.h"
+#include "host_link.h"
+#include "byte_order.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 
+// Sectors holding the 128 GPT partition entries
+#define SD_FORMATTER_GPT_SECTORS 32
+
+typedef struct {
+    fat_type_t type;
+    uint8_t sectors_per_cluster;
+    uint16_t reserved_sectors;
+    uint16_t root_entries;
+    uint32_t fat_size;
+    uint32_t cluster_count;
+    uint32_t data_offset;       // Sectors from boot sector to cluster 2
+} fat_layout_t;
+
+// Volumes mounted by the content preview (too large for the stack)
+static fat_volume_t preview_fat;
+static exfat_volume_t preview_exfat;
+static ext_volume_t preview_ext;
+
+typedef struct {
+    bool known;
+    uint64_t used_bytes;
+    uint64_t capacity_bytes;
+    uint32_t scan_ms;
+    const char* note;               // Cross-check result, NULL if none
+} partition_usage_t;
+
+static sd_block_dev_t* sd_formatter_preview_dev(void) {
+    sd_block_dev_t* dev = sd_block_slot(0);
+    if (!sd_block_is_attached(dev) && sd_block_attach(dev) != 0) {
+        return NULL;
+    }
+    return dev;
+}
+
+// Used space of a FAT or exFAT partition from its allocation tables
+static void sd_formatter_partition_usage(uint32_t start_lba, partition_usage_t* usage) {
+    memset(usage, 0, sizeof(*usage));
+    sd_block_dev_t* dev = sd_formatter_preview_dev();
+    if (!dev) return;
+
+    if (fat_volume_mount(dev, start_lba, &preview_fat) == 0) {
+        fat_volume_usage_t fat;
+        if (fat_volume_count_free(&preview_fat, &fat) != 0) return;
+
+        uint64_t cluster_bytes = (uint64_t)preview_fat.sectors_per_cluster * SD_BLOCK_SIZE;
+        usage->known = true;
+        usage->capacity_bytes = preview_fat.cluster_count * cluster_bytes;
+        usage->used_bytes = (preview_fat.cluster_count - fat.free_clusters) * cluster_bytes;
+        usage->scan_ms = fat.elapsed_ms;
+        if (fat.fsinfo_free != FAT_FSINFO_UNKNOWN) {
+            usage->note = (fat.fsinfo_free == fat.free_clusters) ? "FSInfo agrees"
+                                                                  : "FSInfo free count is stale";
+        }
+    } else if (exfat_volume_mount(dev, start_lba, &preview_exfat) == 0) {
+        exfat_volume_usage_t exfat;
+        if (exfat_volume_count_used(&preview_exfat, &exfat) != 0) return;
+
+        uint64_t cluster_bytes = (uint64_t)exfat_volume_cluster_sectors(&preview_exfat) * SD_BLOCK_SIZE;
+        usage->known = true;
+        usage->capacity_bytes = preview_exfat.cluster_count * cluster_bytes;
+        usage->used_bytes = exfat.used_clusters * cluster_bytes;
+        usage->scan_ms = exfat.elapsed_ms;
+        if (exfat.percent_in_use != EXFAT_PERCENT_UNKNOWN) {
+            uint32_t percent = (uint32_t)((uint64_t)exfat.used_clusters * 100 / preview_exfat.cluster_count);
+            usage->note = (percent == exfat.percent_in_use) ? "PercentInUse agrees"
+                                                            : "PercentInUse is stale";
+        }
+    } else if (ext_volume_mount(dev, start_lba, &preview_ext) == 0) {
+        // ext keeps an exact free block count in the superblock
+        usage->known = true;
+        usage->capacity_bytes = preview_ext.blocks_count * preview_ext.block_size;
+        usage->used_bytes = (preview_ext.blocks_count - preview_ext.free_blocks) * preview_ext.block_size;
+        usage->note = "from superblock";
+    }
+}
+
+// Mount the FAT volume at start_lba and print its directory tree
+static void sd_formatter_list_fat(uint32_t start_lba, int partition_number) {
+    fat_volume_t* vol = &preview_fat;
+    sd_block_dev_t* dev = sd_formatter_preview_dev();
+
+    if (!dev || fat_volume_mount(dev, start_lba, vol) != 0) {
+        printf("Could not read boot sector for partition %d\n", partition_number);
+        return;
+    }
+
+    printf("%s volume: %u clusters of %u bytes, data at LBA %u\n",
+           fat_volume_type_name(vol->type), vol->cluster_count,
+           vol->sectors_per_cluster * SD_BLOCK_SIZE, vol->data_lba);
+    fat_walk_tree(vol, NULL, NULL);
+}
+
+static void sd_formatter_list_exfat(uint32_t start_lba, int partition_number) {
+    exfat_volume_t* vol = &preview_exfat;
+    sd_block_dev_t* dev = sd_formatter_preview_dev();
+
+    if (!dev || exfat_volume_mount(dev, start_lba, vol) != 0) {
+        printf("Could not read boot sector for partition %d\n", partition_number);
+        return;
+    }
+
+    printf("exFAT volume: %u clusters of %u bytes, serial %08X\n", vol->cluster_count,
+           exfat_volume_cluster_sectors(vol) * SD_BLOCK_SIZE, vol->serial);
+    exfat_walk_tree(vol, NULL, NULL);
+}
+
+static void sd_formatter_list_ext(uint32_t start_lba, int partition_number) {
+    ext_volume_t* vol = &preview_ext;
+    sd_block_dev_t* dev = sd_formatter_preview_dev();
+
+    if (!dev || ext_volume_mount(dev, start_lba, vol) != 0) {
+        printf("Could not read superblock for partition %d\n", partition_number);
+        return;
+    }
+
+    printf("%s volume \"%s\": %llu blocks of %u bytes, %u groups\n", ext_volume_type_name(vol),
+           vol->volume_name, (unsigned long long)vol->blocks_count, vol->block_size, vol->group_count);
+    ext_walk_tree(vol, NULL, NULL);
+}
+
+// Filesystem name as pico-sd-lib reports it, from the volume itself
+static void sd_formatter_name_filesystem(sd_block_dev_t* dev, partition_info_t* partition) {
+    const char* name = "Unknown";
+    if (fat_volume_mount(dev, partition->start_lba, &preview_fat) == 0) {
+        name = fat_volume_type_name(preview_fat.type);
+    } else if (exfat_volume_mount(dev, partition->start_lba, &preview_exfat) == 0) {
+        name = "exFAT";
+    } else if (ext_volume_mount(dev, partition->start_lba, &preview_ext) == 0) {
+        name = ext_volume_type_name(&preview_ext);
+    }
+    snprintf(partition->filesystem, sizeof(partition->filesystem), "%s", name);
+}
+
+static bool sd_formatter_is_volume_boot_sector(const uint8_t* sector) {
+    if (memcmp(sector + 3, "EXFAT   ", 8) == 0) {
+        return true;
+    }
+    uint8_t sectors_per_cluster = sector[13];
+    return le16_get(sector + 11) == SD_BLOCK_SIZE && sectors_per_cluster != 0 &&
+           (sectors_per_cluster & (sectors_per_cluster - 1)) == 0 &&
+           le16_get(sector + 14) != 0 && sector[16] != 0;
+}
+
+int sd_formatter_get_info(sd_analysis_t* analysis) {
+    uint8_t sector[SD_BLOCK_SIZE];
+
+    memset(analysis, 0, sizeof(*analysis));
+    sd_block_dev_t* dev = sd_formatter_preview_dev();
+    if (!dev || sd_block_read_blocks(dev, 0, 1, sector) != 0) {
+        return -1;
+    }
+    // sd_block does not tell v1 from v2 byte-addressed cards
+    analysis->card_info.type = dev->block_addressing ? SD_CARD_TYPE_SDHC : SD_CARD_TYPE_SD2;
+    analysis->card_info.blocks = sd_block_get_block_count(dev);
+
+    if (sector[510] != 0x55 || sector[511] != 0xAA) {
+        return 0;
+    }
+    // A volume boot sector at LBA 0 (no partition table) carries the same
+    // signature; MBR boot code often starts with a jump too, so only a
+    // plausible BPB or the exFAT OEM name counts as a bare volume
+    if (sd_formatter_is_volume_boot_sector(sector)) {
+        return 0;
+    }
+    bool protective = false;
+    for (int i = 0; i < 4; i++) {
+        if (sector[446 + i * 16 + 4] == 0xEE) protective = true;
+    }
+    if (!protective) {
+        analysis->has_mbr = true;
+    } else if (sd_block_read_blocks(dev, 1, 1, sector) == 0 && memcmp(sector, "EFI PART", 8) == 0) {
+        analysis->has_gpt = true;
+    }
+    return 0;
+}
+
+int sd_formatter_read_partitions(const sd_analysis_t* analysis, partition_info_t* partitions, int max) {
+    uint8_t sector[SD_BLOCK_SIZE];
+    sd_block_dev_t* dev = sd_formatter_preview_dev();
+    if (!dev) return -1;
+
+    uint32_t card_blocks = sd_block_get_block_count(dev);
+    int count = 0;
+
+    if (analysis->has_mbr) {
+        if (sd_block_read_blocks(dev, 0, 1, sector) != 0) return -1;
+        for (int i = 0; i < 4 && count < max; i++) {
+            const uint8_t* entry = sector + 446 + i * 16;
+            uint32_t start = le32_get(entry + 8);
+            uint32_t size = le32_get(entry + 12);
+            // Extended partitions (0x05, 0x0F) are not followed
+            if (entry[4] == 0x00 || entry[4] == 0x05 || entry[4] == 0x0F ||
+                start == 0 || size == 0 || start >= card_blocks) {
+                continue;
+            }
+            partition_info_t* partition = &partitions[count++];
+            memset(partition, 0, sizeof(*partition));
+            partition->start_lba = start;
+            partition->size_sectors = size;
+        }
+    } else if (analysis->has_gpt) {
+        if (sd_block_read_blocks(dev, 1, 1, sector) != 0) return -1;
+        uint32_t entries_lba = (uint32_t)le64_get(sector + 72);
+        uint32_t entry_count = le32_get(sector + 80);
+        uint32_t entry_size = le32_get(sector + 84);
+        if (entry_size < 128 || entry_size > SD_BLOCK_SIZE || SD_BLOCK_SIZE % entry_size != 0) {
+            return -1;
+        }
+
+        uint32_t per_sector = SD_BLOCK_SIZE / entry_size;
+        for (uint32_t i = 0; i < entry_count && count < max; i++) {
+            if (i % per_sector == 0 &&
+                sd_block_read_blocks(dev, entries_lba + i / per_sector, 1, sector) != 0) {
+                return -1;
+            }
+            const uint8_t* entry = sector + (i % per_sector) * entry_size;
+            static const uint8_t unused[16];
+            uint64_t first = le64_get(entry + 32);
+            uint64_t last = le64_get(entry + 40);
+            if (memcmp(entry, unused, 16) == 0 || last < first || first >= card_blocks) {
+                continue;
+            }
+
+            partition_info_t* partition = &partitions[count++];
+            memset(partition, 0, sizeof(*partition));
+            partition->start_lba = (uint32_t)first;
+            partition->size_sectors = (uint32_t)(last - first + 1);
+
+            uint16_t name[37];
+            for (int k = 0; k < 36; k++) name[k] = le16_get(entry + 56 + k * 2);
+            name[36] = 0;
+            fat_walk_utf16_to_utf8(name, partition->name, sizeof(partition->name));
+        }
+    } else if (max > 0) {
+        // No partition table: a volume may still start at LBA 0 and fill the card
+        memset(&partitions[0], 0, sizeof(partitions[0]));
+        partitions[0].size_sectors = card_blocks;
+        snprintf(partitions[0].name, sizeof(partitions[0].name), "Volume");
+        sd_formatter_name_filesystem(dev, &partitions[0]);
+        return strcmp(partitions[0].filesystem, "Unknown") == 0 ? 0 : 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        sd_formatter_name_filesystem(dev, &partitions[i]);
+    }
+    return count;
+}
+
 int sd_formatter_show_card_content(void) {
     sd_analysis_t analysis;
-    if (sd_analyzer_get_info(&analysis) != 0) {
+    if (sd_formatter_get_info(&analysis) != 0) {
         printf("Failed to read SD card information\n");
         return -1;
     }
@@ -18,22 +274,25 @@ int sd_formatter_show_card_content(void) {
     
     // Show partition information
     partition_info_t partitions[8];
-    int partition_count = 0;
+    
+    int partition_count = sd_formatter_read_partitions(&analysis, partitions, 8);
     
     if (analysis.has_gpt) {
         printf("Partition table: GPT\n");
-        partition_count = sd_analyzer_parse_gpt(partitions, 8);
     } else if (analysis.has_mbr) {
         printf("Partition table: MBR\n");
-        partition_count = sd_analyzer_parse_mbr(partitions, 8);
+    } else if (partition_count > 0) {
+        printf("Partition table: None (one volume starting at LBA 0)\n");
     } else {
         printf("Partition table: None\n");
     }
     
     if (partition_count > 0) {
-        printf("+-----+-------------+---------+-------------+\n");
-        printf("| #   | Name        | Type    | Size        |\n");
-        printf("+-----+-------------+---------+-------------+\n");
+        partition_usage_t usage[8];
+        
+        printf("+-----+-------------+---------+-------------+-------------+\n");
+        printf("| #   | Name        | Type    | Size        | Used        |\n");
+        printf("+-----+-------------+---------+-------------+-------------+\n");
         
         for (int i = 0; i < partition_count; i++) {
             char name[13];
@@ -43,13 +302,35 @@ int sd_formatter_show_card_content(void) {
                 snprintf(name, sizeof(name), "%.11s", partitions[i].name);
             }
             
-            printf("| %-3d | %-11s | %-7s | %7.1fMB   |\n", 
+            sd_formatter_partition_usage(partitions[i].start_lba, &usage[i]);
+            char used[14];
+            if (usage[i].known) {
+                snprintf(used, sizeof(used), "%7.1fMB", usage[i].used_bytes / (1024.0 * 1024));
+            } else {
+                snprintf(used, sizeof(used), "%9s", "-");
+            }
+            
+            printf("| %-3d | %-11s | %-7s | %7.1fMB   | %s   |\n", 
                    i + 1,
                    name,
                    partitions[i].filesystem,
-                   (partitions[i].size_sectors * 512.0) / (1024 * 1024));
+                   (partitions[i].size_sectors * 512.0) / (1024 * 1024),
+                   used);
+        }
+        printf("+-----+-------------+---------+-------------+-------------+\n");
+        
+        // Data that a format would destroy
+        uint64_t used_total = 0;
+        for (int i = 0; i < partition_count; i++) {
+            if (!usage[i].known) continue;
+            used_total += usage[i].used_bytes;
+            printf("Partition %d: %.1f of %.1f MB in use (%u%%), scanned in %u ms%s%s\n",
+                   i + 1, usage[i].used_bytes / (1024.0 * 1024),
+                   usage[i].capacity_bytes / (1024.0 * 1024),
+                   usage[i].capacity_bytes ? (unsigned)(usage[i].used_bytes * 100 / usage[i].capacity_bytes) : 0,
+                   usage[i].scan_ms, usage[i].note ? ", " : "", usage[i].note ? usage[i].note : "");
         }
-        printf("+-----+-------------+---------+-------------+\n");
+        printf("Data that formatting will destroy: %.1f MB\n", used_total / (1024.0 * 1024));
         
         // Show contents of ALL partitions
         printf("\n=== ALL PARTITION CONTENTS ===\n");
@@ -63,29 +344,12 @@ int sd_formatter_show_card_content(void) {
                 strcmp(partitions[i].filesystem, "FAT16") == 0 ||
                 strcmp(partitions[i].filesystem, "FAT12") == 0) {
                 
-                // Calculate actual root directory location for FAT
-                uint32_t fat_start_lba = partitions[i].start_lba;
-                
-                // Read the boot sector to get proper FAT parameters
-                uint8_t boot_sector[512];
-                if (sd_read_block(fat_start_lba, boot_sector) == 0) {
-                    // Parse FAT boot sector to find root directory
-                    uint16_t reserved_sectors = *(uint16_t*)(boot_sector + 14);
-                    uint8_t num_fats = boot_sector[16];
-                    uint32_t fat_size = *(uint32_t*)(boot_sector + 36); // FAT32
-                    
-                    uint32_t root_dir_lba = fat_start_lba + reserved_sectors + (num_fats * fat_size);
-                    
-                    printf("Root directory at LBA %u:\n", root_dir_lba);
-                    sd_analyzer_list_fat_directory(root_dir_lba, "/");
-                } else {
-                    printf("Could not read boot sector for partition %d\n", i + 1);
-                }
+                sd_formatter_list_fat(partitions[i].start_lba, i + 1);
                 
             } else if (strcmp(partitions[i].filesystem, "exFAT") == 0) {
-                printf("exFAT partition - contents listing not implemented yet\n");
+                sd_formatter_list_exfat(partitions[i].start_lba, i + 1);
             } else if (strncmp(partitions[i].filesystem, "ext", 3) == 0) {
-                printf("Linux ext filesystem - contents listing not implemented yet\n");
+                sd_formatter_list_ext(partitions[i].start_lba, i + 1);
             } else {
                 printf("Unknown filesystem type - cannot list contents\n");
             }
@@ -119,6 +383,10 @@ int sd_formatter_get_format_options(format_options_t* options) {
     strcpy(options->volume_label, "SDCARD");
     options->quick_format = true;
     options->confirm_format = false;
+    options->backup_before_format = false;
+    options->dry_run = true;
+    options->secure_erase = SECURE_ERASE_NONE;
+    options->resume_secure_erase = false;
     
     printf("\n=== FORMAT OPTIONS ===\n");
     printf("Select partition table type:\n");
@@ -142,59 +410,347 @@ int sd_formatter_get_format_options(format_options_t* options) {
     printf("\nVolume label [%s]: ", options->volume_label);
     printf("(Using default: %s)\n", options->volume_label);
     
+    printf("\nBackup dump before format (y/N): ");
+    printf("%s\n", options->backup_before_format ? "y" : "N");
+    
+    printf("\nSecure erase before format:\n");
+    printf("  1. None [default]\n");
+    printf("  2. Zero pass + verify\n");
+    printf("  3. Random pass + verify\n");
+    printf("  4. Zero, ones, random + verify\n");
+    printf("  5. Card erase command + verify\n");
+    printf("Choice (1-5): ");
+    printf("%d (%s selected)\n", (int)options->secure_erase + 1,
+           secure_erase_mode_name(options->secure_erase));
+    
+    printf("\nResume an interrupted secure erase (y/N): ");
+    printf("%s\n", options->resume_secure_erase ? "y" : "N");
+    
     return 0;
 }
 
-int sd_formatter_wipe_card(void) {
-    printf("\nWiping SD card...\n");
-    
-    // Get card info first
-    sd_analysis_t analysis;
-    if (sd_analyzer_get_info(&analysis) != 0) {
+// Deterministic per-card identifiers (volume serial, GUIDs) derived from the
+// CID, so reformatting the same card produces byte-identical metadata
+static uint32_t sd_formatter_card_seed(const uint8_t cid[16], uint32_t salt) {
+    return host_link_crc32(salt, cid, 16);
+}
+
+static void sd_formatter_make_guid(uint8_t guid[16], const uint8_t cid[16], uint32_t salt) {
+    for (int i = 0; i < 4; i++) {
+        le32_put(guid + i * 4, sd_formatter_card_seed(cid, salt + i));
+    }
+    guid[7] = (guid[7] & 0x0F) | 0x40;   // Version 4
+    guid[8] = (guid[8] & 0x3F) | 0x80;   // RFC 4122 variant
+}
+
+// 11-character, space-padded, upper-case FAT volume label
+static void sd_formatter_fat_label(const char* label, char out[11]) {
+    memset(out, ' ', 11);
+    if (!label || !label[0]) {
+        memcpy(out, "NO NAME", 7);
+        return;
+    }
+    for (int i = 0; i < 11 && label[i]; i++) {
+        char c = label[i];
+        out[i] = (c >= 'a' && c <= 'z') ? (char)(c - 'a' + 'A') : c;
+    }
+}
+
+static uint8_t sd_formatter_mbr_type(filesystem_type_t fs_type) {
+    switch (fs_type) {
+        case FILESYSTEM_FAT12: return 0x01;
+        case FILESYSTEM_FAT16: return 0x0E;  // FAT16 LBA
+        case FILESYSTEM_FAT32: return 0x0C;  // FAT32 LBA
+        case FILESYSTEM_EXFAT: return 0x07;
+        default: return 0x00;
+    }
+}
+
+static void sd_formatter_mbr_entry(uint8_t* entry, uint8_t type, uint32_t start_lba, uint32_t size_sectors) {
+    // CHS fields use the "beyond CHS range" marker; everything is LBA addressed
+    entry[0] = 0x00;
+    entry[1] = 0xFE; entry[2] = 0xFF; entry[3] = 0xFF;
+    entry[4] = type;
+    entry[5] = 0xFE; entry[6] = 0xFF; entry[7] = 0xFF;
+    le32_put(entry + 8, start_lba);
+    le32_put(entry + 12, size_sectors);
+}
+
+int sd_formatter_wipe_card(format_plan_t* fp) {
+    write_plan_t* plan = &fp->plan;
+    uint32_t total_sectors = fp->total_sectors;
+
+    printf("\nPlanning wipe of partition tables and boot sectors...\n");
+
+    // First 64 sectors (MBR, primary GPT, boot loaders) and the backup GPT
+    write_plan_add_zero(plan, 0, 64, "wipe: leading sectors");
+    if (total_sectors > 64 + SD_FORMATTER_GPT_SECTORS + 1) {
+        write_plan_add_zero(plan, total_sectors - SD_FORMATTER_GPT_SECTORS - 1,
+                            SD_FORMATTER_GPT_SECTORS + 1, "wipe: backup GPT");
+    }
+
+    return plan->overflow ? -1 : 0;
+}
+
+// Recompute the GPT entry array and header CRCs after identifiers change
+static void sd_formatter_seal_gpt(format_plan_t* fp) {
+    static const uint8_t zero_sector[SD_BLOCK_SIZE];
+
+    uint32_t entries_crc = host_link_crc32(0, fp->gpt_entries, SD_BLOCK_SIZE);
+    for (int i = 1; i < SD_FORMATTER_GPT_SECTORS; i++) {
+        entries_crc = host_link_crc32(entries_crc, zero_sector, SD_BLOCK_SIZE);
+    }
+
+    uint8_t* headers[2] = { fp->gpt_primary, fp->gpt_backup };
+    for (int i = 0; i < 2; i++) {
+        le32_put(headers[i] + 88, entries_crc);
+        le32_put(headers[i] + 16, 0);
+        le32_put(headers[i] + 16, host_link_crc32(0, headers[i], 92));
+    }
+}
+
+static int sd_formatter_create_gpt(format_plan_t* fp, uint32_t start_lba,
+                                   uint32_t size_sectors, const char* name) {
+    write_plan_t* plan = &fp->plan;
+    uint32_t total_sectors = fp->total_sectors;
+    static const uint8_t basic_data_guid[16] = {
+        0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,
+        0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7
+    };
+
+    uint32_t last_lba = total_sectors - 1;
+    uint32_t backup_entries_lba = last_lba - SD_FORMATTER_GPT_SECTORS;
+    uint32_t last_usable = backup_entries_lba - 1;
+    if (start_lba + size_sectors - 1 > last_usable) {
+        printf("Partition overlaps the backup GPT area\n");
         return -1;
     }
-    
-    // Wipe first few sectors (MBR, GPT header, etc.)
-    uint8_t zero_buffer[512] = {0};
-    
-    printf("Clearing partition tables and boot sectors...\n");
-    
-    // Write functionality not implemented yet
-    printf("Warning: sd_write_block not implemented yet\n");
-    
-    // For now, just simulate the process
-    printf("Simulating wipe of first 64 sectors...\n");
-    for (int i = 0; i < 64; i++) {
-        printf("\rClearing sector %d/64", i + 1);
-        sleep_ms(10); // Simulate write time
+
+    // Protective MBR covering the whole card
+    uint8_t* mbr = write_plan_alloc_sector(plan);
+    uint8_t* entries = write_plan_alloc_sector(plan);
+    uint8_t* primary = write_plan_alloc_sector(plan);
+    uint8_t* backup = write_plan_alloc_sector(plan);
+    if (!mbr || !entries || !primary || !backup) {
+        return -1;
     }
-    printf("\nWipe simulation complete\n");
-    
-    return 0;
+
+    sd_formatter_mbr_entry(mbr + 446, 0xEE, 1, last_lba);
+    mbr[446 + 1] = 0x00; mbr[446 + 2] = 0x02; mbr[446 + 3] = 0x00;
+    mbr[510] = 0x55;
+    mbr[511] = 0xAA;
+
+    // Single basic data partition; the remaining 127 entries stay zero
+    memcpy(entries, basic_data_guid, 16);
+    le64_put(entries + 32, start_lba);
+    le64_put(entries + 40, (uint64_t)start_lba + size_sectors - 1);
+    for (int i = 0; i < 36 && name[i]; i++) {
+        le16_put(entries + 56 + i * 2, (uint8_t)name[i]);
+    }
+
+    memcpy(primary, "EFI PART", 8);
+    le32_put(primary + 8, 0x00010000);
+    le32_put(primary + 12, 92);
+    le64_put(primary + 24, 1);
+    le64_put(primary + 32, last_lba);
+    le64_put(primary + 40, 2 + SD_FORMATTER_GPT_SECTORS);
+    le64_put(primary + 48, last_usable);
+    le64_put(primary + 72, 2);
+    le32_put(primary + 80, 128);
+    le32_put(primary + 84, 128);
+
+    memcpy(backup, primary, 92);
+    le64_put(backup + 24, last_lba);
+    le64_put(backup + 32, 1);
+    le64_put(backup + 72, backup_entries_lba);
+
+    // GUIDs and CRCs are filled in by sd_formatter_stamp_ids()
+    fp->mbr = mbr;
+    fp->gpt_entries = entries;
+    fp->gpt_primary = primary;
+    fp->gpt_backup = backup;
+
+    write_plan_add_data(plan, 0, 1, mbr, "protective MBR");
+    write_plan_add_data(plan, 1, 1, primary, "GPT header");
+    write_plan_add_zero(plan, 2, SD_FORMATTER_GPT_SECTORS, "GPT entries");
+    write_plan_add_data(plan, 2, 1, entries, "GPT entries");
+    write_plan_add_zero(plan, backup_entries_lba, SD_FORMATTER_GPT_SECTORS, "backup GPT entries");
+    write_plan_add_data(plan, backup_entries_lba, 1, entries, "backup GPT entries");
+    write_plan_add_data(plan, last_lba, 1, backup, "backup GPT header");
+    return plan->overflow ? -1 : 0;
 }
 
-int sd_formatter_create_partition_table(partition_table_type_t type, uint32_t total_sectors) {
+int sd_formatter_create_partition_table(format_plan_t* fp, partition_table_type_t type,
+                                        uint32_t start_lba, uint32_t size_sectors,
+                                        filesystem_type_t fs_type) {
+    write_plan_t* plan = &fp->plan;
+
     printf("\nCreating %s partition table...\n", 
            sd_formatter_get_partition_table_name(type));
     
     if (type == PARTITION_TABLE_MBR) {
         printf("Creating MBR with single partition covering full card\n");
-        // MBR creation logic would go here
+        uint8_t* mbr = write_plan_alloc_sector(plan);
+        if (!mbr) return -1;
+
+        sd_formatter_mbr_entry(mbr + 446, sd_formatter_mbr_type(fs_type), start_lba, size_sectors);
+        mbr[510] = 0x55;
+        mbr[511] = 0xAA;
+        write_plan_add_data(plan, 0, 1, mbr, "MBR");
+        fp->mbr = mbr;
         
     } else if (type == PARTITION_TABLE_GPT) {
         printf("Creating GPT with single partition covering full card\n");
-        // GPT creation logic would go here
+        if (sd_formatter_create_gpt(fp, start_lba, size_sectors,
+                                    sd_formatter_get_filesystem_name(fs_type)) != 0) {
+            return -1;
+        }
         
     } else {
         return -1;
     }
     
-    printf("Partition table creation simulated\n");
-    return 0;
+    printf("Partition table: partition at LBA %u, %u sectors\n", start_lba, size_sectors);
+    return plan->overflow ? -1 : 0;
+}
+
+// Pick cluster size and FAT size so the cluster count lands in the range
+// that defines the requested FAT variant
+static int sd_formatter_fat_layout(filesystem_type_t fs_type, uint32_t start_lba,
+                                   uint32_t size_sectors, fat_layout_t* layout) {
+    uint32_t bits;
+    uint32_t min_clusters;
+    uint32_t max_clusters;
+    uint32_t spc;
+
+    memset(layout, 0, sizeof(*layout));
+
+    switch (fs_type) {
+        case FILESYSTEM_FAT12:
+            layout->type = FAT_TYPE_12;
+            bits = 12; min_clusters = 1; max_clusters = 4084;
+            layout->reserved_sectors = 1;
+            layout->root_entries = 512;
+            spc = 1;
+            break;
+        case FILESYSTEM_FAT16:
+            layout->type = FAT_TYPE_16;
+            bits = 16; min_clusters = 4085; max_clusters = 65524;
+            layout->reserved_sectors = 1;
+            layout->root_entries = 512;
+            spc = size_sectors < 32680 ? 2 : size_sectors < 262144 ? 4 :
+                  size_sectors < 524288 ? 8 : size_sectors < 1048576 ? 16 :
+                  size_sectors < 2097152 ? 32 : 64;
+            break;
+        case FILESYSTEM_FAT32:
+            layout->type = FAT_TYPE_32;
+            bits = 32; min_clusters = 65525; max_clusters = 0x0FFFFFF5;
+            layout->reserved_sectors = 32;
+            layout->root_entries = 0;
+            spc = size_sectors < 532480 ? 1 : size_sectors < 16777216 ? 8 :
+                  size_sectors < 33554432 ? 16 : size_sectors < 67108864 ? 32 : 64;
+            break;
+        default:
+            return -1;
+    }
+
+    uint32_t root_sectors = (uint32_t)layout->root_entries * 32 / SD_BLOCK_SIZE;
+
+    for (int attempt = 0; attempt < 8; attempt++) {
+        // Fixed point: the FAT must hold an entry for every cluster it leaves room for
+        uint32_t fat_size = 1;
+        uint32_t clusters = 0;
+        for (int i = 0; i < 8; i++) {
+            uint32_t meta = layout->reserved_sectors + 2 * fat_size + root_sectors;
+            if (meta >= size_sectors) return -1;
+            clusters = (size_sectors - meta) / spc;
+            uint32_t needed = (uint32_t)(((uint64_t)(clusters + 2) * bits + 8 * SD_BLOCK_SIZE - 1) /
+                                         (8 * SD_BLOCK_SIZE));
+            if (needed <= fat_size) break;
+            fat_size = needed;
+        }
+
+        // FAT32: pad the reserved area so clusters align with the card's pages
+        uint16_t reserved = layout->reserved_sectors;
+        if (layout->type == FAT_TYPE_32) {
+            uint32_t misalign = (start_lba + reserved + 2 * fat_size) % spc;
+            if (misalign) reserved += spc - misalign;
+        }
+
+        uint32_t meta = reserved + 2 * fat_size + root_sectors;
+        if (meta >= size_sectors) return -1;
+        clusters = (size_sectors - meta) / spc;
+
+        if (clusters < min_clusters && spc > 1) {
+            spc /= 2;
+        } else if (clusters > max_clusters && spc < 128) {
+            spc *= 2;
+        } else if (clusters < min_clusters || clusters > max_clusters) {
+            return -1;
+        } else {
+            layout->sectors_per_cluster = (uint8_t)spc;
+            layout->reserved_sectors = reserved;
+            layout->fat_size = fat_size;
+            layout->cluster_count = clusters;
+            layout->data_offset = meta;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void sd_formatter_build_boot_sector(uint8_t* bs, const fat_layout_t* layout, uint32_t start_lba,
+                                           uint32_t size_sectors, const char label[11]) {
+    bool fat32 = (layout->type == FAT_TYPE_32);
+    uint32_t code_offset = fat32 ? 0x5A : 0x3E;
+
+    bs[0] = 0xEB;
+    bs[1] = (uint8_t)(code_offset - 2);
+    bs[2] = 0x90;
+    memcpy(bs + 3, "MSWIN4.1", 8);
+    le16_put(bs + 11, SD_BLOCK_SIZE);
+    bs[13] = layout->sectors_per_cluster;
+    le16_put(bs + 14, layout->reserved_sectors);
+    bs[16] = 2;
+    le16_put(bs + 17, layout->root_entries);
+    if (!fat32 && size_sectors < 65536) {
+        le16_put(bs + 19, (uint16_t)size_sectors);
+    } else {
+        le32_put(bs + 32, size_sectors);
+    }
+    bs[21] = 0xF8;
+    if (!fat32) {
+        le16_put(bs + 22, (uint16_t)layout->fat_size);
+    }
+    le16_put(bs + 24, 63);
+    le16_put(bs + 26, 255);
+    le32_put(bs + 28, start_lba);
+
+    uint8_t* ext = bs + 36;
+    if (fat32) {
+        le32_put(bs + 36, layout->fat_size);
+        le32_put(bs + 44, FAT_FIRST_CLUSTER);   // Root directory cluster
+        le16_put(bs + 48, 1);                   // FSInfo sector
+        le16_put(bs + 50, 6);                   // Backup boot sector
+        ext = bs + 64;
+    }
+    ext[0] = 0x80;
+    ext[2] = 0x29;      // Volume serial at ext + 3 is stamped per card
+    memcpy(ext + 7, label, 11);
+    memcpy(ext + 18, fat32 ? "FAT32   " : (layout->type == FAT_TYPE_16 ? "FAT16   " : "FAT12   "), 8);
+
+    // Not bootable: INT 18h hands control back to the BIOS
+    bs[code_offset] = 0xCD;
+    bs[code_offset + 1] = 0x18;
+    bs[510] = 0x55;
+    bs[511] = 0xAA;
 }
 
-int sd_formatter_format_partition(uint32_t start_lba, uint32_t size_sectors, 
-                                 filesystem_type_t fs_type, const char* volume_label) {
+int sd_formatter_format_partition(format_plan_t* fp, uint32_t start_lba, uint32_t size_sectors,
+                                  filesystem_type_t fs_type, const char* volume_label,
+                                  bool quick_format) {
+    write_plan_t* plan = &fp->plan;
+
     printf("\nFormatting partition at LBA %u (%.2f MB) as %s...\n",
            start_lba, 
            (size_sectors * 512.0) / (1024 * 1024),
@@ -202,27 +758,156 @@ int sd_formatter_format_partition(uint32_t start_lba, uint32_t size_sectors,
     
     printf("Volume label: %s\n", volume_label);
     
-    if (fs_type == FILESYSTEM_FAT32) {
-        printf("Creating FAT32 boot sector...\n");
-        printf("Initializing File Allocation Tables...\n");
-        printf("Creating root directory...\n");
-        
-    } else if (fs_type == FILESYSTEM_FAT16) {
-        printf("Creating FAT16 boot sector...\n");
-        printf("Initializing File Allocation Tables...\n");
-        printf("Creating root directory...\n");
-        
-    } else if (fs_type == FILESYSTEM_EXFAT) {
-        printf("Creating exFAT boot sector...\n");
-        printf("Initializing File Allocation Table...\n");
-        printf("Creating root directory cluster...\n");
-        
-    } else {
+    if (fs_type == FILESYSTEM_EXFAT) {
+        printf("exFAT creation not implemented yet\n");
         return -1;
     }
-    
-    printf("Filesystem creation simulated\n");
-    return 0;
+
+    fat_layout_t layout;
+    if (sd_formatter_fat_layout(fs_type, start_lba, size_sectors, &layout) != 0) {
+        printf("Partition size does not suit %s\n", sd_formatter_get_filesystem_name(fs_type));
+        return -1;
+    }
+    printf("Layout: %u sectors/cluster, %u clusters, FAT %u sectors, %u reserved\n",
+           layout.sectors_per_cluster, layout.cluster_count, layout.fat_size, layout.reserved_sectors);
+
+    char label[11];
+    sd_formatter_fat_label(volume_label, label);
+
+    uint32_t fat_lba = start_lba + layout.reserved_sectors;
+    uint32_t data_lba = start_lba + layout.data_offset;
+    uint32_t root_lba = fat_lba + 2 * layout.fat_size;
+    uint32_t root_sectors = (layout.type == FAT_TYPE_32)
+                            ? layout.sectors_per_cluster
+                            : (uint32_t)layout.root_entries * 32 / SD_BLOCK_SIZE;
+    if (layout.type == FAT_TYPE_32) {
+        root_lba = data_lba;
+    }
+
+    if (!quick_format) {
+        write_plan_add_zero(plan, data_lba, start_lba + size_sectors - data_lba, "data area");
+    }
+
+    printf("Creating %s boot sector...\n", fat_volume_type_name(layout.type));
+    uint8_t* boot = write_plan_alloc_sector(plan);
+    if (!boot) return -1;
+    sd_formatter_build_boot_sector(boot, &layout, start_lba, size_sectors, label);
+    fp->boot_sector = boot;
+    fp->boot_serial_offset = (layout.type == FAT_TYPE_32) ? 67 : 39;
+
+    write_plan_add_zero(plan, start_lba, layout.reserved_sectors, "reserved sectors");
+    write_plan_add_data(plan, start_lba, 1, boot, "boot sector");
+
+    if (layout.type == FAT_TYPE_32) {
+        uint8_t* fsinfo = write_plan_alloc_sector(plan);
+        if (!fsinfo) return -1;
+        le32_put(fsinfo + 0, 0x41615252);
+        le32_put(fsinfo + 484, 0x61417272);
+        le32_put(fsinfo + 488, layout.cluster_count - 1);    // Root uses one cluster
+        le32_put(fsinfo + 492, FAT_FIRST_CLUSTER + 1);
+        le32_put(fsinfo + 508, 0xAA550000);
+
+        write_plan_add_data(plan, start_lba + 1, 1, fsinfo, "FSInfo");
+        write_plan_add_data(plan, start_lba + 6, 1, boot, "backup boot sector");
+        write_plan_add_data(plan, start_lba + 7, 1, fsinfo, "backup FSInfo");
+    }
+
+    printf("Initializing File Allocation Tables...\n");
+    uint8_t* fat_head = write_plan_alloc_sector(plan);
+    if (!fat_head) return -1;
+    switch (layout.type) {
+        case FAT_TYPE_12:
+            fat_head[0] = 0xF8; fat_head[1] = 0xFF; fat_head[2] = 0xFF;
+            break;
+        case FAT_TYPE_16:
+            le16_put(fat_head, 0xFFF8);
+            le16_put(fat_head + 2, 0xFFFF);
+            break;
+        default:
+            le32_put(fat_head, 0x0FFFFFF8);
+            le32_put(fat_head + 4, 0x0FFFFFFF);
+            le32_put(fat_head + 8, 0x0FFFFFFF);     // Root directory chain end
+            break;
+    }
+    for (int i = 0; i < 2; i++) {
+        uint32_t lba = fat_lba + i * layout.fat_size;
+        write_plan_add_zero(plan, lba, layout.fat_size, i == 0 ? "FAT 1" : "FAT 2");
+        write_plan_add_data(plan, lba, 1, fat_head, i == 0 ? "FAT 1 head" : "FAT 2 head");
+    }
+
+    printf("Creating root directory...\n");
+    uint8_t* root = write_plan_alloc_sector(plan);
+    if (!root) return -1;
+    memcpy(root, label, 11);
+    root[11] = 0x08;    // ATTR_VOLUME_ID
+    write_plan_add_zero(plan, root_lba, root_sectors, "root directory");
+    write_plan_add_data(plan, root_lba, 1, root, "volume label entry");
+
+    return plan->overflow ? -1 : 0;
+}
+
+void sd_formatter_plan_init(format_plan_t* fp, uint32_t total_sectors) {
+    memset(fp, 0, sizeof(*fp));
+    write_plan_init(&fp->plan);
+    fp->total_sectors = total_sectors;
+}
+
+int sd_formatter_build_plan(format_plan_t* fp, const format_options_t* options,
+                            uint32_t total_sectors, uint32_t au_sectors) {
+    sd_formatter_plan_init(fp, total_sectors);
+    fp->au_sectors = au_sectors;
+
+    // Start the partition on an allocation unit boundary (at least 1 MiB)
+    uint32_t start = SD_FORMATTER_PARTITION_START;
+    if (au_sectors > start) {
+        start = au_sectors;
+    }
+    if (total_sectors <= start + SD_FORMATTER_TAIL_RESERVE) {
+        printf("Card too small to partition\n");
+        return -1;
+    }
+    fp->partition_start = start;
+    fp->partition_size = total_sectors - start - SD_FORMATTER_TAIL_RESERVE;
+
+    printf("Step 1: Wiping existing data...\n");
+    if (sd_formatter_wipe_card(fp) != 0) {
+        printf("Failed to wipe SD card\n");
+        return -1;
+    }
+
+    printf("\nStep 2: Creating partition table...\n");
+    if (sd_formatter_create_partition_table(fp, options->partition_table,
+                                            fp->partition_start, fp->partition_size,
+                                            options->filesystem) != 0) {
+        printf("Failed to create partition table\n");
+        return -1;
+    }
+
+    printf("\nStep 3: Formatting filesystem...\n");
+    if (sd_formatter_format_partition(fp, fp->partition_start, fp->partition_size,
+                                      options->filesystem, options->volume_label,
+                                      options->quick_format) != 0) {
+        printf("Failed to format partition\n");
+        return -1;
+    }
+
+    return fp->plan.overflow ? -1 : 0;
+}
+
+void sd_formatter_stamp_ids(format_plan_t* fp, const uint8_t cid[16]) {
+    if (fp->gpt_primary) {
+        sd_formatter_make_guid(fp->gpt_entries + 16, cid, 0x50415254);     // "PART"
+        sd_formatter_make_guid(fp->gpt_primary + 56, cid, 0x4449534B);     // "DISK"
+        memcpy(fp->gpt_backup + 56, fp->gpt_primary + 56, 16);
+        sd_formatter_seal_gpt(fp);
+    } else if (fp->mbr) {
+        le32_put(fp->mbr + 440, sd_formatter_card_seed(cid, 0x4D425200));  // Disk signature
+    }
+
+    if (fp->boot_sector) {
+        le32_put(fp->boot_sector + fp->boot_serial_offset,
+                 sd_formatter_card_seed(cid, fp->partition_start));
+    }
 }
 
 const char* sd_formatter_get_partition_table_name(partition_table_type_t type) {
@@ -254,5 +939,9 @@ void sd_formatter_print_format_summary(const format_options_t* options,
            sd_formatter_get_filesystem_name(options->filesystem));
     printf("Volume label: %s\n", options->volume_label);
     printf("Quick format: %s\n", options->quick_format ? "Yes" : "No");
+    printf("Backup dump: %s\n", options->backup_before_format ? "Yes" : "No");
+    printf("Secure erase: %s\n", secure_erase_mode_name(options->secure_erase));
+    printf("Resume interrupted erase: %s\n", options->resume_secure_erase ? "Yes" : "No");
+    printf("Mode: %s\n", options->dry_run ? "Dry run (no writes)" : "WRITE");
     printf("======================\n");
 }
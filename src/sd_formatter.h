@@ -2,6 +2,8 @@
 #define SD_FORMATTER_H
 
 #include "sd_analyzer.h"
+#include "write_plan.h"
+#include "secure_erase.h"
 
 // Partition table types
 typedef enum {
@@ -24,16 +26,60 @@ typedef struct {
     char volume_label[12];
     bool quick_format;
     bool confirm_format;
+    bool backup_before_format;  // Stream used contents to the host before wiping
+    bool dry_run;               // Report what would change without writing
+    secure_erase_mode_t secure_erase;   // Overwrite the whole card before formatting
+    bool resume_secure_erase;   // Continue an erase interrupted on this card first
 } format_options_t;
 
+// Partition placement used by the formatter
+#define SD_FORMATTER_PARTITION_START 2048   // 1 MiB alignment
+#define SD_FORMATTER_TAIL_RESERVE    1024   // Room for the backup GPT
+
 // SD formatter functions
 int sd_formatter_show_card_content(void);
+
+// Card summary and partition list for slot 0, read through sd_block so the
+// card is only identified once. Filesystem names use pico-sd-lib's spelling
+// ("FAT32", "exFAT", "ext4"); read_partitions returns the count or -1.
+int sd_formatter_get_info(sd_analysis_t* analysis);
+int sd_formatter_read_partitions(const sd_analysis_t* analysis, partition_info_t* partitions, int max);
 bool sd_formatter_confirm_format(const sd_analysis_t* analysis);
 int sd_formatter_get_format_options(format_options_t* options);
-int sd_formatter_wipe_card(void);
-int sd_formatter_create_partition_table(partition_table_type_t type, uint32_t total_sectors);
-int sd_formatter_format_partition(uint32_t start_lba, uint32_t size_sectors, 
-                                 filesystem_type_t fs_type, const char* volume_label);
+
+// A complete format compiled for one card geometry. Identifier fields
+// (disk signature, GUIDs, volume serial) are stamped separately so the
+// plan can be reused for every card of the same capacity. The pointers
+// refer into plan.arena, so a format_plan_t must not be copied.
+typedef struct {
+    write_plan_t plan;
+    uint32_t total_sectors;
+    uint32_t au_sectors;
+    uint32_t partition_start;
+    uint32_t partition_size;
+    uint8_t* mbr;                   // MBR or protective MBR
+    uint8_t* gpt_primary;
+    uint8_t* gpt_backup;
+    uint8_t* gpt_entries;
+    uint8_t* boot_sector;
+    uint16_t boot_serial_offset;
+} format_plan_t;
+
+void sd_formatter_plan_init(format_plan_t* fp, uint32_t total_sectors);
+
+// Wipe, partition and format steps in one call (au_sectors may be 0)
+int sd_formatter_build_plan(format_plan_t* fp, const format_options_t* options,
+                            uint32_t total_sectors, uint32_t au_sectors);
+void sd_formatter_stamp_ids(format_plan_t* fp, const uint8_t cid[16]);
+
+// Plan builders: each adds its sectors to the write plan (later steps win)
+int sd_formatter_wipe_card(format_plan_t* fp);
+int sd_formatter_create_partition_table(format_plan_t* fp, partition_table_type_t type,
+                                        uint32_t start_lba, uint32_t size_sectors,
+                                        filesystem_type_t fs_type);
+int sd_formatter_format_partition(format_plan_t* fp, uint32_t start_lba, uint32_t size_sectors,
+                                  filesystem_type_t fs_type, const char* volume_label,
+                                  bool quick_format);
 
 // Utility functions
 const char* sd_formatter_get_partition_table_name(partition_table_type_t type);
@@ -0,0 +1,466 @@
+#include "secure_erase.h"
+#include "checkpoint.h"
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "pico/util/queue.h"
+#include <stdio.h>
+#include <string.h>
+
+// Double buffering: core 1 fills one buffer while core 0 writes the other
+#define SECURE_ERASE_BUFFERS 2
+#define SECURE_ERASE_CHUNK_BYTES (SECURE_ERASE_CHUNK_BLOCKS * SD_BLOCK_SIZE)
+#define SECURE_ERASE_PROGRESS_STEPS 10
+
+// Checkpoint parameters
+#define ERASE_PARAM_MODE        0
+#define ERASE_PARAM_SEED        1
+#define ERASE_PARAM_PASS        2   // Index into the mode's sequence
+#define ERASE_PARAM_MISMATCHES  3   // Verify pass, blocks found so far
+
+// CSD command classes: class 5 (erase) is CCC bit 5, i.e. CSD bit 89
+#define SD_CSD_CCC_ERASE_BYTE 4
+#define SD_CSD_CCC_ERASE_MASK 0x02
+
+typedef struct {
+    int count;
+    secure_erase_pass_t passes[SECURE_ERASE_MAX_PASSES];
+} erase_sequence_t;
+
+static const erase_sequence_t erase_sequences[] = {
+    [SECURE_ERASE_NONE]       = { 0, { SECURE_ERASE_PASS_ZERO } },
+    [SECURE_ERASE_ZERO]       = { 2, { SECURE_ERASE_PASS_ZERO, SECURE_ERASE_PASS_VERIFY } },
+    [SECURE_ERASE_RANDOM]     = { 2, { SECURE_ERASE_PASS_RANDOM, SECURE_ERASE_PASS_VERIFY } },
+    [SECURE_ERASE_THREE_PASS] = { 4, { SECURE_ERASE_PASS_ZERO, SECURE_ERASE_PASS_ONES,
+                                       SECURE_ERASE_PASS_RANDOM, SECURE_ERASE_PASS_VERIFY } },
+    [SECURE_ERASE_CARD]       = { 2, { SECURE_ERASE_PASS_CARD_ERASE, SECURE_ERASE_PASS_VERIFY } },
+};
+
+// What the card should hold after a pass, for the verify pass
+typedef struct {
+    bool random;
+    uint8_t fill;
+} erase_pattern_t;
+
+typedef struct {
+    uint32_t s[4];
+} xoshiro128_t;
+
+// Where the running erase checkpoints to
+typedef struct {
+    bool enabled;
+    checkpoint_t cp;
+    uint64_t saved_us;
+} erase_job_t;
+
+static uint32_t erase_buffers[SECURE_ERASE_BUFFERS][SECURE_ERASE_CHUNK_BYTES / 4];
+static uint8_t verify_buffer[SECURE_ERASE_CHUNK_BYTES];
+static uint8_t pattern_block[SD_BLOCK_SIZE];
+static queue_t erase_free_queue;
+static queue_t erase_full_queue;
+static erase_job_t erase_job;
+
+// Owned by core 1 while the generator runs
+static xoshiro128_t generator;
+static uint32_t generator_seed;
+static uint32_t generator_first_chunk;
+static uint32_t generator_chunks;
+
+static inline uint32_t rotl32(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+// splitmix32 spreads the seed over the whole state (never all zero)
+static void xoshiro128_seed(xoshiro128_t* g, uint32_t seed) {
+    for (int i = 0; i < 4; i++) {
+        seed += 0x9E3779B9;
+        uint32_t z = seed;
+        z = (z ^ (z >> 16)) * 0x85EBCA6B;
+        z = (z ^ (z >> 13)) * 0xC2B2AE35;
+        g->s[i] = z ^ (z >> 16);
+    }
+}
+
+// xoshiro128**: shifts, xors and two single-cycle multiplies per word on the
+// M0+, an order of magnitude faster than the SPI bus can take the data.
+// The state stays in registers for the whole buffer.
+static void xoshiro128_fill(xoshiro128_t* g, uint32_t* out, uint32_t words) {
+    uint32_t s0 = g->s[0], s1 = g->s[1], s2 = g->s[2], s3 = g->s[3];
+    for (uint32_t i = 0; i < words; i++) {
+        out[i] = rotl32(s1 * 5, 7) * 9;
+        uint32_t t = s1 << 9;
+        s2 ^= s0;
+        s3 ^= s1;
+        s1 ^= s2;
+        s0 ^= s3;
+        s2 ^= t;
+        s3 = rotl32(s3, 11);
+    }
+    g->s[0] = s0;
+    g->s[1] = s1;
+    g->s[2] = s2;
+    g->s[3] = s3;
+}
+
+static void secure_erase_core1_entry(void) {
+    // Checkpoint saves hold this core off while they program flash
+    multicore_lockout_victim_init();
+
+    for (uint32_t chunk = generator_first_chunk; chunk < generator_chunks; chunk++) {
+        uint8_t index;
+        queue_remove_blocking(&erase_free_queue, &index);
+        // Each chunk starts from its own point of the splitmix32 sequence, so
+        // a resumed pass can pick the stream up at any chunk
+        xoshiro128_seed(&generator, generator_seed + chunk * 4 * 0x9E3779B9);
+        xoshiro128_fill(&generator, erase_buffers[index], SECURE_ERASE_CHUNK_BYTES / 4);
+        queue_add_blocking(&erase_full_queue, &index);
+    }
+}
+
+// The stream depends only on the seed and the chunk number, so a verify
+// pass started with the same seed sees exactly what the write pass wrote
+static void secure_erase_start_generator(uint32_t seed, uint32_t first_chunk, uint32_t chunks) {
+    queue_init(&erase_free_queue, sizeof(uint8_t), SECURE_ERASE_BUFFERS + 1);
+    queue_init(&erase_full_queue, sizeof(uint8_t), SECURE_ERASE_BUFFERS + 1);
+    for (uint8_t i = 0; i < SECURE_ERASE_BUFFERS; i++) {
+        queue_add_blocking(&erase_free_queue, &i);
+    }
+    generator_seed = seed;
+    generator_first_chunk = first_chunk;
+    generator_chunks = chunks;
+
+    multicore_reset_core1();
+    multicore_launch_core1(secure_erase_core1_entry);
+}
+
+static void secure_erase_stop_generator(void) {
+    // Also stops a generator still waiting for a buffer after an error
+    multicore_reset_core1();
+    queue_free(&erase_full_queue);
+    queue_free(&erase_free_queue);
+}
+
+// Record progress in flash at most every SECURE_ERASE_CHECKPOINT_MS, or now
+// when force is set. next_lba must be where the pass can restart.
+static void secure_erase_checkpoint(uint32_t next_lba, uint32_t mismatches, bool force) {
+    if (!erase_job.enabled) {
+        return;
+    }
+    uint64_t now = time_us_64();
+    if (!force && now - erase_job.saved_us < (uint64_t)SECURE_ERASE_CHECKPOINT_MS * 1000) {
+        return;
+    }
+    erase_job.cp.next_lba = next_lba;
+    erase_job.cp.params[ERASE_PARAM_MISMATCHES] = mismatches;
+    if (checkpoint_save(&erase_job.cp) != 0) {
+        printf("  Continuing without checkpoints\n");
+        erase_job.enabled = false;
+    }
+    erase_job.saved_us = now;
+}
+
+static void secure_erase_finish_pass(secure_erase_pass_report_t* pr, uint64_t start_us) {
+    pr->elapsed_ms = (uint32_t)((time_us_64() - start_us) / 1000);
+    pr->kib_per_s = pr->elapsed_ms ? (uint32_t)((uint64_t)pr->blocks * 1000 / 2 / pr->elapsed_ms) : 0;
+}
+
+// Write the pattern over the card, or compare the card with it,
+// from first_lba on, which must be a multiple of SECURE_ERASE_CHUNK_BLOCKS
+static int secure_erase_stream_pass(sd_block_dev_t* dev, const erase_pattern_t* pattern,
+                                    bool verify, uint32_t seed, uint32_t first_lba,
+                                    secure_erase_pass_report_t* pr) {
+    uint32_t total = sd_block_get_block_count(dev);
+    uint64_t start_us = time_us_64();
+    int status = 0;
+
+    if (pattern->random) {
+        secure_erase_start_generator(seed, first_lba / SECURE_ERASE_CHUNK_BLOCKS,
+                                     (total + SECURE_ERASE_CHUNK_BLOCKS - 1) / SECURE_ERASE_CHUNK_BLOCKS);
+    } else {
+        memset(pattern_block, pattern->fill, sizeof(pattern_block));
+    }
+
+    uint32_t next_step = (uint32_t)((uint64_t)first_lba * SECURE_ERASE_PROGRESS_STEPS / total) + 1;
+    for (uint32_t lba = first_lba; lba < total; ) {
+        uint32_t n = total - lba;
+        if (n > SECURE_ERASE_CHUNK_BLOCKS) n = SECURE_ERASE_CHUNK_BLOCKS;
+
+        uint8_t index = 0;
+        const uint8_t* data = pattern_block;
+        if (pattern->random) {
+            queue_remove_blocking(&erase_full_queue, &index);
+            data = (const uint8_t*)erase_buffers[index];
+        }
+
+        int result;
+        if (!verify) {
+            result = pattern->random ? sd_block_write_blocks(dev, lba, n, data)
+                                     : sd_block_fill_blocks(dev, lba, n, pattern_block);
+        } else {
+            result = sd_block_read_blocks(dev, lba, n, verify_buffer);
+            for (uint32_t i = 0; result == 0 && i < n; i++) {
+                const uint8_t* want = pattern->random ? data + i * SD_BLOCK_SIZE : pattern_block;
+                if (memcmp(verify_buffer + i * SD_BLOCK_SIZE, want, SD_BLOCK_SIZE) != 0) {
+                    if (pr->mismatched_blocks++ == 0) {
+                        printf("  First mismatch at LBA %u\n", lba + i);
+                    }
+                }
+            }
+        }
+
+        if (pattern->random) {
+            queue_add_blocking(&erase_free_queue, &index);
+        }
+        if (result != 0) {
+            printf("  %s failed at LBA %u\n", verify ? "Read" : "Write", lba);
+            status = -1;
+            break;
+        }
+
+        lba += n;
+        pr->blocks += n;
+        if ((uint64_t)lba * SECURE_ERASE_PROGRESS_STEPS >= (uint64_t)next_step * total) {
+            secure_erase_finish_pass(pr, start_us);
+            printf("  %3u%% (%u KiB/s)\n", next_step * 100 / SECURE_ERASE_PROGRESS_STEPS, pr->kib_per_s);
+            next_step++;
+        }
+        secure_erase_checkpoint(lba, pr->mismatched_blocks, false);
+    }
+
+    if (pattern->random) {
+        secure_erase_stop_generator();
+    }
+    secure_erase_finish_pass(pr, start_us);
+    return (status == 0 && pr->mismatched_blocks == 0) ? 0 : -1;
+}
+
+static bool secure_erase_card_supported(sd_block_dev_t* dev) {
+    uint8_t csd[16];
+    return sd_block_read_csd(dev, csd) == 0 && (csd[SD_CSD_CCC_ERASE_BYTE] & SD_CSD_CCC_ERASE_MASK);
+}
+
+// What the card holds once the pass has completed
+static void secure_erase_pattern_after(sd_block_dev_t* dev, secure_erase_pass_t pass,
+                                       erase_pattern_t* written) {
+    written->random = (pass == SECURE_ERASE_PASS_RANDOM);
+    written->fill = (pass == SECURE_ERASE_PASS_ONES) ? 0xFF : 0x00;
+    if (pass == SECURE_ERASE_PASS_CARD_ERASE && secure_erase_card_supported(dev)) {
+        written->fill = sd_block_erase_value(dev);
+    }
+}
+
+// Erase command over the card from first_lba on, in groups that each finish
+// within the busy timeout. Cards without the erase command class get a zero pass.
+static int secure_erase_card_pass(sd_block_dev_t* dev, const erase_pattern_t* written,
+                                  uint32_t first_lba, secure_erase_pass_report_t* pr) {
+    if (!secure_erase_card_supported(dev)) {
+        printf("  Card does not support erase commands - writing zeros instead\n");
+        return secure_erase_stream_pass(dev, written, false, 0, first_lba, pr);
+    }
+
+    uint32_t total = sd_block_get_block_count(dev);
+    uint64_t start_us = time_us_64();
+    for (uint32_t lba = first_lba; lba < total; ) {
+        uint32_t n = total - lba;
+        if (n > SECURE_ERASE_ERASE_BLOCKS) n = SECURE_ERASE_ERASE_BLOCKS;
+        if (sd_block_erase_blocks(dev, lba, n) != 0) {
+            printf("  Erase failed at LBA %u\n", lba);
+            secure_erase_finish_pass(pr, start_us);
+            return -1;
+        }
+        lba += n;
+        pr->blocks += n;
+        secure_erase_checkpoint(lba, 0, false);
+    }
+    secure_erase_finish_pass(pr, start_us);
+    return 0;
+}
+
+// Run the mode's passes from first_pass on, the first of them from first_lba
+static int secure_erase_execute(sd_block_dev_t* dev, secure_erase_mode_t mode, uint32_t seed,
+                                int first_pass, uint32_t first_lba, uint32_t mismatches,
+                                secure_erase_report_t* report) {
+    secure_erase_report_t result;
+    memset(&result, 0, sizeof(result));
+    result.seed = seed;
+
+    const erase_sequence_t* sequence = &erase_sequences[mode];
+    erase_pattern_t written = { false, 0x00 };
+    if (first_pass > 0) {
+        secure_erase_pattern_after(dev, sequence->passes[first_pass - 1], &written);
+    }
+    uint32_t total = sd_block_get_block_count(dev);
+    uint32_t lba = first_lba;
+    uint64_t start_us = time_us_64();
+
+    memset(&erase_job, 0, sizeof(erase_job));
+    erase_job.enabled = true;
+    erase_job.cp.operation = CHECKPOINT_OP_SECURE_ERASE;
+    sd_block_read_cid(dev, erase_job.cp.cid);
+    erase_job.cp.card_blocks = total;
+    erase_job.cp.params[ERASE_PARAM_MODE] = mode;
+    erase_job.cp.params[ERASE_PARAM_SEED] = seed;
+
+    printf("Secure erase (%s): %d pass(es) over %u blocks\n", secure_erase_mode_name(mode),
+           sequence->count, total);
+
+    for (int i = first_pass; i < sequence->count && result.status == 0; i++) {
+        secure_erase_pass_t pass = sequence->passes[i];
+        secure_erase_pass_report_t* pr = &result.passes[i];
+        pr->pass = pass;
+        result.pass_count = i + 1;
+
+        if (i > first_pass) lba = 0;
+        if (pass == SECURE_ERASE_PASS_VERIFY && i == first_pass) {
+            pr->mismatched_blocks = mismatches;
+        }
+        erase_job.cp.params[ERASE_PARAM_PASS] = (uint32_t)i;
+        secure_erase_checkpoint(lba, pr->mismatched_blocks, true);
+
+        if (lba > 0) {
+            printf("Pass %d/%d: %s (resumed at LBA %u)\n", i + 1, sequence->count,
+                   secure_erase_pass_name(pass), lba);
+        } else {
+            printf("Pass %d/%d: %s\n", i + 1, sequence->count, secure_erase_pass_name(pass));
+        }
+        int status;
+        if (pass != SECURE_ERASE_PASS_VERIFY) {
+            secure_erase_pattern_after(dev, pass, &written);
+        }
+        switch (pass) {
+            case SECURE_ERASE_PASS_CARD_ERASE:
+                status = secure_erase_card_pass(dev, &written, lba, pr);
+                break;
+            case SECURE_ERASE_PASS_VERIFY:
+                status = secure_erase_stream_pass(dev, &written, true, seed, lba, pr);
+                break;
+            default:
+                status = secure_erase_stream_pass(dev, &written, false, seed, lba, pr);
+                break;
+        }
+        if (status != 0) {
+            result.status = -1;
+        }
+    }
+    result.elapsed_ms = (uint32_t)((time_us_64() - start_us) / 1000);
+
+    // Once the last pass reached the end there is nothing left to resume,
+    // whatever the verify found. An I/O error keeps the checkpoint so the
+    // erase can continue on the next boot.
+    if (sequence->count == 0 || (result.pass_count == sequence->count &&
+                                 lba + result.passes[sequence->count - 1].blocks >= total)) {
+        checkpoint_clear();
+    }
+
+    for (int i = first_pass; i < result.pass_count; i++) {
+        const secure_erase_pass_report_t* pr = &result.passes[i];
+        printf("  %-10s %10u blocks %8u ms %6u KiB/s", secure_erase_pass_name(pr->pass),
+               pr->blocks, pr->elapsed_ms, pr->kib_per_s);
+        if (pr->pass == SECURE_ERASE_PASS_VERIFY) {
+            printf("  %u mismatched block(s)", pr->mismatched_blocks);
+        }
+        printf("\n");
+    }
+    printf("Secure erase %s (%u ms)\n", result.status == 0 ? "complete" : "FAILED", result.elapsed_ms);
+
+    if (report) *report = result;
+    return result.status;
+}
+
+int secure_erase_run(sd_block_dev_t* dev, secure_erase_mode_t mode, uint32_t seed,
+                     secure_erase_report_t* report) {
+    if ((int)mode < 0 || mode > SECURE_ERASE_CARD ||
+        (!sd_block_is_attached(dev) && sd_block_attach(dev) != 0)) {
+        if (report) {
+            memset(report, 0, sizeof(*report));
+            report->seed = seed;
+            report->status = -1;
+        }
+        return -1;
+    }
+    return secure_erase_execute(dev, mode, seed, 0, 0, 0, report);
+}
+
+// Load the checkpoint of an erase interrupted on this card; a checkpoint for
+// another card is kept and an unusable one discarded
+static bool secure_erase_load_pending(sd_block_dev_t* dev, checkpoint_t* cp) {
+    if (!checkpoint_load(cp) || cp->operation != CHECKPOINT_OP_SECURE_ERASE) {
+        return false;
+    }
+    if (!sd_block_is_attached(dev) && sd_block_attach(dev) != 0) {
+        return false;
+    }
+
+    uint8_t cid[16] = {0};
+    sd_block_read_cid(dev, cid);
+    if (!checkpoint_matches_card(cp, cid, sd_block_get_block_count(dev))) {
+        printf("Interrupted secure erase found for another card - keeping it for that card\n");
+        return false;
+    }
+
+    secure_erase_mode_t mode = (secure_erase_mode_t)cp->params[ERASE_PARAM_MODE];
+    if (mode <= SECURE_ERASE_NONE || mode > SECURE_ERASE_CARD ||
+        (int)cp->params[ERASE_PARAM_PASS] >= erase_sequences[mode].count ||
+        cp->next_lba > cp->card_blocks) {
+        printf("Discarding unusable secure erase checkpoint\n");
+        checkpoint_clear();
+        return false;
+    }
+    return true;
+}
+
+bool secure_erase_find_pending(sd_block_dev_t* dev, secure_erase_pending_t* pending) {
+    checkpoint_t cp;
+    if (!secure_erase_load_pending(dev, &cp)) {
+        return false;
+    }
+
+    secure_erase_pending_t found;
+    found.mode = (secure_erase_mode_t)cp.params[ERASE_PARAM_MODE];
+    found.pass = (int)cp.params[ERASE_PARAM_PASS];
+    found.pass_count = erase_sequences[found.mode].count;
+    found.next_lba = cp.next_lba;
+    found.card_blocks = cp.card_blocks;
+
+    printf("\nInterrupted secure erase (%s) found for this card: pass %d/%d, %s, at LBA %u of %u\n",
+           secure_erase_mode_name(found.mode), found.pass + 1, found.pass_count,
+           secure_erase_pass_name(erase_sequences[found.mode].passes[found.pass]),
+           found.next_lba, found.card_blocks);
+
+    if (pending) *pending = found;
+    return true;
+}
+
+int secure_erase_resume_pending(sd_block_dev_t* dev, secure_erase_report_t* report) {
+    checkpoint_t cp;
+    if (!secure_erase_load_pending(dev, &cp)) {
+        return 0;
+    }
+
+    printf("Resuming interrupted secure erase at LBA %u\n", cp.next_lba);
+    int status = secure_erase_execute(dev, (secure_erase_mode_t)cp.params[ERASE_PARAM_MODE],
+                                      cp.params[ERASE_PARAM_SEED], (int)cp.params[ERASE_PARAM_PASS],
+                                      cp.next_lba, cp.params[ERASE_PARAM_MISMATCHES], report);
+    return status == 0 ? 1 : -1;
+}
+
+const char* secure_erase_mode_name(secure_erase_mode_t mode) {
+    switch (mode) {
+        case SECURE_ERASE_NONE: return "none";
+        case SECURE_ERASE_ZERO: return "zero";
+        case SECURE_ERASE_RANDOM: return "random";
+        case SECURE_ERASE_THREE_PASS: return "three-pass";
+        case SECURE_ERASE_CARD: return "card erase";
+        default: return "unknown";
+    }
+}
+
+const char* secure_erase_pass_name(secure_erase_pass_t pass) {
+    switch (pass) {
+        case SECURE_ERASE_PASS_ZERO: return "zero";
+        case SECURE_ERASE_PASS_ONES: return "ones";
+        case SECURE_ERASE_PASS_RANDOM: return "random";
+        case SECURE_ERASE_PASS_CARD_ERASE: return "card erase";
+        case SECURE_ERASE_PASS_VERIFY: return "verify";
+        default: return "unknown";
+    }
+}
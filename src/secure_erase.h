@@ -0,0 +1,90 @@
+#ifndef SECURE_ERASE_H
+#define SECURE_ERASE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sd_block.h"
+
+// Whole-card overwrite before formatting. A mode is a fixed sequence of
+// passes; every pass covers the full card with multi-block transfers.
+// Random data comes from a seeded xoshiro128** generator on core 1, which
+// fills one buffer while core 0 writes the other, so random passes run at
+// the SPI rate like the fixed patterns do. The verify pass regenerates the
+// same stream from the seed instead of storing anything.
+//
+// Progress is checkpointed to flash (see checkpoint.h) at every pass start
+// and every SECURE_ERASE_CHECKPOINT_MS, so an erase cut short by a power
+// loss or USB reset continues from its last checkpoint on the next boot.
+
+typedef enum {
+    SECURE_ERASE_NONE = 0,
+    SECURE_ERASE_ZERO = 1,          // 0x00, verify
+    SECURE_ERASE_RANDOM = 2,        // Random, verify
+    SECURE_ERASE_THREE_PASS = 3,    // 0x00, 0xFF, random, verify
+    SECURE_ERASE_CARD = 4           // Card erase command, verify
+} secure_erase_mode_t;
+
+typedef enum {
+    SECURE_ERASE_PASS_ZERO = 0,
+    SECURE_ERASE_PASS_ONES,
+    SECURE_ERASE_PASS_RANDOM,
+    SECURE_ERASE_PASS_CARD_ERASE,   // CMD32/33/38; falls back to a zero pass
+    SECURE_ERASE_PASS_VERIFY        // Read back what the previous pass wrote
+} secure_erase_pass_t;
+
+#define SECURE_ERASE_MAX_PASSES 4
+
+// Blocks per multi-block write, and per generator buffer
+#define SECURE_ERASE_CHUNK_BLOCKS 32
+
+// Blocks per erase command, so each stays within the busy timeout
+#define SECURE_ERASE_ERASE_BLOCKS (64u * 1024)
+
+// Flash endurance: about 100k erases per sector, 16 saves per erase and
+// CHECKPOINT_FLASH_SECTORS sectors allow years of continuous erasing
+#define SECURE_ERASE_CHECKPOINT_MS 60000
+
+typedef struct {
+    secure_erase_pass_t pass;
+    uint32_t blocks;
+    uint32_t elapsed_ms;
+    uint32_t kib_per_s;
+    uint32_t mismatched_blocks;     // Verify pass only
+} secure_erase_pass_report_t;
+
+typedef struct {
+    int32_t status;                 // 0 when every pass completed and verified
+    uint32_t seed;
+    int pass_count;
+    secure_erase_pass_report_t passes[SECURE_ERASE_MAX_PASSES];
+    uint32_t elapsed_ms;
+} secure_erase_report_t;
+
+// Run every pass of the mode over the whole card in the slot. seed selects
+// the random stream (e.g. derived from the time); report may be NULL.
+int secure_erase_run(sd_block_dev_t* dev, secure_erase_mode_t mode, uint32_t seed,
+                     secure_erase_report_t* report);
+
+typedef struct {
+    secure_erase_mode_t mode;
+    int pass;                       // Pass the erase stopped in, from 0
+    int pass_count;
+    uint32_t next_lba;
+    uint32_t card_blocks;
+} secure_erase_pending_t;
+
+// Report an erase interrupted on this card without touching the card.
+// Returns false when none is pending for it (a checkpoint for another card
+// is kept); pending may be NULL.
+bool secure_erase_find_pending(sd_block_dev_t* dev, secure_erase_pending_t* pending);
+
+// Continue an erase interrupted on this card. Only call this once the
+// operator has chosen to resume it. Returns 1 when one was resumed and
+// completed, 0 when none is pending for the card and -1 when the resumed
+// erase failed.
+int secure_erase_resume_pending(sd_block_dev_t* dev, secure_erase_report_t* report);
+
+const char* secure_erase_mode_name(secure_erase_mode_t mode);
+const char* secure_erase_pass_name(secure_erase_pass_t pass);
+
+#endif // SECURE_ERASE_H
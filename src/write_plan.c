@@ -0,0 +1,254 @@
+#include "write_plan.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+#include <string.h>
+
+// Sectors compared per multi-block read
+#define WRITE_PLAN_CHUNK_SECTORS 16
+
+// One compare buffer per slot so both slots can execute plans concurrently
+static uint8_t plan_buffers[SD_BLOCK_SLOTS][WRITE_PLAN_CHUNK_SECTORS * SD_BLOCK_SIZE];
+static uint8_t zero_block[SD_BLOCK_SIZE];
+
+void write_plan_init(write_plan_t* plan) {
+    plan->count = 0;
+    plan->overflow = false;
+    plan->arena_used = 0;
+}
+
+uint8_t* write_plan_alloc_sector(write_plan_t* plan) {
+    if (plan->arena_used >= WRITE_PLAN_ARENA_SECTORS) {
+        plan->overflow = true;
+        return NULL;
+    }
+    uint8_t* sector = plan->arena[plan->arena_used++];
+    memset(sector, 0, SD_BLOCK_SIZE);
+    return sector;
+}
+
+static int write_plan_insert(write_plan_t* plan, int index, const write_extent_t* extent) {
+    if (plan->count >= WRITE_PLAN_MAX_EXTENTS) {
+        plan->overflow = true;
+        return -1;
+    }
+    memmove(&plan->extents[index + 1], &plan->extents[index],
+            (plan->count - index) * sizeof(write_extent_t));
+    plan->extents[index] = *extent;
+    plan->count++;
+    return 0;
+}
+
+// Trim existing extents so that [lba, end) is free, keeping the list sorted
+static int write_plan_carve(write_plan_t* plan, uint32_t lba, uint32_t end) {
+    for (int i = 0; i < plan->count; i++) {
+        write_extent_t* e = &plan->extents[i];
+        uint32_t e_end = e->lba + e->count;
+        if (e_end <= lba || e->lba >= end) continue;
+
+        bool keep_left = e->lba < lba;
+        bool keep_right = e_end > end;
+
+        if (keep_left && keep_right) {
+            write_extent_t right = *e;
+            right.lba = end;
+            right.count = e_end - end;
+            if (right.kind == WRITE_EXTENT_DATA) {
+                right.data = e->data + (size_t)(end - e->lba) * SD_BLOCK_SIZE;
+            }
+            e->count = lba - e->lba;
+            return write_plan_insert(plan, i + 1, &right);
+        }
+
+        if (keep_left) {
+            e->count = lba - e->lba;
+        } else if (keep_right) {
+            if (e->kind == WRITE_EXTENT_DATA) {
+                e->data += (size_t)(end - e->lba) * SD_BLOCK_SIZE;
+            }
+            e->count = e_end - end;
+            e->lba = end;
+        } else {
+            memmove(&plan->extents[i], &plan->extents[i + 1],
+                    (plan->count - i - 1) * sizeof(write_extent_t));
+            plan->count--;
+            i--;
+        }
+    }
+    return 0;
+}
+
+static int write_plan_add(write_plan_t* plan, const write_extent_t* extent) {
+    if (extent->count == 0) return 0;
+    if (write_plan_carve(plan, extent->lba, extent->lba + extent->count) != 0) {
+        return -1;
+    }
+
+    int index = 0;
+    while (index < plan->count && plan->extents[index].lba < extent->lba) {
+        index++;
+    }
+    return write_plan_insert(plan, index, extent);
+}
+
+int write_plan_add_data(write_plan_t* plan, uint32_t lba, uint32_t count,
+                        const uint8_t* data, const char* label) {
+    if (!data) {
+        plan->overflow = true;
+        return -1;
+    }
+    write_extent_t extent = { lba, count, WRITE_EXTENT_DATA, data, label };
+    return write_plan_add(plan, &extent);
+}
+
+int write_plan_add_zero(write_plan_t* plan, uint32_t lba, uint32_t count, const char* label) {
+    write_extent_t extent = { lba, count, WRITE_EXTENT_ZERO, NULL, label };
+    return write_plan_add(plan, &extent);
+}
+
+void write_plan_print(const write_plan_t* plan) {
+    printf("Write plan: %d extents%s\n", plan->count, plan->overflow ? " (INCOMPLETE)" : "");
+    for (int i = 0; i < plan->count; i++) {
+        const write_extent_t* e = &plan->extents[i];
+        printf("  LBA %10u +%-8u %-4s %s\n", e->lba, e->count,
+               e->kind == WRITE_EXTENT_DATA ? "data" : "zero", e->label);
+    }
+}
+
+// Compare one extent against the card and rewrite the differing runs
+static int write_plan_apply_extent(sd_block_dev_t* dev, const write_extent_t* e, bool dry_run,
+                                   write_plan_report_t* report) {
+    uint8_t* plan_buffer = plan_buffers[dev->index];
+    uint32_t differing = 0;
+
+    for (uint32_t done = 0; done < e->count; ) {
+        uint32_t n = e->count - done;
+        if (n > WRITE_PLAN_CHUNK_SECTORS) n = WRITE_PLAN_CHUNK_SECTORS;
+
+        uint32_t lba = e->lba + done;
+        if (sd_block_read_blocks(dev, lba, n, plan_buffer) != 0) {
+            printf("  Read failed at LBA %u\n", lba);
+            return -1;
+        }
+
+        uint32_t run_start = 0;
+        uint32_t run_length = 0;
+        for (uint32_t i = 0; i <= n; i++) {
+            bool differs = false;
+            if (i < n) {
+                const uint8_t* want = (e->kind == WRITE_EXTENT_DATA)
+                                      ? e->data + (size_t)(done + i) * SD_BLOCK_SIZE
+                                      : zero_block;
+                differs = memcmp(plan_buffer + i * SD_BLOCK_SIZE, want, SD_BLOCK_SIZE) != 0;
+            }
+
+            if (differs) {
+                if (run_length == 0) run_start = i;
+                run_length++;
+                continue;
+            }
+            if (run_length == 0) continue;
+
+            differing += run_length;
+            if (!dry_run) {
+                uint32_t run_lba = lba + run_start;
+                int result = (e->kind == WRITE_EXTENT_DATA)
+                    ? sd_block_write_blocks(dev, run_lba, run_length,
+                                            e->data + (size_t)(done + run_start) * SD_BLOCK_SIZE)
+                    : sd_block_fill_blocks(dev, run_lba, run_length, zero_block);
+                if (result != 0) {
+                    printf("  Write failed at LBA %u\n", run_lba);
+                    return -1;
+                }
+            }
+            run_length = 0;
+        }
+        done += n;
+    }
+
+    report->sectors_written += differing;
+    report->sectors_unchanged += e->count - differing;
+
+    printf("  LBA %10u +%-8u %-24s %u sector(s) %s\n", e->lba, e->count, e->label,
+           differing, dry_run ? "would change" : "written");
+    return 0;
+}
+
+// Length of the already-zero prefix of an extent, in sectors
+static int write_plan_zero_prefix(sd_block_dev_t* dev, const write_extent_t* e, uint32_t* clean) {
+    uint8_t* plan_buffer = plan_buffers[dev->index];
+
+    *clean = 0;
+    while (*clean < e->count) {
+        uint32_t n = e->count - *clean;
+        if (n > WRITE_PLAN_CHUNK_SECTORS) n = WRITE_PLAN_CHUNK_SECTORS;
+
+        if (sd_block_read_blocks(dev, e->lba + *clean, n, plan_buffer) != 0) {
+            printf("  Read failed at LBA %u\n", e->lba + *clean);
+            return -1;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            if (memcmp(plan_buffer + i * SD_BLOCK_SIZE, zero_block, SD_BLOCK_SIZE) != 0) {
+                *clean += i;
+                return 0;
+            }
+        }
+        *clean += n;
+    }
+    return 0;
+}
+
+int write_plan_execute(const write_plan_t* plan, sd_block_dev_t* dev, bool dry_run,
+                       write_plan_report_t* report) {
+    memset(report, 0, sizeof(*report));
+
+    if (plan->overflow) {
+        printf("Write plan is incomplete - refusing to apply it\n");
+        return -1;
+    }
+    if (!sd_block_is_attached(dev) && sd_block_attach(dev) != 0) {
+        return -1;
+    }
+
+    uint64_t start_us = time_us_64();
+    bool erase_gives_zero = (sd_block_erase_value(dev) == 0x00);
+
+    printf("%s write plan on slot %u (%d extents)...\n", dry_run ? "Dry run of" : "Applying",
+           dev->index, plan->count);
+
+    for (int i = 0; i < plan->count; i++) {
+        const write_extent_t* e = &plan->extents[i];
+        report->sectors_planned += e->count;
+
+        // Large zero ranges: skip the part that is already zero, then a
+        // single erase command clears the rest faster than writing it
+        if (e->kind == WRITE_EXTENT_ZERO && e->count >= WRITE_PLAN_ERASE_THRESHOLD && erase_gives_zero) {
+            uint32_t clean;
+            if (write_plan_zero_prefix(dev, e, &clean) != 0) {
+                return -1;
+            }
+            uint32_t dirty = e->count - clean;
+            if (dirty && !dry_run && sd_block_erase_blocks(dev, e->lba + clean, dirty) != 0) {
+                printf("  Erase failed at LBA %u\n", e->lba + clean);
+                return -1;
+            }
+            report->sectors_unchanged += clean;
+            report->sectors_erased += dirty;
+            printf("  LBA %10u +%-8u %-24s %u sector(s) %s\n", e->lba, e->count, e->label,
+                   dirty, dry_run ? "would be erased" : "erased");
+            continue;
+        }
+
+        if (write_plan_apply_extent(dev, e, dry_run, report) != 0) {
+            return -1;
+        }
+    }
+
+    report->elapsed_ms = (uint32_t)((time_us_64() - start_us) / 1000);
+    printf("%s: %u sectors planned, %u unchanged, %u %s, %u %s (%u ms)\n",
+           dry_run ? "Dry run" : "Plan applied",
+           report->sectors_planned, report->sectors_unchanged,
+           report->sectors_written, dry_run ? "would be written" : "written",
+           report->sectors_erased, dry_run ? "would be erased" : "erased",
+           report->elapsed_ms);
+    return 0;
+}
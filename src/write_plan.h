@@ -0,0 +1,64 @@
+#ifndef WRITE_PLAN_H
+#define WRITE_PLAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sd_block.h"
+
+// A format operation compiled into an ordered list of disjoint extents.
+// Extents added later take precedence over earlier ones where they overlap,
+// so a caller can lay down large zero ranges first and then the metadata
+// sectors that live inside them.
+
+typedef enum {
+    WRITE_EXTENT_DATA = 0,          // Write count sectors from data
+    WRITE_EXTENT_ZERO = 1           // Sectors must read back as zero
+} write_extent_kind_t;
+
+typedef struct {
+    uint32_t lba;
+    uint32_t count;
+    write_extent_kind_t kind;
+    const uint8_t* data;
+    const char* label;
+} write_extent_t;
+
+#define WRITE_PLAN_MAX_EXTENTS  48
+#define WRITE_PLAN_ARENA_SECTORS 10
+
+// Zero extents at least this long are erased instead of compared and written
+#define WRITE_PLAN_ERASE_THRESHOLD 256
+
+typedef struct {
+    write_extent_t extents[WRITE_PLAN_MAX_EXTENTS];
+    int count;
+    bool overflow;                  // An add failed; the plan is incomplete
+    int arena_used;
+    uint8_t arena[WRITE_PLAN_ARENA_SECTORS][SD_BLOCK_SIZE];
+} write_plan_t;
+
+typedef struct {
+    uint32_t sectors_planned;
+    uint32_t sectors_unchanged;     // Already held the planned contents
+    uint32_t sectors_written;
+    uint32_t sectors_erased;
+    uint32_t elapsed_ms;
+} write_plan_report_t;
+
+void write_plan_init(write_plan_t* plan);
+
+// Zeroed sector storage owned by the plan; NULL when exhausted
+uint8_t* write_plan_alloc_sector(write_plan_t* plan);
+
+int write_plan_add_data(write_plan_t* plan, uint32_t lba, uint32_t count,
+                        const uint8_t* data, const char* label);
+int write_plan_add_zero(write_plan_t* plan, uint32_t lba, uint32_t count, const char* label);
+
+void write_plan_print(const write_plan_t* plan);
+
+// Compare each extent with the card in the slot and only write sectors that differ.
+// With dry_run nothing is written; the report shows what would change.
+int write_plan_execute(const write_plan_t* plan, sd_block_dev_t* dev, bool dry_run,
+                       write_plan_report_t* report);
+
+#endif // WRITE_PLAN_H
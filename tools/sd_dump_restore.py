@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+"""Rebuild a card image from a captured backup dump.
+
+The firmware streams the dump (record layout in src/sd_dump.h) over the
+USB serial port, interleaved with console text. Capture the port to a file,
+or read it directly with --port (requires pyserial), then:
+
+    sd_dump_restore.py capture.bin card.img
+    sd_dump_restore.py --port /dev/ttyACM0 card.img
+
+The image is created at the card's full size; blocks that no record covers
+were unallocated or all zero and read back as zeros (the file is sparse
+where the platform allows). Write it back with e.g. dd.
+"""
+
+import argparse
+import struct
+import sys
+import zlib
+
+MAGIC = b"SD"
+BLOCK_SIZE = 512
+CHUNK_BLOCKS = 16
+SUPPORTED_VERSION = 2
+
+RECORD_BEGIN = 1
+RECORD_DATA = 2
+RECORD_END = 3
+
+ENC_RAW = 0
+ENC_LZ4 = 1
+
+HEADER = struct.Struct("<2sBBIHHII")    # magic, kind, encoding, lba, block_count, zero_mask, payload_len, crc
+BEGIN = struct.Struct("<II16s")
+STATS = struct.Struct("<i6I")
+MAX_PAYLOAD = CHUNK_BLOCKS * BLOCK_SIZE
+
+
+class DumpError(Exception):
+    pass
+
+
+def lz4_decompress(src, size):
+    """Decode one LZ4 block whose decompressed size is known."""
+    out = bytearray()
+    i = 0
+    while i < len(src):
+        token = src[i]
+        i += 1
+        literal_len = token >> 4
+        if literal_len == 15:
+            while True:
+                b = src[i]
+                i += 1
+                literal_len += b
+                if b != 255:
+                    break
+        out += src[i:i + literal_len]
+        i += literal_len
+        if i >= len(src):
+            break
+        offset = src[i] | (src[i + 1] << 8)
+        i += 2
+        if offset == 0 or offset > len(out):
+            raise DumpError("bad LZ4 match offset")
+        match_len = token & 0x0F
+        if match_len == 15:
+            while True:
+                b = src[i]
+                i += 1
+                match_len += b
+                if b != 255:
+                    break
+        match_len += 4
+        start = len(out) - offset
+        for k in range(match_len):      # Matches may overlap their own output
+            out.append(out[start + k])
+    if len(out) != size:
+        raise DumpError("LZ4 block decoded to %d bytes, expected %d" % (len(out), size))
+    return bytes(out)
+
+
+class Records:
+    """Yield (kind, encoding, lba, block_count, zero_mask, payload) from a byte stream.
+
+    Console text and damaged records are skipped by rescanning for the magic
+    one byte past every candidate whose CRC does not match.
+    """
+
+    def __init__(self, read):
+        self.read = read
+        self.buffer = bytearray()
+        self.skipped = 0
+
+    def _fill(self, n):
+        while len(self.buffer) < n:
+            data = self.read(65536)
+            if not data:
+                return False
+            self.buffer += data
+        return True
+
+    def __iter__(self):
+        while True:
+            start = self.buffer.find(MAGIC)
+            if start < 0:
+                keep = 1 if self.buffer.endswith(MAGIC[:1]) else 0
+                self.skipped += len(self.buffer) - keep
+                del self.buffer[:len(self.buffer) - keep]
+                if not self._fill(len(self.buffer) + 1):
+                    return
+                continue
+            self.skipped += start
+            del self.buffer[:start]
+            if not self._fill(HEADER.size):
+                return
+            _, kind, encoding, lba, count, zero_mask, length, crc = HEADER.unpack_from(self.buffer)
+            if length > MAX_PAYLOAD:
+                del self.buffer[:1]
+                self.skipped += 1
+                continue
+            if not self._fill(HEADER.size + length):
+                return
+            payload = bytes(self.buffer[HEADER.size:HEADER.size + length])
+            if zlib.crc32(payload, zlib.crc32(bytes(self.buffer[:16]))) != crc:
+                del self.buffer[:1]
+                self.skipped += 1
+                continue
+            del self.buffer[:HEADER.size + length]
+            yield kind, encoding, lba, count, zero_mask, payload
+
+
+def restore(read, image_path):
+    begin = None
+    stats = None
+    blocks_written = 0
+    with open(image_path, "wb") as image:
+        records = Records(read)
+        for kind, encoding, lba, count, zero_mask, payload in records:
+            if kind == RECORD_BEGIN:
+                version, card_blocks, cid = BEGIN.unpack_from(payload)
+                if version != SUPPORTED_VERSION:
+                    raise DumpError("dump version %d, this tool reads version %d" %
+                                    (version, SUPPORTED_VERSION))
+                begin = (card_blocks, cid)
+                image.truncate(card_blocks * BLOCK_SIZE)
+                print("Card: %u blocks, CID %s" % (card_blocks, cid.hex()))
+            elif kind == RECORD_DATA:
+                if begin is None:
+                    raise DumpError("DATA record before BEGIN - capture started too late")
+                if count == 0 or count > CHUNK_BLOCKS or lba + count > begin[0]:
+                    raise DumpError("record at LBA %u covers blocks outside the card" % lba)
+                present = [n for n in range(count) if not zero_mask & (1 << n)]
+                size = len(present) * BLOCK_SIZE
+                if encoding == ENC_LZ4:
+                    data = lz4_decompress(payload, size)
+                elif encoding == ENC_RAW:
+                    data = payload
+                else:
+                    raise DumpError("unknown encoding %d at LBA %u" % (encoding, lba))
+                if len(data) != size:
+                    raise DumpError("record at LBA %u holds %d bytes, expected %d" % (lba, len(data), size))
+                for i, n in enumerate(present):
+                    image.seek((lba + n) * BLOCK_SIZE)
+                    image.write(data[i * BLOCK_SIZE:(i + 1) * BLOCK_SIZE])
+                blocks_written += len(present)
+            elif kind == RECORD_END:
+                stats = STATS.unpack_from(payload)
+                break
+    if begin is None:
+        raise DumpError("no BEGIN record found")
+    if stats is None:
+        raise DumpError("stream ended before the END record - image is incomplete")
+
+    status, scanned, unallocated, zero, sent, bytes_sent, elapsed_ms = stats
+    print("Restored %u blocks (%u scanned, %u unallocated, %u zero; %u bytes in %u ms)" %
+          (blocks_written, scanned, unallocated, zero, bytes_sent, elapsed_ms))
+    if records.skipped:
+        print("Skipped %u bytes of console text or damaged records" % records.skipped)
+    if blocks_written != sent:
+        raise DumpError("the dump sent %u blocks but only %u were received intact" % (sent, blocks_written))
+    if status != 0:
+        raise DumpError("the firmware reported the dump as failed (status %d)" % status)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Rebuild a card image from a backup dump stream")
+    parser.add_argument("capture", nargs="?", help="captured stream, '-' for stdin")
+    parser.add_argument("image", help="card image to create")
+    parser.add_argument("--port", help="read the dump live from this USB serial device")
+    args = parser.parse_args()
+
+    try:
+        if args.port:
+            import serial
+            with serial.Serial(args.port, 115200, timeout=30) as port:
+                restore(port.read, args.image)
+        elif args.capture == "-":
+            restore(sys.stdin.buffer.read, args.image)
+        elif args.capture:
+            with open(args.capture, "rb") as f:
+                restore(f.read, args.image)
+        else:
+            parser.error("give a capture file or --port")
+    except DumpError as e:
+        print("error: %s" % e, file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
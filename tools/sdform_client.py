@@ -0,0 +1,338 @@
+#!/usr/bin/env python3
+"""Reference host client for the formatter's binary protocol.
+
+The frame layout, commands and payload structures are described in
+src/host_command.h; the firmware must be built with SDFORMATTER_HOST_MODE.
+
+    sdform_client.py /dev/ttyACM0 info
+    sdform_client.py /dev/ttyACM0 options --fs fat32 --label CAM01 --write
+    sdform_client.py /dev/ttyACM0 format
+    sdform_client.py /dev/ttyACM0 verify
+    sdform_client.py /dev/ttyACM0 resume-erase
+    sdform_client.py /dev/ttyACM0 read 0 2048 head.img
+    sdform_client.py /dev/ttyACM0 write 2048 patch.img
+    sdform_client.py /dev/ttyACM0 trace
+
+Only the command line needs pyserial; Client works on any object with
+read(n) and write(data).
+"""
+
+import argparse
+import random
+import struct
+import sys
+import time
+import zlib
+
+MAGIC = b"SC"
+VERSION = 1
+BLOCK_SIZE = 512
+MAX_BLOCKS = 8
+RESPONSE = 0x80
+
+CMD_GET_INFO = 0x01
+CMD_SET_OPTIONS = 0x02
+CMD_FORMAT = 0x03
+CMD_VERIFY = 0x04
+CMD_READ = 0x05
+CMD_WRITE = 0x06
+CMD_FETCH_TRACE = 0x07
+CMD_RESUME_ERASE = 0x08
+
+COMMAND_NAMES = {
+    CMD_GET_INFO: "get-info", CMD_SET_OPTIONS: "set-options", CMD_FORMAT: "format",
+    CMD_VERIFY: "verify", CMD_READ: "read", CMD_WRITE: "write", CMD_FETCH_TRACE: "fetch-trace",
+    CMD_RESUME_ERASE: "resume-erase",
+}
+
+STATUS_OK = 0
+STATUS_BAD_CRC = 1
+STATUS_MISMATCH = 6
+STATUS_NAMES = ["ok", "bad crc", "bad command", "bad argument", "no card", "i/o error", "mismatch"]
+
+HEADER = struct.Struct("<2sBBHHI")      # magic, command, status, sequence, payload_len, crc
+INFO = struct.Struct("<HHIII16sBB2x")
+OPTIONS = struct.Struct("<BBBBB3x12s")
+EXTENT = struct.Struct("<IHH")
+REPORT = struct.Struct("<5I")
+TRACE = struct.Struct("<II")
+TRACE_ENTRY = struct.Struct("<IHBBII")
+
+PARTITION_TABLES = {"mbr": 0, "gpt": 1}
+FILESYSTEMS = {"fat12": 0, "fat16": 1, "fat32": 2}      # The firmware cannot build exFAT yet
+SECURE_ERASE_MODES = {"none": 0, "zero": 1, "random": 2, "three-pass": 3, "card": 4}
+ERASE_MODE_NAMES = {value: name for name, value in SECURE_ERASE_MODES.items()}
+
+# FORMAT may include a secure erase of the whole card
+FORMAT_TIMEOUT = 24 * 3600.0
+
+
+class ProtocolError(Exception):
+    pass
+
+
+class CommandError(Exception):
+    def __init__(self, command, status, payload):
+        name = STATUS_NAMES[status] if status < len(STATUS_NAMES) else "status %d" % status
+        super().__init__("%s failed: %s" % (COMMAND_NAMES.get(command, hex(command)), name))
+        self.status = status
+        self.payload = payload
+
+
+def frame(command, sequence, payload=b"", status=0):
+    head = HEADER.pack(MAGIC, command, status, sequence, len(payload), 0)[:8]
+    return head + struct.pack("<I", zlib.crc32(head + payload)) + payload
+
+
+def parse_report(payload):
+    keys = ("sectors_planned", "sectors_unchanged", "sectors_written", "sectors_erased", "elapsed_ms")
+    return dict(zip(keys, REPORT.unpack(payload)))
+
+
+class Client:
+    def __init__(self, port, timeout=5.0, retries=3):
+        self.port = port
+        self.timeout = timeout
+        self.retries = retries
+        # The firmware resends its last response to a request with the same
+        # sequence and CRC; a random start keeps a new run from matching the
+        # last request of the previous one
+        self.sequence = random.randrange(0x10000)
+        self.buffer = bytearray()
+
+    def _read(self, deadline):
+        data = self.port.read(max(1, getattr(self.port, "in_waiting", 0) or 1))
+        if data:
+            self.buffer += data
+        elif time.monotonic() > deadline:
+            raise TimeoutError("no response from the formatter")
+
+    def send(self, command, payload=b""):
+        """Queue a request without waiting; returns its sequence number."""
+        self.sequence = (self.sequence + 1) & 0xFFFF
+        self.port.write(frame(command, self.sequence, payload))
+        return self.sequence
+
+    def receive(self, timeout=None):
+        """Next good frame as (command, status, sequence, payload).
+
+        Console text and damaged frames are skipped by rescanning for the
+        magic one byte past every candidate that fails its CRC.
+        """
+        deadline = time.monotonic() + (self.timeout if timeout is None else timeout)
+        while True:
+            start = self.buffer.find(MAGIC)
+            if start < 0:
+                del self.buffer[:max(0, len(self.buffer) - 1)]
+                self._read(deadline)
+                continue
+            del self.buffer[:start]
+            if len(self.buffer) < HEADER.size:
+                self._read(deadline)
+                continue
+            _, command, status, sequence, length, crc = HEADER.unpack_from(self.buffer)
+            if length > BLOCK_SIZE * MAX_BLOCKS + 8:
+                del self.buffer[:1]
+                continue
+            if len(self.buffer) < HEADER.size + length:
+                self._read(deadline)
+                continue
+            payload = bytes(self.buffer[HEADER.size:HEADER.size + length])
+            if zlib.crc32(bytes(self.buffer[:8]) + payload) != crc:
+                del self.buffer[:1]
+                continue
+            del self.buffer[:HEADER.size + length]
+            return command, status, sequence, payload
+
+    def call(self, command, payload=b"", timeout=None):
+        """Send one request and wait for its response.
+
+        A lost response is recovered by resending the request with the same
+        sequence number: the firmware replays its last response instead of
+        running the command again.
+        """
+        sequence = self.send(command, payload)
+        for attempt in range(self.retries + 1):
+            try:
+                while True:
+                    r_command, status, r_sequence, r_payload = self.receive(timeout)
+                    if status == STATUS_BAD_CRC:
+                        break
+                    if r_sequence == sequence and r_command == command | RESPONSE:
+                        if status != STATUS_OK:
+                            raise CommandError(command, status, r_payload)
+                        return r_payload
+            except TimeoutError:
+                if attempt == self.retries:
+                    raise
+            self.port.write(frame(command, sequence, payload))
+        raise ProtocolError("%s: request kept arriving damaged" % COMMAND_NAMES[command])
+
+    def pipeline(self, requests, window=4, timeout=None):
+        """Run (command, payload) requests with up to window in flight.
+
+        Only for idempotent requests (READ, WRITE): after a damaged frame or
+        a timeout every outstanding request is sent again.
+        """
+        results = [None] * len(requests)
+        pending = {}
+        next_index = 0
+        retries = 0
+        while next_index < len(requests) or pending:
+            while next_index < len(requests) and len(pending) < window:
+                command, payload = requests[next_index]
+                pending[self.send(command, payload)] = next_index
+                next_index += 1
+            try:
+                r_command, status, r_sequence, r_payload = self.receive(timeout)
+            except TimeoutError:
+                if retries == self.retries:
+                    raise
+                status = STATUS_BAD_CRC
+            if status == STATUS_BAD_CRC:
+                retries += 1
+                for sequence, index in pending.items():
+                    command, payload = requests[index]
+                    self.port.write(frame(command, sequence, payload))
+                continue
+            retries = 0
+            index = pending.pop(r_sequence, None)
+            if index is None:
+                continue
+            command = requests[index][0]
+            if status != STATUS_OK:
+                raise CommandError(command, status, r_payload)
+            results[index] = r_payload
+        return results
+
+    def get_info(self):
+        version, max_payload, blocks, au, ready_us, cid, erase_value, erase_pending = \
+            INFO.unpack(self.call(CMD_GET_INFO))
+        if version != VERSION:
+            raise ProtocolError("firmware speaks protocol v%d, client v%d" % (version, VERSION))
+        return {"version": version, "max_payload": max_payload, "card_blocks": blocks,
+                "au_sectors": au, "ready_us": ready_us, "cid": cid.hex(), "erase_value": erase_value,
+                "erase_pending": ERASE_MODE_NAMES.get(erase_pending, erase_pending)}
+
+    def set_options(self, partition_table="mbr", filesystem="fat32", label="SDCARD",
+                    quick_format=True, dry_run=True, secure_erase="none"):
+        payload = OPTIONS.pack(PARTITION_TABLES[partition_table], FILESYSTEMS[filesystem],
+                               int(quick_format), int(dry_run), SECURE_ERASE_MODES[secure_erase],
+                               label.encode("ascii")[:11].ljust(12, b"\0"))
+        table, fs, quick, dry, erase, label_bytes = OPTIONS.unpack(self.call(CMD_SET_OPTIONS, payload))
+        return {"partition_table": table, "filesystem": fs, "quick_format": bool(quick),
+                "dry_run": bool(dry), "secure_erase": erase,
+                "label": label_bytes.split(b"\0")[0].decode("ascii", "replace")}
+
+    def format(self, timeout=FORMAT_TIMEOUT):
+        return parse_report(self.call(CMD_FORMAT, timeout=timeout))
+
+    def verify(self, timeout=600.0):
+        """Dry run of the format; raises CommandError (status mismatch) on differences."""
+        return parse_report(self.call(CMD_VERIFY, timeout=timeout))
+
+    def resume_erase(self, timeout=FORMAT_TIMEOUT):
+        """Continue the secure erase reported in get_info()["erase_pending"]; needs dry run cleared."""
+        self.call(CMD_RESUME_ERASE, timeout=timeout)
+
+    def read(self, lba, count, window=4):
+        requests = [(CMD_READ, EXTENT.pack(first, min(MAX_BLOCKS, lba + count - first), 0))
+                    for first in range(lba, lba + count, MAX_BLOCKS)]
+        return b"".join(self.pipeline(requests, window))
+
+    def write(self, lba, data, window=4):
+        """Write whole blocks at lba; needs dry run cleared (set_options(dry_run=False))."""
+        if len(data) % BLOCK_SIZE:
+            raise ValueError("data must be whole %d-byte blocks" % BLOCK_SIZE)
+        chunk = MAX_BLOCKS * BLOCK_SIZE
+        requests = [(CMD_WRITE, EXTENT.pack(lba + offset // BLOCK_SIZE,
+                                            len(data[offset:offset + chunk]) // BLOCK_SIZE, 0) +
+                     data[offset:offset + chunk])
+                    for offset in range(0, len(data), chunk)]
+        self.pipeline(requests, window)
+
+    def fetch_trace(self, first=0):
+        payload = self.call(CMD_FETCH_TRACE, struct.pack("<I", first))
+        next_index, count = TRACE.unpack_from(payload)
+        entries = []
+        for i in range(count):
+            time_ms, sequence, command, status, lba, elapsed_us = \
+                TRACE_ENTRY.unpack_from(payload, TRACE.size + i * TRACE_ENTRY.size)
+            entries.append({"time_ms": time_ms, "sequence": sequence, "command": command,
+                            "status": status, "lba": lba, "elapsed_us": elapsed_us})
+        return next_index, entries
+
+
+def print_report(report):
+    print("%(sectors_planned)u planned, %(sectors_unchanged)u unchanged, %(sectors_written)u written, "
+          "%(sectors_erased)u erased (%(elapsed_ms)u ms)" % report)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Drive the SD card formatter over its binary protocol")
+    parser.add_argument("port", help="USB serial device, e.g. /dev/ttyACM0 or COM5")
+    parser.add_argument("--timeout", type=float, default=5.0)
+    sub = parser.add_subparsers(dest="command", required=True)
+    sub.add_parser("info")
+    opt = sub.add_parser("options")
+    opt.add_argument("--table", choices=PARTITION_TABLES, default="mbr")
+    opt.add_argument("--fs", choices=FILESYSTEMS, default="fat32")
+    opt.add_argument("--label", default="SDCARD")
+    opt.add_argument("--full", action="store_true", help="full format instead of quick")
+    opt.add_argument("--erase", choices=SECURE_ERASE_MODES, default="none")
+    opt.add_argument("--write", action="store_true", help="clear dry run: FORMAT and WRITE write the card")
+    sub.add_parser("format")
+    sub.add_parser("verify")
+    sub.add_parser("resume-erase", help="continue an interrupted secure erase (after options --write)")
+    rd = sub.add_parser("read")
+    rd.add_argument("lba", type=int)
+    rd.add_argument("count", type=int)
+    rd.add_argument("output")
+    wr = sub.add_parser("write")
+    wr.add_argument("lba", type=int)
+    wr.add_argument("input")
+    tr = sub.add_parser("trace")
+    tr.add_argument("--first", type=int, default=0)
+    args = parser.parse_args()
+
+    import serial
+    with serial.Serial(args.port, 115200, timeout=0.05) as port:
+        client = Client(port, timeout=args.timeout)
+        try:
+            if args.command == "info":
+                for key, value in client.get_info().items():
+                    print("%-12s %s" % (key, value))
+            elif args.command == "options":
+                print(client.set_options(args.table, args.fs, args.label, not args.full,
+                                         not args.write, args.erase))
+            elif args.command == "format":
+                print_report(client.format())
+            elif args.command == "verify":
+                print_report(client.verify())
+                print("card matches the format")
+            elif args.command == "resume-erase":
+                client.resume_erase()
+                print("secure erase completed")
+            elif args.command == "read":
+                with open(args.output, "wb") as f:
+                    f.write(client.read(args.lba, args.count))
+            elif args.command == "write":
+                with open(args.input, "rb") as f:
+                    client.write(args.lba, f.read())
+            elif args.command == "trace":
+                next_index, entries = client.fetch_trace(args.first)
+                for i, e in enumerate(entries, next_index - len(entries)):
+                    print("%5d %10u ms  seq %5u  %-12s %-12s lba %10u %8u us" % (
+                        i, e["time_ms"], e["sequence"], COMMAND_NAMES.get(e["command"], hex(e["command"])),
+                        STATUS_NAMES[e["status"]] if e["status"] < len(STATUS_NAMES) else e["status"],
+                        e["lba"], e["elapsed_us"]))
+        except CommandError as e:
+            if e.status == STATUS_MISMATCH:
+                print_report(parse_report(e.payload))
+            print(e, file=sys.stderr)
+            return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())